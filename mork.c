@@ -2,32 +2,202 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <time.h>
 #include "parseMork.h"
 
+// Row filter for --where, keeps the rows that have the column
+int rowHasColumn( void *arg, morkDb *mork, morkId tableScope, morkId tableId,
+		morkId rowScope, morkId rowId, morkCells *cells ) {
+	int i;
+	for( i = 0; i < cells->cnt; ++i ) {
+		const char *column = getColumn( mork, cells->entries[i].key );
+		if( column && strcmp( column, (const char *) arg ) == 0 )
+			return 1;
+	}
+	return 0;
+}
+
+// What --progress and --timeout want of the progress calls
+typedef struct {
+	int	show;		// Show how far the parse has got
+	int	timeout;	// Seconds, 0 for no limit
+	time_t	deadline;	// When the parse of this file is stopped
+} progressWanted;
+// Progress callback, stops the parse once the time is up
+int showProgress( void *arg, const morkProgress *progress ) {
+	progressWanted *want = (progressWanted *) arg;
+	if( want->show ) {
+		if( progress->total ) {
+			fprintf( stderr, "\r%3d%% parsed, %lld rows",
+				(int) (progress->bytes * 100 / progress->total), progress->rows );
+		} else {
+			fprintf( stderr, "\r%lld bytes parsed, %lld rows",
+				progress->bytes, progress->rows );
+		}
+		if( progress->done )	fprintf( stderr, "\n" );
+	}
+	if( want->deadline && time( NULL ) >= want->deadline ) {
+		fprintf( stderr, "%serror: parse stopped after %d seconds at byte %lld\n",
+			want->show ? "\n" : "", want->timeout, progress->bytes );
+		return 0;
+	}
+	return 1;
+}
+
 void usage() {
 	fprintf( stderr, "usage: mork [-v] [-V vCardFileName] abook.mab\n" );
+	fprintf( stderr, " --bloom file     : Write a Bloom filter of the e-mail addresses of all the files\n" );
+	fprintf( stderr, " --check file addr: Check whether the address may be in a Bloom filter file\n" );
+	fprintf( stderr, " --columnar file  : Write the rows to a binary columnar file\n" );
+	fprintf( stderr, " --columns a,b,c  : Only load these columns of the rows\n" );
+	fprintf( stderr, " --count          : Only count the dictionary entries, rows and cells\n" );
+	fprintf( stderr, " --csv            : Write the rows as CSV\n" );
+	fprintf( stderr, " --dense          : Add the dense row layout for faster field look ups\n" );
+	fprintf( stderr, " --json           : Write the rows as JSON Lines\n" );
+	fprintf( stderr, " --pipeline       : Write the -V vCards on another thread while parsing\n" );
+	fprintf( stderr, " --presize        : Count the file first and size the arrays to fit\n" );
+	fprintf( stderr, " --progress       : Show how far the parse has got\n" );
+	fprintf( stderr, " --recover file   : Skip past errors, writing what was skipped to the file\n" );
+	fprintf( stderr, " --serve sock     : Answer look ups in the files that follow on the socket until stopped\n" );
+	fprintf( stderr, " --table id:scope : Only parse the rows of this table\n" );
+	fprintf( stderr, " --timeout secs   : Stop parsing a file after this many seconds\n" );
+	fprintf( stderr, " --where column   : Only load the rows that have the column\n" );
+	fprintf( stderr, " -D oldFileName   : List the changes from the old file\n" );
 	fprintf( stderr, " -g               : Do not parse groups\n" );
+	fprintf( stderr, " -i               : Only write vCards changed since the last -i run\n" );
+	fprintf( stderr, " -m               : Report memory usage\n" );
+	fprintf( stderr, " -M vCardFileName : Merge the cards of all the files into one vCard file\n" );
 	fprintf( stderr, " -v               : Verbose\n" );
 	fprintf( stderr, " -V vCardFileName : write vCards to the file\n" );
 }
 
 int main( int argc, char **argv ) {
 	char *vCardFile = (char *) 0;
+	char *diffFile = (char *) 0;
+	int memoryReport = 0;
+	int incremental = 0;
+	int json = 0;
+	int csv = 0;
+	int countOnly = 0;
+	int pipeline = 0;
+	int dense = 0;
+	char *columnarFile = (char *) 0;
+	morkParseOptions options;
+	progressWanted progress;
+	char *mergeFile = (char *) 0;
+	char *bloomFile = (char *) 0;
+	FILE *recoverfp = (FILE *) 0;
+	int lazyTable = 0;
+	morkId tableScope = 0, tableId = 0;
+	const char **mergeNames;
+	int mergeCnt = 0;
 	char *arg;
 	int i;
 	morkDb *mork;
 	//morkLogfp = stdout;
 	morkLogfp = 0;
 	morkErrfp = stderr;
+	memset( &options, 0, sizeof(options) );
+	memset( &progress, 0, sizeof(progress) );
+	mergeNames = calloc( argc, sizeof(*mergeNames) );
 	for( i = 1; i < argc; ++i ) {
 		arg = argv[i];
 		switch( *arg ) {
 		case '-':	// Options
 			++arg;
 			switch( *arg ) {
+			case '-':	// Long options
+				if( strcmp( arg, "-json" ) == 0 ) {
+					json = 1;
+				} else if( strcmp( arg, "-csv" ) == 0 ) {
+					csv = 1;
+				} else if( strcmp( arg, "-count" ) == 0 ) {
+					countOnly = 1;
+				} else if( strcmp( arg, "-pipeline" ) == 0 ) {
+					pipeline = 1;
+				} else if( strcmp( arg, "-dense" ) == 0 ) {
+					dense = 1;
+				} else if( strcmp( arg, "-presize" ) == 0 ) {
+					options.presize = 1;
+				} else if( strcmp( arg, "-progress" ) == 0 ) {
+					progress.show = 1;
+					options.progress = showProgress;
+					options.progressArg = &progress;
+				} else if( strcmp( arg, "-recover" ) == 0 && i + 1 < argc ) {
+					// The skips of all the files go in one report
+					options.recover = 1;
+					recoverfp = fopen( argv[++i], "w" );
+					if( !recoverfp ) {
+						fprintf( stderr, "error: unable to write file \"%s\"\n", argv[i] );
+						return -1;
+					}
+				} else if( strcmp( arg, "-timeout" ) == 0 && i + 1 < argc ) {
+					progress.timeout = atoi( argv[++i] );
+					options.progress = showProgress;
+					options.progressArg = &progress;
+				} else if( strcmp( arg, "-columnar" ) == 0 && i + 1 < argc ) {
+					columnarFile = argv[++i];
+				} else if( strcmp( arg, "-bloom" ) == 0 && i + 1 < argc ) {
+					bloomFile = argv[++i];
+				} else if( strcmp( arg, "-check" ) == 0 && i + 2 < argc ) {
+					// Answered from the filter alone
+					FILE *bloomfp = fopen( argv[++i], "rb" );
+					morkBloom *bloom = bloomfp ? readMorkBloomFile( bloomfp ) : (morkBloom *) 0;
+					int maybe;
+					if( bloomfp )	fclose( bloomfp );
+					if( !bloom )	return -1;
+					maybe = checkMorkBloomEmail( bloom, argv[++i] );
+					freeMorkBloom( bloom );
+					fprintf( stdout, "%s: %s\n", argv[i], maybe ? "maybe" : "no" );
+					free( mergeNames );
+					return maybe ? 0 : 1;
+				} else if( strcmp( arg, "-serve" ) == 0 && i + 2 < argc ) {
+					// The rest of the arguments are the files served
+					int served = serveMorkFiles( argv[i+1],
+						(const char **) argv + i + 2, argc - i - 2 );
+					free( mergeNames );
+					return served ? 0 : -1;
+				} else if( strcmp( arg, "-table" ) == 0 && i + 1 < argc ) {
+					// "id:scope" as Mork gives a table, the scope is
+					// the default one if left out
+					char *scope;
+					tableId = strtoll( argv[++i], &scope, 16 );
+					if( *scope == ':' && *++scope == '^' )	++scope;
+					tableScope = strtoll( scope, NULL, 16 );
+					lazyTable = 1;
+				} else if( strcmp( arg, "-where" ) == 0 && i + 1 < argc ) {
+					options.rowFilter = rowHasColumn;
+					options.rowFilterArg = argv[++i];
+				} else if( strcmp( arg, "-columns" ) == 0 && i + 1 < argc ) {
+					// Split the comma separated names in place
+					char *name = argv[++i];
+					options.columns = calloc( strlen( name ) / 2 + 2, sizeof(char *) );
+					for( options.columnCnt = 0; name; ++options.columnCnt ) {
+						options.columns[options.columnCnt] = name;
+						if( (name = strchr( name, ',' )) )	*name++ = '\0';
+					}
+				} else {
+					usage();
+					return -1;
+				}
+				break;
+			case 'D':	// Diff against an older file
+				if( !*(++arg) ) arg = argv[++i];
+				diffFile = arg;
+				break;
 			case 'g':	// Group parsing off
 				morkDoNotParseGroups = 1;
 				break;
+			case 'i':	// Incremental vCards
+				incremental = 1;
+				break;
+			case 'm':	// Memory usage
+				memoryReport = 1;
+				break;
+			case 'M':	// Merge into one vCard file
+				if( !*(++arg) ) arg = argv[++i];
+				mergeFile = arg;
+				break;
 			case 'v':	// verbose
 				morkLogfp = stdout;
 				break;
@@ -42,7 +212,91 @@ int main( int argc, char **argv ) {
 			}
 			break;
 		default:	// File name
-			mork = parseMorkFile( argv[i] );
+			// Files to merge are all loaded together at the end
+			if( mergeFile || bloomFile ) {
+				mergeNames[mergeCnt++] = argv[i];
+				break;
+			}
+			if( countOnly ) {
+				morkCounts counts;
+				if( !countMorkFile( argv[i], &counts ) )	return -1;
+				fprintf( stdout, "----- counts of %s -----\n", argv[i] );
+				dumpMorkCounts( stdout, &counts );
+				freeMorkCounts( &counts );
+				break;
+			}
+			if( progress.timeout )	progress.deadline = time( NULL ) + progress.timeout;
+			if( vCardFile && pipeline && !incremental ) {
+				// The vCards are written while the file is parsed
+				FILE *vCardfp = fopen( vCardFile, "w" );
+				if( !vCardfp ) {
+					fprintf( stderr, "error: unable to write file \"%s\"\n", vCardFile );
+					return -1;
+				}
+				mork = parseMorkFileWithVcards( argv[i], vCardfp, &options );
+				fclose( vCardfp );
+			} else if( lazyTable ) {
+				// Only the dictionaries and the one table are parsed
+				morkLazyDb *lazy = openMorkLazyFile( argv[i], &options );
+				if( lazy && !loadMorkLazyTable( lazy, tableScope, tableId ) )
+					fprintf( stderr, "warning: no table %llX:%llX in \"%s\"\n",
+						tableId, tableScope, argv[i] );
+				mork = lazy ? finishMorkLazyFile( lazy ) : (morkDb *) 0;
+			} else {
+				mork = parseMorkFileWithOptions( argv[i], &options );
+			}
+			if( !mork )	return -1;
+			if( recoverfp )	dumpMorkSkips( recoverfp, mork, argv[i] );
+			// Everything below only reads the cells
+			resolveMorkDb( mork );
+			// Another copy of the rows' value ids, for the look ups
+			// of the fields of each row
+			if( dense )	buildMorkDenseRows( mork );
+			if( memoryReport ) {
+				morkFrozenDb *frozen = freezeMorkDb( mork );
+				fprintf( stdout, "Memory usage: %lu bytes parsed, ",
+					(unsigned long) morkDbMemoryUsage( mork ) );
+				if( mork->slots ) {
+					fprintf( stdout, "%lu of them dense rows, ",
+						(unsigned long) morkDenseMemoryUsage( mork ) );
+				}
+				fprintf( stdout, "%lu bytes frozen\n",
+					(unsigned long) morkFrozenDbMemoryUsage( frozen ) );
+				freeFrozenMorkDb( frozen );
+			}
+			if( diffFile ) {
+				morkDb *old = parseMorkFile( diffFile );
+				if( !old )	return -1;
+				morkDiff *diff = diffMorkDb( old, mork );
+				fprintf( stdout, "----- changes from %s -----\n", diffFile );
+				dumpMorkDiff( stdout, old, mork, diff );
+				freeMorkDiff( diff );
+				freeMorkDb( old );
+				free( old );
+				freeMorkDb( mork );
+				free( mork );
+				break;
+			}
+			if( json ) {
+				dumpJsonLines( stdout, mork );
+				freeMorkDb( mork );
+				free( mork );
+				break;
+			}
+			if( csv || columnarFile ) {
+				morkColumnar *columnar = transposeMorkDb( mork );
+				if( csv )	dumpMorkColumnarCsv( stdout, mork, columnar );
+				if( columnarFile ) {
+					FILE *columnarfp = fopen( columnarFile, "wb" );
+					if( !columnarfp || !writeMorkColumnarFile( columnarfp, mork, columnar ) )
+						fprintf( stderr, "error: unable to write file \"%s\"\n", columnarFile );
+					if( columnarfp )	fclose( columnarfp );
+				}
+				freeMorkColumnar( columnar );
+				freeMorkDb( mork );
+				free( mork );
+				break;
+			}
 			fprintf( stdout, "\nDump of Mork Data\n" );
 			fprintf( stdout, "----- columns table -----\n" );
 			dumpMorkColumns( stdout, mork );
@@ -50,7 +304,16 @@ int main( int argc, char **argv ) {
 			dumpMorkValues( stdout, mork );
 			fprintf( stdout, "----- mork structure -----\n" );
 			dumpTableScopeMap( stdout, mork );
-			if( vCardFile ) {
+			if( vCardFile && incremental ) {
+				// Hashes are kept beside the vCard file
+				char *hashFile = malloc( strlen( vCardFile ) + 8 );
+				sprintf( hashFile, "%s.hashes", vCardFile );
+				FILE *vCardfp = fopen( vCardFile, "w" );
+				fprintf( stdout, "----- deleted vCards -----\n" );
+				dumpVcardsIncremental( vCardfp, stdout, mork, hashFile );
+				fclose( vCardfp );
+				free( hashFile );
+			} else if( vCardFile && !pipeline ) {
 				FILE *vCardfp = fopen( vCardFile, "w" );
 				dumpVcards( vCardfp, mork );
 				fclose( vCardfp );
@@ -59,5 +322,44 @@ int main( int argc, char **argv ) {
 			break;
 		}
 	}
+	if( mergeCnt && bloomFile ) {
+		morkDb **dbs = calloc( mergeCnt, sizeof(*dbs) );
+		morkBloom *bloom;
+		FILE *bloomfp;
+		for( i = 0; i < mergeCnt; ++i )
+			dbs[i] = parseMorkFileWithOptions( mergeNames[i], &options );
+		bloom = makeMorkBloomForDbs( dbs, mergeCnt, 0.01 );
+		bloomfp = fopen( bloomFile, "wb" );
+		if( !bloom || !bloomfp || !writeMorkBloomFile( bloomfp, bloom ) ) {
+			fprintf( stderr, "error: unable to write file \"%s\"\n", bloomFile );
+			return -1;
+		}
+		fclose( bloomfp );
+		fprintf( stdout, "Bloom filter of %d addresses in %llu bits\n",
+			bloom->cnt, bloom->bits );
+		freeMorkBloom( bloom );
+		for( i = 0; i < mergeCnt; ++i ) {
+			if( !dbs[i] )	continue;
+			freeMorkDb( dbs[i] );
+			free( dbs[i] );
+		}
+		free( dbs );
+	}
+	if( mergeCnt && mergeFile ) {
+		morkMerge *merge = mergeMorkFiles( mergeNames, mergeCnt );
+		FILE *vCardfp = fopen( mergeFile, "w" );
+		if( !merge || !vCardfp ) {
+			fprintf( stderr, "error: unable to write file \"%s\"\n", mergeFile );
+			return -1;
+		}
+		dumpMorkMergeVcards( vCardfp, merge );
+		fclose( vCardfp );
+		fprintf( stdout, "Merged %d cards from %d rows of %d files\n",
+			merge->cnt, merge->rowCnt, mergeCnt );
+		freeMorkMerge( merge );
+	}
+	if( recoverfp )	fclose( recoverfp );
+	free( mergeNames );
+	free( options.columns );
 	return 0;
 }
@@ -0,0 +1,224 @@
+/*-----------------------------------------------------------------------------
+ *    MorkBloom.c - Bloom filter of the e-mail addresses in address books
+ *
+ *    Asking whether an address is in any of someone's address books
+ *    is mostly answered no. makeMorkBloomForDbs() puts the normalized
+ *    (lower cased, trimmed) PrimaryEmail and SecondEmail of every row
+ *    into a Bloom filter that can be saved with writeMorkBloomFile()
+ *    and loaded again with readMorkBloomFile(). checkMorkBloomEmail()
+ *    then answers no for certain, or maybe, from the filter alone,
+ *    without the address books.
+ *
+ *    The file is, with all integers little endian:
+ *
+ *	"MORKBLM1"			magic
+ *	u32 hashes			bits set for each address
+ *	u32 cnt				addresses added
+ *	u64 bits			a power of two
+ *	u8 bitmap[bits / 8]		bit (i & 7) of byte (i >> 3) for bit i
+ *
+ ----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include "parseMork.h"
+
+#define	morkErr(...)	if( morkErrfp ) fprintf( morkErrfp, ##__VA_ARGS__ )
+
+#define	MorkBloomMagic	"MORKBLM1"
+
+// The most bits set for each address
+#define	MORKBLOOMMAXHASHES	16
+
+// The two hashes of a normalized address, the bits set are
+// a + i * b for i up to the number of hashes
+static void hashMorkBloomEmail( const char *email, unsigned long long *a, unsigned long long *b ) {
+	unsigned long long h = 0xcbf29ce484222325ULL;
+	const unsigned char *s = (const unsigned char *) email;
+	const unsigned char *end;
+	// Leave off the white space at the ends and ignore case
+	while( isspace( *s ) )	++s;
+	end = s + strlen( (const char *) s );
+	while( end > s && isspace( end[-1] ) )	--end;
+	for( ; s < end; ++s ) {
+		h ^= tolower( *s );
+		h *= 0x100000001b3ULL;
+	}
+	// Mix the bits so both hashes use all of them
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	*a = h;
+	*b = (h >> 32 | h << 32) | 1;
+}
+
+// An empty filter sized for the number of addresses and the rate of
+// false maybes wanted
+morkBloom *makeMorkBloom( int expected, double falseRate ) {
+	morkBloom		*bloom;
+	unsigned long long	bits = 64;
+	double			want;
+
+	if( expected < 1 )	expected = 1;
+	if( falseRate <= 0 || falseRate >= 1 )	falseRate = 0.01;
+	want = -expected * log( falseRate ) / (M_LN2 * M_LN2);
+	while( bits < want )	bits <<= 1;
+	bloom = calloc( 1, sizeof(*bloom) );
+	if( !bloom ) {
+		morkErr( "***** error: unable to allocate Bloom filter\n" );
+		return bloom;
+	}
+	bloom->bits = bits;
+	bloom->hashes = (int) (bits / (double) expected * M_LN2 + 0.5);
+	if( bloom->hashes < 1 )			bloom->hashes = 1;
+	if( bloom->hashes > MORKBLOOMMAXHASHES )	bloom->hashes = MORKBLOOMMAXHASHES;
+	bloom->bitmap = calloc( bits / 8, 1 );
+	if( !bloom->bitmap ) {
+		morkErr( "***** error: unable to allocate Bloom filter\n" );
+		free( bloom );
+		return (morkBloom *) 0;
+	}
+	return bloom;
+}
+void freeMorkBloom( morkBloom *bloom ) {
+	if( !bloom )	return;
+	free( bloom->bitmap );
+	free( bloom );
+}
+void addMorkBloomEmail( morkBloom *bloom, const char *email ) {
+	unsigned long long a, b;
+	int i;
+	if( !email || !*email )	return;
+	hashMorkBloomEmail( email, &a, &b );
+	for( i = 0; i < bloom->hashes; ++i, a += b ) {
+		unsigned long long bit = a & (bloom->bits - 1);
+		bloom->bitmap[bit >> 3] |= 1 << (bit & 7);
+	}
+	++bloom->cnt;
+}
+// False if the address is certainly not in the filter, true if it may be
+int checkMorkBloomEmail( morkBloom *bloom, const char *email ) {
+	unsigned long long a, b;
+	int i;
+	if( !email || !*email )	return 0;
+	hashMorkBloomEmail( email, &a, &b );
+	for( i = 0; i < bloom->hashes; ++i, a += b ) {
+		unsigned long long bit = a & (bloom->bits - 1);
+		if( !(bloom->bitmap[bit >> 3] & (1 << (bit & 7))) )
+			return 0;
+	}
+	return 1;
+}
+
+// Counts the e-mail addresses of the database's rows and adds them
+// to the filter if there is one
+static int addMorkBloomDbEmails( morkDb *mork, morkBloom *bloom ) {
+	morkId	columns[2];
+	int	cnt = 0;
+	int	i, j, k, l, c;
+
+	columns[0] = getColumnId( mork, "PrimaryEmail" );
+	columns[1] = getColumnId( mork, "SecondEmail" );
+	for( i = 0; i < mork->cnt; ++i ) {
+		morkTableMap *tableMap = mork->entries[i];
+		for( j = 0; j < tableMap->cnt; ++j ) {
+			rowScopeMap *scopeMap = tableMap->entries[j];
+			for( k = 0; k < scopeMap->cnt; ++k ) {
+				morkRowMap *rowMap = scopeMap->entries[k];
+				for( l = 0; l < rowMap->cnt; ++l ) {
+					for( c = 0; c < 2; ++c ) {
+						char *email;
+						if( !columns[c] )	continue;
+						email = valueForColumnId( columns[c],
+							rowMap->entries[l], mork );
+						if( !email || !*email )	continue;
+						if( bloom )	addMorkBloomEmail( bloom, email );
+						++cnt;
+					}
+				}
+			}
+		}
+	}
+	return cnt;
+}
+// A filter of the e-mail addresses in the databases
+morkBloom *makeMorkBloomForDbs( morkDb **dbs, int cnt, double falseRate ) {
+	morkBloom	*bloom;
+	int		expected = 0;
+	int		i;
+
+	for( i = 0; i < cnt; ++i ) {
+		if( dbs[i] )	expected += addMorkBloomDbEmails( dbs[i], (morkBloom *) 0 );
+	}
+	bloom = makeMorkBloom( expected, falseRate );
+	if( !bloom )	return bloom;
+	for( i = 0; i < cnt; ++i ) {
+		if( dbs[i] )	addMorkBloomDbEmails( dbs[i], bloom );
+	}
+	return bloom;
+}
+
+// Little endian integers for the file
+static void writeMorkBloomInt( FILE *ofp, unsigned long long v, int len ) {
+	unsigned char b[8];
+	int i;
+	for( i = 0; i < len; ++i, v >>= 8 )	b[i] = v & 0xff;
+	fwrite( b, 1, len, ofp );
+}
+static int readMorkBloomInt( FILE *ifp, unsigned long long *v, int len ) {
+	unsigned char b[8];
+	int i;
+	if( fread( b, 1, len, ifp ) != len )	return 0;
+	for( *v = 0, i = len - 1; i >= 0; --i )	*v = *v << 8 | b[i];
+	return 1;
+}
+// Writes the filter in the format described above.
+// Returns false if the file could not be written.
+int writeMorkBloomFile( FILE *ofp, morkBloom *bloom ) {
+	if( !bloom ) {
+		morkErr( "***** error: request to write a NULL Bloom filter\n" );
+		return 0;
+	}
+	fwrite( MorkBloomMagic, 1, strlen( MorkBloomMagic ), ofp );
+	writeMorkBloomInt( ofp, bloom->hashes, 4 );
+	writeMorkBloomInt( ofp, bloom->cnt, 4 );
+	writeMorkBloomInt( ofp, bloom->bits, 8 );
+	fwrite( bloom->bitmap, 1, bloom->bits / 8, ofp );
+	return !ferror( ofp );
+}
+// Reads a filter written by writeMorkBloomFile(), NULL if it is not one
+morkBloom *readMorkBloomFile( FILE *ifp ) {
+	char			magic[sizeof(MorkBloomMagic)];
+	unsigned long long	hashes, cnt, bits;
+	morkBloom		*bloom;
+
+	if( fread( magic, 1, strlen( MorkBloomMagic ), ifp ) != strlen( MorkBloomMagic ) ||
+	    memcmp( magic, MorkBloomMagic, strlen( MorkBloomMagic ) ) ||
+	    !readMorkBloomInt( ifp, &hashes, 4 ) || !readMorkBloomInt( ifp, &cnt, 4 ) ||
+	    !readMorkBloomInt( ifp, &bits, 8 ) ||
+	    hashes < 1 || hashes > MORKBLOOMMAXHASHES ||
+	    bits < 64 || (bits & (bits - 1)) ) {
+		morkErr( "***** error: not a Mork Bloom filter file\n" );
+		return (morkBloom *) 0;
+	}
+	bloom = calloc( 1, sizeof(*bloom) );
+	if( bloom )	bloom->bitmap = malloc( bits / 8 );
+	if( !bloom || !bloom->bitmap ) {
+		morkErr( "***** error: unable to allocate Bloom filter\n" );
+		free( bloom );
+		return (morkBloom *) 0;
+	}
+	bloom->hashes = hashes;
+	bloom->cnt = cnt;
+	bloom->bits = bits;
+	if( fread( bloom->bitmap, 1, bits / 8, ifp ) != bits / 8 ) {
+		morkErr( "***** error: Mork Bloom filter file is cut short\n" );
+		freeMorkBloom( bloom );
+		return (morkBloom *) 0;
+	}
+	return bloom;
+}
@@ -0,0 +1,263 @@
+/*-----------------------------------------------------------------------------
+ *    MorkColumnar.c - Column at a time views of Mork databases
+ *
+ *    transposeMorkDb() turns the rows of a morkDb inside out. Every row
+ *    gets an index (in table scope, table, row scope and row order) and
+ *    every column used by any row gets an array with the value id of
+ *    that column for each row index and a bitmap of the rows that have
+ *    it. Looking at one field of every row then only touches that
+ *    field's array.
+ *
+ *    The view can be written as a binary columnar file with
+ *    writeMorkColumnarFile() or as CSV with dumpMorkColumnarCsv().
+ *
+ *    The binary file is, with all integers little endian:
+ *
+ *	"MORKCOL1"			magic
+ *	u32 rowCnt, u32 columnCnt
+ *	i64 tableScope[rowCnt]		the keys of each row
+ *	i64 tableId[rowCnt]
+ *	i64 rowScope[rowCnt]
+ *	i64 rowId[rowCnt]
+ *	then for each column:
+ *	u32 nameLen, name		the column name (no '\0')
+ *	u8 valid[(rowCnt + 7) / 8]	bit (i & 7) of byte (i >> 3) for row i
+ *	u64 offset[rowCnt + 1]		value of row i is bytes offset[i] up
+ *	bytes				to offset[i + 1] of the string data
+ *
+ ----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "parseMork.h"
+
+#define	morkErr(...)	if( morkErrfp ) fprintf( morkErrfp, ##__VA_ARGS__ )
+
+#define	MorkColumnarMagic	"MORKCOL1"
+
+static int compareMorkIds( const void *a, const void *b ) {
+	morkId x = *(const morkId *) a, y = *(const morkId *) b;
+	return x < y ? -1 : x > y;
+}
+// Index of the column in the view, -1 if it is not there
+static int findMorkColumnarColumn( morkColumnar *c, morkId columnId ) {
+	int lo = 0, hi = c->columnCnt - 1;
+	while( lo <= hi ) {
+		int mid = (lo + hi) / 2;
+		if( c->columns[mid].columnId == columnId )	return mid;
+		if( c->columns[mid].columnId < columnId )	lo = mid + 1;
+		else						hi = mid - 1;
+	}
+	return -1;
+}
+
+morkColumnar *transposeMorkDb( morkDb *mork ) {
+	morkColumnar	*c;
+	morkId		*ids = (morkId *) 0;
+	int		idCnt = 0, idSize = 0, idLimit = 4096;
+	int		row, n;
+	int		i, j, k, l, m;
+
+	if( !mork ) {
+		morkErr( "***** error: request to transpose a NULL Mork database\n" );
+		return (morkColumnar *) 0;
+	}
+	c = calloc( 1, sizeof(*c) );
+
+	// Count the rows and find every column that is used
+	for( i = 0; i < mork->cnt; ++i ) {
+		morkTableMap *tableMap = mork->entries[i];
+		for( j = 0; j < tableMap->cnt; ++j ) {
+			rowScopeMap *scopeMap = tableMap->entries[j];
+			for( k = 0; k < scopeMap->cnt; ++k ) {
+				morkRowMap *rowMap = scopeMap->entries[k];
+				c->rowCnt += rowMap->cnt;
+				for( l = 0; l < rowMap->cnt; ++l ) {
+					morkCells *cells = rowMap->entries[l];
+					for( m = 0; m < cells->cnt; ++m ) {
+						if( idCnt >= idSize ) {
+							idSize = idSize ? idSize * 2 : 64;
+							ids = realloc( ids, idSize * sizeof(*ids) );
+						}
+						ids[idCnt++] = cells->entries[m].key;
+					}
+					// Keep the list from growing with the rows
+					if( idCnt > idLimit ) {
+						qsort( ids, idCnt, sizeof(*ids), compareMorkIds );
+						for( n = 0, m = 0; m < idCnt; ++m )
+							if( !n || ids[m] != ids[n-1] )	ids[n++] = ids[m];
+						idCnt = n;
+						idLimit = 2 * idCnt + 4096;
+					}
+				}
+			}
+		}
+	}
+	qsort( ids, idCnt, sizeof(*ids), compareMorkIds );
+	for( n = 0, m = 0; m < idCnt; ++m )
+		if( !n || ids[m] != ids[n-1] )	ids[n++] = ids[m];
+
+	// The row keys and an empty array and bitmap for each column
+	c->tableScopes = malloc( (c->rowCnt + 1) * sizeof(morkId) );
+	c->tableIds = malloc( (c->rowCnt + 1) * sizeof(morkId) );
+	c->rowScopes = malloc( (c->rowCnt + 1) * sizeof(morkId) );
+	c->rowIds = malloc( (c->rowCnt + 1) * sizeof(morkId) );
+	c->columnCnt = n;
+	c->columns = calloc( n + 1, sizeof(*c->columns) );
+	for( m = 0; m < n; ++m ) {
+		c->columns[m].columnId = ids[m];
+		c->columns[m].values = calloc( c->rowCnt + 1, sizeof(morkId) );
+		c->columns[m].valid = calloc( (c->rowCnt + 7) / 8 + 1, 1 );
+	}
+	free( ids );
+
+	// Scatter every cell into its column
+	row = 0;
+	for( i = 0; i < mork->cnt; ++i ) {
+		morkTableMap *tableMap = mork->entries[i];
+		for( j = 0; j < tableMap->cnt; ++j ) {
+			rowScopeMap *scopeMap = tableMap->entries[j];
+			for( k = 0; k < scopeMap->cnt; ++k ) {
+				morkRowMap *rowMap = scopeMap->entries[k];
+				for( l = 0; l < rowMap->cnt; ++l, ++row ) {
+					morkCells *cells = rowMap->entries[l];
+					c->tableScopes[row] = mork->keys[i];
+					c->tableIds[row] = tableMap->keys[j];
+					c->rowScopes[row] = scopeMap->keys[k];
+					c->rowIds[row] = rowMap->keys[l];
+					for( m = 0; m < cells->cnt; ++m ) {
+						morkColumn *col = &c->columns[findMorkColumnarColumn( c,
+							cells->entries[m].key )];
+						col->values[row] = cells->entries[m].value;
+						col->valid[row >> 3] |= 1 << (row & 7);
+						++col->validCnt;
+					}
+				}
+			}
+		}
+	}
+	return c;
+}
+void freeMorkColumnar( morkColumnar *columnar ) {
+	int i;
+	if( !columnar )	return;
+	for( i = 0; i < columnar->columnCnt; ++i ) {
+		free( columnar->columns[i].values );
+		free( columnar->columns[i].valid );
+	}
+	free( columnar->columns );
+	free( columnar->tableScopes );
+	free( columnar->tableIds );
+	free( columnar->rowScopes );
+	free( columnar->rowIds );
+	free( columnar );
+}
+// Gets the column of the view, NULL if no row has it
+morkColumn *getMorkColumnarColumn( morkColumnar *columnar, morkId columnId ) {
+	int i = findMorkColumnarColumn( columnar, columnId );
+	return i < 0 ? (morkColumn *) 0 : &columnar->columns[i];
+}
+
+// Little endian integers for the binary file
+static void writeMorkColumnarU32( FILE *ofp, unsigned int v ) {
+	unsigned char b[4];
+	int i;
+	for( i = 0; i < 4; ++i, v >>= 8 )	b[i] = v & 0xff;
+	fwrite( b, 1, sizeof(b), ofp );
+}
+static void writeMorkColumnarU64s( FILE *ofp, const unsigned long long *v, int cnt ) {
+	unsigned char b[8 * 512];
+	int i, j, n = 0;
+	for( i = 0; i < cnt; ++i ) {
+		unsigned long long x = v[i];
+		for( j = 0; j < 8; ++j, x >>= 8 )	b[n++] = x & 0xff;
+		if( n == sizeof(b) ) {
+			fwrite( b, 1, n, ofp );
+			n = 0;
+		}
+	}
+	if( n ) fwrite( b, 1, n, ofp );
+}
+// Writes the view in the binary columnar format described above.
+// Returns false if the file could not be written.
+int writeMorkColumnarFile( FILE *ofp, morkDb *mork, morkColumnar *columnar ) {
+	unsigned long long	*offsets;
+	int			i, j;
+
+	if( !mork || !columnar ) {
+		morkErr( "***** error: request to write a NULL Mork columnar view\n" );
+		return 0;
+	}
+	fwrite( MorkColumnarMagic, 1, strlen( MorkColumnarMagic ), ofp );
+	writeMorkColumnarU32( ofp, columnar->rowCnt );
+	writeMorkColumnarU32( ofp, columnar->columnCnt );
+	writeMorkColumnarU64s( ofp, (unsigned long long *) columnar->tableScopes, columnar->rowCnt );
+	writeMorkColumnarU64s( ofp, (unsigned long long *) columnar->tableIds, columnar->rowCnt );
+	writeMorkColumnarU64s( ofp, (unsigned long long *) columnar->rowScopes, columnar->rowCnt );
+	writeMorkColumnarU64s( ofp, (unsigned long long *) columnar->rowIds, columnar->rowCnt );
+
+	offsets = malloc( (columnar->rowCnt + 1) * sizeof(*offsets) );
+	for( i = 0; i < columnar->columnCnt; ++i ) {
+		morkColumn *col = &columnar->columns[i];
+		const char *name = getColumn( mork, col->columnId );
+		writeMorkColumnarU32( ofp, strlen( name ) );
+		fwrite( name, 1, strlen( name ), ofp );
+		fwrite( col->valid, 1, (columnar->rowCnt + 7) / 8, ofp );
+		offsets[0] = 0;
+		for( j = 0; j < columnar->rowCnt; ++j ) {
+			offsets[j+1] = offsets[j];
+			if( col->valid[j >> 3] & (1 << (j & 7)) )
+				offsets[j+1] += strlen( getValue( mork, col->values[j] ) );
+		}
+		writeMorkColumnarU64s( ofp, offsets, columnar->rowCnt + 1 );
+		for( j = 0; j < columnar->rowCnt; ++j ) {
+			if( col->valid[j >> 3] & (1 << (j & 7)) ) {
+				const char *value = getValue( mork, col->values[j] );
+				fwrite( value, 1, strlen( value ), ofp );
+			}
+		}
+	}
+	free( offsets );
+	return !ferror( ofp );
+}
+
+// A CSV field, quoted when it has to be
+static void writeMorkCsvField( FILE *ofp, const char *s ) {
+	if( !s[strcspn( s, ",\"\r\n" )] ) {
+		fputs( s, ofp );
+		return;
+	}
+	putc( '"', ofp );
+	for( ; *s; ++s ) {
+		if( *s == '"' )	putc( '"', ofp );
+		putc( *s, ofp );
+	}
+	putc( '"', ofp );
+}
+// Writes the view as CSV, a header line of the row key names and
+// the column names (in column id order) then a line for each row.
+void dumpMorkColumnarCsv( FILE *ofp, morkDb *mork, morkColumnar *columnar ) {
+	int i, j;
+	if( !mork || !columnar ) {
+		morkErr( "***** error: request to dump a NULL Mork columnar view\n" );
+		return;
+	}
+	fprintf( ofp, "tableScope,tableId,rowScope,rowId" );
+	for( i = 0; i < columnar->columnCnt; ++i ) {
+		putc( ',', ofp );
+		writeMorkCsvField( ofp, getColumn( mork, columnar->columns[i].columnId ) );
+	}
+	putc( '\n', ofp );
+	for( j = 0; j < columnar->rowCnt; ++j ) {
+		fprintf( ofp, "%lld,%lld,%lld,%lld", columnar->tableScopes[j],
+			columnar->tableIds[j], columnar->rowScopes[j],
+			columnar->rowIds[j] );
+		for( i = 0; i < columnar->columnCnt; ++i ) {
+			morkColumn *col = &columnar->columns[i];
+			putc( ',', ofp );
+			if( col->valid[j >> 3] & (1 << (j & 7)) )
+				writeMorkCsvField( ofp, getValue( mork, col->values[j] ) );
+		}
+		putc( '\n', ofp );
+	}
+}
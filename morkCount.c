@@ -0,0 +1,227 @@
+/*-----------------------------------------------------------------------------
+ *    MorkCount.c - Count what is in a Mork file without loading it
+ *
+ *    countMorkStream() runs the file through the lexer only, keeping no
+ *    names or values, and counts the dictionary entries, tables, rows
+ *    and cells. The values of row cells are skipped by the lexer without
+ *    being decoded. The rows are counted for each row map (table scope,
+ *    table and row scope) so a parse that is told the counts can make
+ *    each array the right size the first time instead of growing it.
+ *
+ *    The counts are of what the file holds, so rows given more than
+ *    once and groups that are aborted are counted too, and counting
+ *    goes on past errors as a parse that recovers from them does. They
+ *    are never less than what the parse ends up with.
+ *
+ ----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "parseMork.h"
+#include "morkLexer.h"
+
+typedef int	bool;
+#define	true	1
+#define	false	0
+
+#define	morkErr(...)	if( morkErrfp ) fprintf( morkErrfp, ##__VA_ARGS__ )
+
+// From parseMork.c
+void parseScopeId( const char *textId, morkId *id, morkId *scope );
+
+// The counting state
+typedef struct {
+	morkCounts	*counts;
+	bool		inColumnDict;
+	morkId		tableScope;	// Current table, 0 when not in one
+	morkId		tableId;
+	int		rowCells;	// Cells of the open row
+	int		last;		// Row map count used last
+} morkCounter;
+
+// Index of the row map's count (adding one if it is new)
+static int findMorkRowMapCount( morkCounts *c, morkId tableScope, morkId tableId,
+		morkId rowScope, int last ) {
+	morkRowMapCount *r;
+	int i;
+	// Rows mostly come one after another in the same row map
+	if( last < c->rowMapCnt ) {
+		r = &c->rowMaps[last];
+		if( r->tableScope == tableScope && r->tableId == tableId && r->rowScope == rowScope )
+			return last;
+	}
+	for( i = 0; i < c->rowMapCnt; ++i ) {
+		r = &c->rowMaps[i];
+		if( r->tableScope == tableScope && r->tableId == tableId && r->rowScope == rowScope )
+			return i;
+	}
+	if( c->rowMapCnt >= c->rowMapSize ) {
+		c->rowMapSize = c->rowMapSize ? c->rowMapSize * 2 : 16;
+		c->rowMaps = realloc( c->rowMaps, c->rowMapSize * sizeof(*c->rowMaps) );
+	}
+	r = &c->rowMaps[c->rowMapCnt];
+	r->tableScope = tableScope;
+	r->tableId = tableId;
+	r->rowScope = rowScope;
+	r->rows = 0;
+	return c->rowMapCnt++;
+}
+// Counts a row in its row map, the scopes are filled in as setCurrentRow() does
+static void countMorkRow( morkCounter *k, const char *text ) {
+	morkId id = 0, scope = 0;
+	morkId tableScope = k->tableScope ? k->tableScope : MORKDEFAULTSCOPE;
+	parseScopeId( text, &id, &scope );
+	if( !scope )	scope = tableScope;
+	k->last = findMorkRowMapCount( k->counts, tableScope, k->tableId, scope, k->last );
+	k->counts->rowMaps[k->last].rows++;
+	k->counts->rows++;
+}
+static int countMorkToken( void *arg, const morkToken *token ) {
+	morkCounter *k = (morkCounter *) arg;
+	morkCounts *c = k->counts;
+	switch( token->type ) {
+	case MTDictOpen:
+		k->inColumnDict = false;
+		break;
+	case MTDictMeta:
+		k->inColumnDict = token->textLen == strlen( MorkDictColumnMeta ) - 2 &&
+		    strncmp( token->text, MorkDictColumnMeta + 1, token->textLen ) == 0;
+		break;
+	case MTCell:
+		// Only dictionary cells get here, row cells are skipped
+		if( k->inColumnDict )	c->columns++;
+		else			c->values++;
+		break;
+	case MTTableOpen:
+		c->tables++;
+		k->tableId = 0;
+		k->tableScope = 0;
+		parseScopeId( token->text, &k->tableId, &k->tableScope );
+		break;
+	case MTTableClose:
+		k->tableId = 0;
+		k->tableScope = 0;
+		break;
+	case MTOid:
+	case MTRowOpen:
+		countMorkRow( k, token->text );
+		k->rowCells = 0;
+		break;
+	case MTRowClose:
+		if( k->rowCells > c->maxCells )	c->maxCells = k->rowCells;
+		break;
+	case MTGroupStart:
+		c->groups++;
+		break;
+	default:
+		break;
+	}
+	return true;
+}
+// Counts the cells of rows and skips their values
+static int countMorkCell( void *arg, const char *column, int columnLen, int flags ) {
+	morkCounter *k = (morkCounter *) arg;
+	k->counts->cells++;
+	k->rowCells++;
+	if( !(flags & MTFValueOid) )	k->counts->literals++;
+	return false;
+}
+
+// Counts what is in the stream. Returns false if it is not a Mork file.
+int countMorkStream( FILE *ifp, morkCounts *counts ) {
+	morkCounter	k;
+	morkLexer	lex;
+	char		*buf;
+	size_t		n;
+	int		ok = true;
+
+	memset( counts, 0, sizeof(*counts) );
+	memset( &k, 0, sizeof(k) );
+	k.counts = counts;
+	buf = malloc( MORKREADSIZE );
+	if( !buf ) {
+		morkErr( "***** error: unable to allocate read buffer\n" );
+		return false;
+	}
+	morkLexerInit( &lex, countMorkToken, &k );
+	lex.filter = countMorkCell;
+	// Counting on past errors keeps the counts at least what a parse
+	// that recovers from them ends up with
+	lex.resync = true;
+	while( ok && (n = fread( buf, 1, MORKREADSIZE, ifp )) > 0 ) {
+		counts->bytes += n;
+		ok = morkLexerFeed( &lex, buf, n );
+	}
+	if( ok )	ok = morkLexerFinish( &lex );
+	// Only a file that is not Mork at all is a failure
+	if( lex.error == LEHeader ) {
+		morkErr( "***** error: Mork does not start with \"%s\"\n", MorkMagicHeader );
+		ok = false;
+	} else {
+		ok = true;
+	}
+	morkLexerFree( &lex );
+	free( buf );
+	return ok;
+}
+int countMorkFile( const char *filename, morkCounts *counts ) {
+	int	ok;
+	FILE	*ifp = fopen( filename, "r" );
+	if( !ifp ) {
+		morkErr( "error: unable to read file \"%s\"\n", filename );
+		memset( counts, 0, sizeof(*counts) );
+		return false;
+	}
+	ok = countMorkStream( ifp, counts );
+	fclose( ifp );
+	return ok;
+}
+void freeMorkCounts( morkCounts *counts ) {
+	free( counts->rowMaps );
+	counts->rowMaps = (morkRowMapCount *) 0;
+	counts->rowMapCnt = counts->rowMapSize = 0;
+}
+void dumpMorkCounts( FILE *ofp, morkCounts *counts ) {
+	int i;
+	fprintf( ofp, "Bytes:              %lld\n", counts->bytes );
+	fprintf( ofp, "Column dictionary:  %lld\n", counts->columns );
+	fprintf( ofp, "Value dictionary:   %lld\n", counts->values );
+	fprintf( ofp, "Literal values:     %lld\n", counts->literals );
+	fprintf( ofp, "Tables:             %lld\n", counts->tables );
+	fprintf( ofp, "Rows:               %lld\n", counts->rows );
+	fprintf( ofp, "Cells:              %lld\n", counts->cells );
+	fprintf( ofp, "Most cells in a row: %d\n", counts->maxCells );
+	fprintf( ofp, "Groups:             %lld\n", counts->groups );
+	for( i = 0; i < counts->rowMapCnt; ++i ) {
+		morkRowMapCount *r = &counts->rowMaps[i];
+		fprintf( ofp, "  Table scope %llX table %llX row scope %llX: %lld rows\n",
+			r->tableScope, r->tableId, r->rowScope, r->rows );
+	}
+}
+// Makes a new row map's arrays the size counted for it
+void presizeMorkRowMap( morkRowMap *map, const morkCounts *counts,
+		morkId tableScope, morkId tableId, morkId rowScope ) {
+	int i;
+	if( map->size )	return;
+	for( i = 0; i < counts->rowMapCnt; ++i ) {
+		const morkRowMapCount *r = &counts->rowMaps[i];
+		if( r->tableScope != tableScope || r->tableId != tableId || r->rowScope != rowScope )
+			continue;
+		if( !r->rows )	return;
+		map->size = r->rows;
+		map->keys = malloc( map->size * sizeof(*map->keys) );
+		map->entries = malloc( map->size * sizeof(*map->entries) );
+		return;
+	}
+}
+// Makes the dictionaries' arrays the size counted for them
+void presizeMorkDicts( morkDb *mork, const morkCounts *counts ) {
+	if( !mork->columns->size && counts->columns ) {
+		mork->columns->size = counts->columns;
+		mork->columns->entries = malloc( mork->columns->size * sizeof(*mork->columns->entries) );
+	}
+	if( !mork->values->size && counts->values + counts->literals ) {
+		mork->values->size = counts->values + counts->literals;
+		mork->values->entries = malloc( mork->values->size * sizeof(*mork->values->entries) );
+	}
+}
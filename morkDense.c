@@ -0,0 +1,174 @@
+/*-----------------------------------------------------------------------------
+ *    MorkDense.c - Dense column slot layout for Mork rows
+ *
+ *    Address book rows use a small set of column ids over and over.
+ *    buildMorkDenseRows() gives each column used by any row a slot
+ *    number, the same for the whole database, and adds to each row a
+ *    block holding a bitmap of the slots it has followed by the value
+ *    ids of just those slots in slot order:
+ *
+ *	[ present bits (words) ][ value id ][ value id ] ...
+ *
+ *    A field is then found with a table lookup for the slot, a bit
+ *    test, and a count of the bits below it for the index, where
+ *    valueForColumnId() would otherwise search the row's cells.
+ *
+ *    The cells stay as they are. A row that is changed afterwards
+ *    drops its block and goes back to being searched. The blocks are
+ *    another copy of the rows' value ids, so mork only adds them when
+ *    asked to (--dense), and morkDenseMemoryUsage() gives their size.
+ *
+ ----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "parseMork.h"
+
+#define	morkLog(...)	if( morkLogfp ) fprintf( morkLogfp, ##__VA_ARGS__ )
+
+// The most column ids the slot table will cover
+#define	MORKMAXSLOTRANGE	65536
+
+// Slot of a column, -1 if no row has it
+static int morkSlotOfColumn( morkSlotMap *s, morkId columnId ) {
+	morkId i = columnId - s->firstColumn;
+	if( i < 0 || i >= s->columnRange )	return -1;
+	return s->slotOf[i];
+}
+
+// Adds the dense layout to every row. Returns false (leaving the rows
+// as they were) if the column ids are too spread out for a slot table.
+int buildMorkDenseRows( morkDb *mork ) {
+	morkSlotMap	*s;
+	morkId		lo = 0, hi = -1;
+	int		i, j, k, l, m;
+
+	freeMorkDenseRows( mork );
+
+	// The range of the column ids that are used
+	for( i = 0; i < mork->cnt; ++i ) {
+		morkTableMap *tableMap = mork->entries[i];
+		for( j = 0; j < tableMap->cnt; ++j ) {
+			rowScopeMap *scopeMap = tableMap->entries[j];
+			for( k = 0; k < scopeMap->cnt; ++k ) {
+				morkRowMap *rowMap = scopeMap->entries[k];
+				for( l = 0; l < rowMap->cnt; ++l ) {
+					morkCells *cells = rowMap->entries[l];
+					if( !cells->cnt )	continue;
+					// The cells are sorted by column id
+					if( hi < lo || cells->entries[0].key < lo )
+						lo = cells->entries[0].key;
+					if( cells->entries[cells->cnt-1].key > hi )
+						hi = cells->entries[cells->cnt-1].key;
+				}
+			}
+		}
+	}
+	if( hi - lo + 1 > MORKMAXSLOTRANGE ) {
+		morkLog( "  Column ids %lld to %lld are too spread out for dense rows\n", lo, hi );
+		return 0;
+	}
+
+	// Slots go to the used columns in column id order
+	s = calloc( 1, sizeof(*s) );
+	s->firstColumn = lo;
+	s->columnRange = hi < lo ? 0 : hi - lo + 1;
+	s->slotOf = malloc( (s->columnRange + 1) * sizeof(*s->slotOf) );
+	for( m = 0; m < s->columnRange; ++m )	s->slotOf[m] = -1;
+	for( i = 0; i < mork->cnt; ++i ) {
+		morkTableMap *tableMap = mork->entries[i];
+		for( j = 0; j < tableMap->cnt; ++j ) {
+			rowScopeMap *scopeMap = tableMap->entries[j];
+			for( k = 0; k < scopeMap->cnt; ++k ) {
+				morkRowMap *rowMap = scopeMap->entries[k];
+				for( l = 0; l < rowMap->cnt; ++l ) {
+					morkCells *cells = rowMap->entries[l];
+					for( m = 0; m < cells->cnt; ++m )
+						s->slotOf[cells->entries[m].key - lo] = 0;
+				}
+			}
+		}
+	}
+	for( m = 0; m < s->columnRange; ++m ) {
+		if( !s->slotOf[m] )	s->slotOf[m] = s->slotCnt++;
+	}
+	s->words = (s->slotCnt + 63) / 64;
+	mork->slots = s;
+
+	// Each row's block, the values are in slot order because both
+	// the cells and the slots are in column id order
+	for( i = 0; i < mork->cnt; ++i ) {
+		morkTableMap *tableMap = mork->entries[i];
+		for( j = 0; j < tableMap->cnt; ++j ) {
+			rowScopeMap *scopeMap = tableMap->entries[j];
+			for( k = 0; k < scopeMap->cnt; ++k ) {
+				morkRowMap *rowMap = scopeMap->entries[k];
+				for( l = 0; l < rowMap->cnt; ++l ) {
+					morkCells *cells = rowMap->entries[l];
+					morkId *values;
+					cells->dense = calloc( s->words + cells->cnt + 1,
+						sizeof(*cells->dense) );
+					values = (morkId *) (cells->dense + s->words);
+					for( m = 0; m < cells->cnt; ++m ) {
+						int slot = s->slotOf[cells->entries[m].key - lo];
+						cells->dense[slot >> 6] |= 1ULL << (slot & 63);
+						values[m] = cells->entries[m].value;
+					}
+				}
+			}
+		}
+	}
+	morkLog( "  Dense rows with %d slots for column ids %lld to %lld\n",
+		s->slotCnt, lo, hi );
+	return 1;
+}
+// Drops the dense layout from every row
+void freeMorkDenseRows( morkDb *mork ) {
+	int i, j, k, l;
+	if( !mork->slots )	return;
+	for( i = 0; i < mork->cnt; ++i ) {
+		morkTableMap *tableMap = mork->entries[i];
+		for( j = 0; j < tableMap->cnt; ++j ) {
+			rowScopeMap *scopeMap = tableMap->entries[j];
+			for( k = 0; k < scopeMap->cnt; ++k ) {
+				morkRowMap *rowMap = scopeMap->entries[k];
+				for( l = 0; l < rowMap->cnt; ++l ) {
+					free( rowMap->entries[l]->dense );
+					rowMap->entries[l]->dense = NULL;
+				}
+			}
+		}
+	}
+	free( mork->slots->slotOf );
+	free( mork->slots );
+	mork->slots = NULL;
+}
+// Index of the column's value in a row's dense block, -1 if the row
+// does not have the column. The values are in the same order as the
+// cells so this is also the index of the cell.
+int findMorkDenseCell( morkDb *mork, morkCells *cells, morkId columnId ) {
+	int slot = morkSlotOfColumn( mork->slots, columnId );
+	int word, rank, i;
+	unsigned long long bit;
+	if( slot < 0 )	return -1;
+	word = slot >> 6;
+	bit = 1ULL << (slot & 63);
+	if( !(cells->dense[word] & bit) )	return -1;
+	rank = __builtin_popcountll( cells->dense[word] & (bit - 1) );
+	for( i = 0; i < word; ++i )
+		rank += __builtin_popcountll( cells->dense[i] );
+	return rank;
+}
+// Gets the value id of the column from a row's dense block. Returns
+// false if the row does not have the column.
+int getMorkDenseValue( morkDb *mork, morkCells *cells, morkId columnId, morkId *valueId ) {
+	int i = findMorkDenseCell( mork, cells, columnId );
+	if( i < 0 )	return 0;
+	*valueId = ((morkId *) (cells->dense + mork->slots->words))[i];
+	return 1;
+}
+// Heap bytes of a row's dense block
+size_t morkDenseRowSize( morkDb *mork, morkCells *cells ) {
+	if( !cells->dense || !mork->slots )	return 0;
+	return (mork->slots->words + cells->cnt + 1) * sizeof(*cells->dense);
+}
@@ -0,0 +1,234 @@
+/*-----------------------------------------------------------------------------
+ *    MorkDiff.c - Structural differences between two Mork databases
+ *
+ *    Every level of a morkDb (table scopes, tables, row scopes and
+ *    rows) is kept sorted by key so the two databases are compared
+ *    with a merge at each level, visiting every row once.
+ *
+ *    Two rows are the same when they have the same columns with the
+ *    same values. Columns are matched by name and values compared as
+ *    text because the dictionary ids are not the same from one file
+ *    to the next.
+ *
+ ----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "parseMork.h"
+
+typedef int	bool;
+#define	true	1
+#define	false	0
+
+#define	morkErr(...)	if( morkErrfp ) fprintf( morkErrfp, ##__VA_ARGS__ )
+
+// What is needed while walking the two databases
+typedef struct {
+	morkDb		*a;
+	morkDb		*b;
+	morkDiff	*diff;
+	bool		sameColumns;	// Same column ids for the same names
+	morkId		*columnMap;	// b column id for each a column entry
+	morkDiffEntry	key;		// Keys of the current level
+} morkDiffContext;
+
+static void addMorkDiffEntry( morkDiffContext *ctx, morkDiffType type,
+		morkCells *a, morkCells *b ) {
+	morkDiff *d = ctx->diff;
+	if( d->cnt >= d->size ) {
+		d->size = d->size ? d->size * 2 : 64;
+		d->entries = realloc( d->entries, d->size * sizeof(*d->entries) );
+	}
+	d->entries[d->cnt] = ctx->key;
+	d->entries[d->cnt].type = type;
+	d->entries[d->cnt].a = a;
+	d->entries[d->cnt].b = b;
+	++d->cnt;
+}
+// Index of the cell with the key, -1 if not there
+static int findMorkCell( morkCells *cells, morkId key ) {
+	int lo = 0, hi = cells->cnt - 1;
+	while( lo <= hi ) {
+		int mid = (lo + hi) / 2;
+		if( cells->entries[mid].key == key )	return mid;
+		if( cells->entries[mid].key < key )	lo = mid + 1;
+		else					hi = mid - 1;
+	}
+	return -1;
+}
+// The b column id for an a column id, 0 if b has no such column
+static morkId mapMorkColumn( morkDiffContext *ctx, morkId columnId ) {
+	morkDict *dict = ctx->a->columns;
+	int lo = 0, hi = dict->cnt - 1;
+	while( lo <= hi ) {
+		int mid = (lo + hi) / 2;
+		if( dict->entries[mid].key == columnId )
+			return ctx->columnMap[mid];
+		if( dict->entries[mid].key < columnId ) lo = mid + 1;
+		else					 hi = mid - 1;
+	}
+	return 0;
+}
+static bool sameMorkCells( morkDiffContext *ctx, morkCells *ca, morkCells *cb ) {
+	int i, j;
+	if( ca->cnt != cb->cnt )	return false;
+	for( i = 0; i < ca->cnt; ++i ) {
+		if( ctx->sameColumns ) {
+			// Both are in the same order, just walk them together
+			j = i;
+			if( ca->entries[i].key != cb->entries[j].key )	return false;
+		} else {
+			morkId columnId = mapMorkColumn( ctx, ca->entries[i].key );
+			if( !columnId )	return false;
+			j = findMorkCell( cb, columnId );
+			if( j < 0 )	return false;
+		}
+		if( strcmp( getMorkCellValue( ctx->a, ca, i ),
+			    getMorkCellValue( ctx->b, cb, j ) ) != 0 )
+			return false;
+	}
+	return true;
+}
+static void diffMorkCells( morkDiffContext *ctx, morkCells *ca, morkCells *cb ) {
+	if( ca && cb ) {
+		if( !sameMorkCells( ctx, ca, cb ) )
+			addMorkDiffEntry( ctx, MDModified, ca, cb );
+	} else if( ca ) {
+		addMorkDiffEntry( ctx, MDRemoved, ca, NULL );
+	} else {
+		addMorkDiffEntry( ctx, MDAdded, NULL, cb );
+	}
+}
+// Each level is a merge of the two sorted key arrays, either
+// side may be missing when the whole subtree was added or removed
+static void diffMorkRowMaps( morkDiffContext *ctx, morkRowMap *a, morkRowMap *b ) {
+	int i = 0, j = 0;
+	int na = a ? a->cnt : 0, nb = b ? b->cnt : 0;
+	while( i < na || j < nb ) {
+		if( j >= nb || (i < na && a->keys[i] < b->keys[j]) ) {
+			ctx->key.rowId = a->keys[i];
+			diffMorkCells( ctx, a->entries[i++], NULL );
+		} else if( i >= na || b->keys[j] < a->keys[i] ) {
+			ctx->key.rowId = b->keys[j];
+			diffMorkCells( ctx, NULL, b->entries[j++] );
+		} else {
+			ctx->key.rowId = a->keys[i];
+			diffMorkCells( ctx, a->entries[i++], b->entries[j++] );
+		}
+	}
+}
+static void diffRowScopeMaps( morkDiffContext *ctx, rowScopeMap *a, rowScopeMap *b ) {
+	int i = 0, j = 0;
+	int na = a ? a->cnt : 0, nb = b ? b->cnt : 0;
+	while( i < na || j < nb ) {
+		if( j >= nb || (i < na && a->keys[i] < b->keys[j]) ) {
+			ctx->key.rowScope = a->keys[i];
+			diffMorkRowMaps( ctx, a->entries[i++], NULL );
+		} else if( i >= na || b->keys[j] < a->keys[i] ) {
+			ctx->key.rowScope = b->keys[j];
+			diffMorkRowMaps( ctx, NULL, b->entries[j++] );
+		} else {
+			ctx->key.rowScope = a->keys[i];
+			diffMorkRowMaps( ctx, a->entries[i++], b->entries[j++] );
+		}
+	}
+}
+static void diffMorkTableMaps( morkDiffContext *ctx, morkTableMap *a, morkTableMap *b ) {
+	int i = 0, j = 0;
+	int na = a ? a->cnt : 0, nb = b ? b->cnt : 0;
+	while( i < na || j < nb ) {
+		if( j >= nb || (i < na && a->keys[i] < b->keys[j]) ) {
+			ctx->key.tableId = a->keys[i];
+			diffRowScopeMaps( ctx, a->entries[i++], NULL );
+		} else if( i >= na || b->keys[j] < a->keys[i] ) {
+			ctx->key.tableId = b->keys[j];
+			diffRowScopeMaps( ctx, NULL, b->entries[j++] );
+		} else {
+			ctx->key.tableId = a->keys[i];
+			diffRowScopeMaps( ctx, a->entries[i++], b->entries[j++] );
+		}
+	}
+}
+
+morkDiff *diffMorkDb( morkDb *a, morkDb *b ) {
+	morkDiffContext ctx;
+	int i = 0, j = 0;
+
+	if( !a || !b ) {
+		morkErr( "***** error: request to diff a NULL Mork database\n" );
+		return (morkDiff *) 0;
+	}
+	memset( &ctx, 0, sizeof(ctx) );
+	ctx.a = a;
+	ctx.b = b;
+	ctx.diff = calloc( 1, sizeof(*ctx.diff) );
+
+	// Match the columns by name
+	ctx.sameColumns = a->columns->cnt == b->columns->cnt;
+	ctx.columnMap = malloc( (a->columns->cnt + 1) * sizeof(*ctx.columnMap) );
+	for( i = 0; i < a->columns->cnt; ++i ) {
+		morkDictEntry *e = &a->columns->entries[i];
+		ctx.columnMap[i] = getColumnId( b, morkDictEntryValue( e ) );
+		if( ctx.columnMap[i] != e->key )	ctx.sameColumns = false;
+	}
+
+	i = 0;
+	while( i < a->cnt || j < b->cnt ) {
+		if( j >= b->cnt || (i < a->cnt && a->keys[i] < b->keys[j]) ) {
+			ctx.key.tableScope = a->keys[i];
+			diffMorkTableMaps( &ctx, a->entries[i++], NULL );
+		} else if( i >= a->cnt || b->keys[j] < a->keys[i] ) {
+			ctx.key.tableScope = b->keys[j];
+			diffMorkTableMaps( &ctx, NULL, b->entries[j++] );
+		} else {
+			ctx.key.tableScope = a->keys[i];
+			diffMorkTableMaps( &ctx, a->entries[i++], b->entries[j++] );
+		}
+	}
+	free( ctx.columnMap );
+	return ctx.diff;
+}
+void freeMorkDiff( morkDiff *diff ) {
+	if( !diff )	return;
+	free( diff->entries );
+	free( diff );
+}
+
+// Print the changed columns of a modified row
+static void dumpMorkDiffCells( FILE *ofp, morkDb *a, morkDb *b, morkCells *ca, morkCells *cb ) {
+	int i;
+	for( i = 0; i < ca->cnt; ++i ) {
+		const char *column = getMorkCellColumn( a, ca, i );
+		const char *va = getMorkCellValue( a, ca, i );
+		const char *vb = valueForColumnId( getColumnId( b, column ), cb, b );
+		if( !vb ) {
+			fprintf( ofp, "     - \"%s\" = \"%s\"\n", column, va );
+		} else if( strcmp( va, vb ) != 0 ) {
+			fprintf( ofp, "     ~ \"%s\" = \"%s\" => \"%s\"\n", column, va, vb );
+		}
+	}
+	for( i = 0; i < cb->cnt; ++i ) {
+		const char *column = getMorkCellColumn( b, cb, i );
+		if( !valueForColumnId( getColumnId( a, column ), ca, a ) ) {
+			fprintf( ofp, "     + \"%s\" = \"%s\"\n", column,
+				getMorkCellValue( b, cb, i ) );
+		}
+	}
+}
+void dumpMorkDiff( FILE *ofp, morkDb *a, morkDb *b, morkDiff *diff ) {
+	static const char *typeNames[] = { "Added", "Removed", "Modified" };
+	int i;
+	if( !diff ) {
+		morkErr( "***** error: request to dump a NULL Mork diff\n" );
+		return;
+	}
+	fprintf( ofp, "Mork diff with %d entries\n", diff->cnt );
+	for( i = 0; i < diff->cnt; ++i ) {
+		morkDiffEntry *e = &diff->entries[i];
+		fprintf( ofp, "%-8s table scope %lld table %lld row scope %lld row %lld\n",
+			typeNames[e->type], e->tableScope, e->tableId,
+			e->rowScope, e->rowId );
+		if( e->type == MDModified )
+			dumpMorkDiffCells( ofp, a, b, e->a, e->b );
+	}
+}
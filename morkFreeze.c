@@ -0,0 +1,343 @@
+/*-----------------------------------------------------------------------------
+ *    MorkFreeze.c - Compact read-only copies of parsed Mork databases
+ *
+ *    A parsed morkDb is a tree of small malloc'd maps and arrays. Once
+ *    loading is done freezeMorkDb() copies it into a single allocation
+ *    that holds a few exactly sized arrays:
+ *
+ *	tableScopes -> tables -> rowScopes -> rows -> cells
+ *
+ *    Each level is sorted by key and refers to its children as an
+ *    index and count into the next array. The dictionary strings are
+ *    kept once each in a string pool and referred to by offset, so
+ *    there are no pointers inside the frozen data at all.
+ *
+ ----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "parseMork.h"
+
+// Roughly what the C library adds to each malloc'd block
+#define	MORKMALLOCOVERHEAD	(2 * sizeof(size_t))
+
+#define	morkErr(...)	if( morkErrfp ) fprintf( morkErrfp, ##__VA_ARGS__ )
+
+// Bytes used by a block of n bytes from malloc
+static size_t morkBlock( size_t n ) {
+	return n + MORKMALLOCOVERHEAD;
+}
+static size_t morkDictMemoryUsage( morkDict *dict ) {
+	size_t		total;
+	morkPoolBlock	*b;
+	if( !dict )	return 0;
+	total = morkBlock( sizeof(*dict) );
+	if( dict->entries ) {
+		total += morkBlock( dict->size * sizeof(*dict->entries) );
+	}
+	for( b = dict->pool; b; b = b->next ) {
+		total += morkBlock( sizeof(*b) + b->size );
+	}
+	return total;
+}
+static size_t morkCellsMemoryUsage( morkDb *mork, morkCells *cells, size_t *dense ) {
+	size_t total = morkBlock( sizeof(*cells) );
+	if( cells->entries ) {
+		total += morkBlock( cells->size * sizeof(*cells->entries) );
+	}
+	if( cells->dense ) {
+		size_t n = morkBlock( morkDenseRowSize( mork, cells ) );
+		total += n;
+		*dense += n;
+	}
+	if( cells->resolved ) {
+		total += morkBlock( (cells->cnt + 1) * sizeof(*cells->resolved) );
+	}
+	return total;
+}
+// Heap bytes used by a parsed Mork database, and of them those used by
+// the dense row layout
+static size_t morkDbMemoryUsages( morkDb *mork, size_t *dense ) {
+	size_t	total;
+	int	i, j, k, l;
+	*dense = 0;
+	if( !mork )	return 0;
+	total = morkBlock( sizeof(*mork) );
+	total += morkDictMemoryUsage( mork->columns );
+	total += morkDictMemoryUsage( mork->values );
+	if( mork->skips )	total += morkBlock( mork->skipSize * sizeof(*mork->skips) );
+	if( mork->slots ) {
+		*dense += morkBlock( sizeof(*mork->slots) );
+		*dense += morkBlock( (mork->slots->columnRange + 1) * sizeof(*mork->slots->slotOf) );
+		total += *dense;
+	}
+	if( mork->entries ) {
+		total += morkBlock( mork->size * sizeof(*mork->keys) );
+		total += morkBlock( mork->size * sizeof(*mork->entries) );
+	}
+	for( i = 0; i < mork->cnt; ++i ) {
+		morkTableMap *tableMap = mork->entries[i];
+		total += morkBlock( sizeof(*tableMap) );
+		if( tableMap->entries ) {
+			total += morkBlock( tableMap->size * sizeof(*tableMap->keys) );
+			total += morkBlock( tableMap->size * sizeof(*tableMap->entries) );
+		}
+		for( j = 0; j < tableMap->cnt; ++j ) {
+			rowScopeMap *scopeMap = tableMap->entries[j];
+			total += morkBlock( sizeof(*scopeMap) );
+			if( scopeMap->entries ) {
+				total += morkBlock( scopeMap->size * sizeof(*scopeMap->keys) );
+				total += morkBlock( scopeMap->size * sizeof(*scopeMap->entries) );
+			}
+			for( k = 0; k < scopeMap->cnt; ++k ) {
+				morkRowMap *rowMap = scopeMap->entries[k];
+				total += morkBlock( sizeof(*rowMap) );
+				if( rowMap->entries ) {
+					total += morkBlock( rowMap->size * sizeof(*rowMap->keys) );
+					total += morkBlock( rowMap->size * sizeof(*rowMap->entries) );
+				}
+				for( l = 0; l < rowMap->cnt; ++l ) {
+					total += morkCellsMemoryUsage( mork, rowMap->entries[l], dense );
+				}
+			}
+		}
+	}
+	return total;
+}
+// Heap bytes used by a parsed Mork database
+size_t morkDbMemoryUsage( morkDb *mork ) {
+	size_t dense;
+	return morkDbMemoryUsages( mork, &dense );
+}
+// Heap bytes of a parsed Mork database used by the dense row layout
+size_t morkDenseMemoryUsage( morkDb *mork ) {
+	size_t dense;
+	morkDbMemoryUsages( mork, &dense );
+	return dense;
+}
+// Heap bytes used by a frozen Mork database
+size_t morkFrozenDbMemoryUsage( morkFrozenDb *frozen ) {
+	return frozen ? morkBlock( frozen->size ) : 0;
+}
+
+// Open addressing table used to put each distinct string
+// in the pool only once
+typedef struct {
+	size_t		size;
+	const char	**keys;
+	size_t		*offsets;
+} morkStringSet;
+
+static unsigned int morkStringHash( const char *s ) {
+	unsigned int h = 2166136261u;
+	while( *s ) {
+		h ^= (unsigned char) *s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+// Returns the slot for the string, a NULL key means it is new
+static size_t morkStringSlot( morkStringSet *set, const char *s ) {
+	size_t i = morkStringHash( s ) & (set->size - 1);
+	while( set->keys[i] && strcmp( set->keys[i], s ) != 0 ) {
+		i = (i + 1) & (set->size - 1);
+	}
+	return i;
+}
+// Give each distinct string of the dictionary its pool offset
+static void poolMorkDict( morkDict *dict, morkStringSet *set, size_t *stringsUsed ) {
+	int i;
+	for( i = 0; i < dict->cnt; ++i ) {
+		const char *value = morkDictEntryValue( &dict->entries[i] );
+		size_t slot = morkStringSlot( set, value );
+		if( !set->keys[slot] ) {
+			set->keys[slot] = value;
+			set->offsets[slot] = *stringsUsed;
+			*stringsUsed += strlen( value ) + 1;
+		}
+	}
+}
+// Copy the dictionary into frozen entries
+static void freezeMorkDict( morkDict *dict, morkFrozenDictEntry *entries,
+		morkStringSet *set ) {
+	int i;
+	for( i = 0; i < dict->cnt; ++i ) {
+		entries[i].key = dict->entries[i].key;
+		entries[i].offset = set->offsets[morkStringSlot( set,
+			morkDictEntryValue( &dict->entries[i] ) )];
+	}
+}
+
+morkFrozenDb *freezeMorkDb( morkDb *mork ) {
+	morkFrozenDb	*f;
+	morkStringSet	set;
+	size_t	tableCnt = 0, rowScopeCnt = 0, rowCnt = 0, cellCnt = 0;
+	size_t	stringsSize = 0;
+	size_t	t, s, r, c;
+	size_t	size, slot;
+	int	i, j, k, l;
+	char	*p;
+
+	if( !mork ) {
+		morkErr( "***** error: request to freeze a NULL Mork database\n" );
+		return (morkFrozenDb *) 0;
+	}
+
+	// Count everything so each array can be exactly sized
+	for( i = 0; i < mork->cnt; ++i ) {
+		morkTableMap *tableMap = mork->entries[i];
+		tableCnt += tableMap->cnt;
+		for( j = 0; j < tableMap->cnt; ++j ) {
+			rowScopeMap *scopeMap = tableMap->entries[j];
+			rowScopeCnt += scopeMap->cnt;
+			for( k = 0; k < scopeMap->cnt; ++k ) {
+				morkRowMap *rowMap = scopeMap->entries[k];
+				rowCnt += rowMap->cnt;
+				for( l = 0; l < rowMap->cnt; ++l ) {
+					cellCnt += rowMap->entries[l]->cnt;
+				}
+			}
+		}
+	}
+
+	// Both dictionaries share the string pool
+	set.size = 16;
+	while( set.size < 2 * ((size_t) mork->columns->cnt + mork->values->cnt) )
+		set.size *= 2;
+	set.keys = calloc( set.size, sizeof(*set.keys) );
+	set.offsets = malloc( set.size * sizeof(*set.offsets) );
+	poolMorkDict( mork->columns, &set, &stringsSize );
+	poolMorkDict( mork->values, &set, &stringsSize );
+
+	// One block, the header then the arrays, largest alignment first
+	size = sizeof(*f);
+	size += (mork->cnt + tableCnt + rowScopeCnt + rowCnt) * sizeof(morkFrozenNode);
+	size += cellCnt * sizeof(morkCellEntry);
+	size += ((size_t) mork->columns->cnt + mork->values->cnt) * sizeof(morkFrozenDictEntry);
+	size += stringsSize;
+	f = (morkFrozenDb *) malloc( size );
+	if( !f ) {
+		morkErr( "***** error: unable to allocate frozen mork database\n" );
+		free( set.keys );
+		free( set.offsets );
+		return (morkFrozenDb *) 0;
+	}
+	f->size = size;
+	p = (char *) (f + 1);
+	f->tableScopeCnt = mork->cnt;
+	f->tableScopes = (morkFrozenNode *) p;	p += mork->cnt * sizeof(morkFrozenNode);
+	f->tableCnt = tableCnt;
+	f->tables = (morkFrozenNode *) p;	p += tableCnt * sizeof(morkFrozenNode);
+	f->rowScopeCnt = rowScopeCnt;
+	f->rowScopes = (morkFrozenNode *) p;	p += rowScopeCnt * sizeof(morkFrozenNode);
+	f->rowCnt = rowCnt;
+	f->rows = (morkFrozenNode *) p;		p += rowCnt * sizeof(morkFrozenNode);
+	f->cellCnt = cellCnt;
+	f->cells = (morkCellEntry *) p;		p += cellCnt * sizeof(morkCellEntry);
+	f->columnCnt = mork->columns->cnt;
+	f->columns = (morkFrozenDictEntry *) p;	p += f->columnCnt * sizeof(morkFrozenDictEntry);
+	f->valueCnt = mork->values->cnt;
+	f->values = (morkFrozenDictEntry *) p;	p += f->valueCnt * sizeof(morkFrozenDictEntry);
+	f->strings = p;
+
+	// Fill the levels in order so each node's children are contiguous
+	t = s = r = c = 0;
+	for( i = 0; i < mork->cnt; ++i ) {
+		morkTableMap *tableMap = mork->entries[i];
+		f->tableScopes[i].key = mork->keys[i];
+		f->tableScopes[i].first = t;
+		f->tableScopes[i].cnt = tableMap->cnt;
+		for( j = 0; j < tableMap->cnt; ++j, ++t ) {
+			rowScopeMap *scopeMap = tableMap->entries[j];
+			f->tables[t].key = tableMap->keys[j];
+			f->tables[t].first = s;
+			f->tables[t].cnt = scopeMap->cnt;
+			for( k = 0; k < scopeMap->cnt; ++k, ++s ) {
+				morkRowMap *rowMap = scopeMap->entries[k];
+				f->rowScopes[s].key = scopeMap->keys[k];
+				f->rowScopes[s].first = r;
+				f->rowScopes[s].cnt = rowMap->cnt;
+				for( l = 0; l < rowMap->cnt; ++l, ++r ) {
+					morkCells *cells = rowMap->entries[l];
+					int m;
+					f->rows[r].key = rowMap->keys[l];
+					f->rows[r].first = c;
+					f->rows[r].cnt = cells->cnt;
+					for( m = 0; m < cells->cnt; ++m, ++c ) {
+						f->cells[c] = cells->entries[m];
+					}
+				}
+			}
+		}
+	}
+
+	// The dictionaries and their strings
+	f->stringsSize = stringsSize;
+	for( slot = 0; slot < set.size; ++slot ) {
+		if( set.keys[slot] ) {
+			memcpy( f->strings + set.offsets[slot], set.keys[slot],
+				strlen( set.keys[slot] ) + 1 );
+		}
+	}
+	freezeMorkDict( mork->columns, f->columns, &set );
+	freezeMorkDict( mork->values, f->values, &set );
+	free( set.keys );
+	free( set.offsets );
+	return f;
+}
+void freeFrozenMorkDb( morkFrozenDb *frozen ) {
+	free( frozen );
+}
+
+// Binary search of count nodes for the key, NULL if not there
+static morkFrozenNode *findFrozenMorkNode( morkFrozenNode *nodes, int cnt, morkId key ) {
+	int lo = 0, hi = cnt - 1;
+	while( lo <= hi ) {
+		int mid = (lo + hi) / 2;
+		if( nodes[mid].key == key )	return &nodes[mid];
+		if( nodes[mid].key < key )	lo = mid + 1;
+		else				hi = mid - 1;
+	}
+	return (morkFrozenNode *) 0;
+}
+static const char *findFrozenMorkDictValue( morkFrozenDb *f,
+		morkFrozenDictEntry *entries, int cnt, morkId key ) {
+	int lo = 0, hi = cnt - 1;
+	while( lo <= hi ) {
+		int mid = (lo + hi) / 2;
+		if( entries[mid].key == key )
+			return f->strings + entries[mid].offset;
+		if( entries[mid].key < key )	lo = mid + 1;
+		else				hi = mid - 1;
+	}
+	return "";
+}
+const char *getFrozenMorkValue( morkFrozenDb *frozen, morkId objectId ) {
+	return findFrozenMorkDictValue( frozen, frozen->values,
+		frozen->valueCnt, objectId );
+}
+const char *getFrozenMorkColumn( morkFrozenDb *frozen, morkId objectId ) {
+	return findFrozenMorkDictValue( frozen, frozen->columns,
+		frozen->columnCnt, objectId );
+}
+morkId getFrozenMorkColumnId( morkFrozenDb *frozen, const char *value ) {
+	int i;
+	for( i = 0; i < frozen->columnCnt; ++i ) {
+		if( strcmp( value, frozen->strings + frozen->columns[i].offset ) == 0 )
+			return frozen->columns[i].key;
+	}
+	return 0;
+}
+// Gets the cells of a row and their count, NULL if there is no such row
+const morkCellEntry *getFrozenMorkRow( morkFrozenDb *frozen, morkId tableScope,
+		morkId tableId, morkId rowScope, morkId rowId, int *cnt ) {
+	morkFrozenNode *n;
+	*cnt = 0;
+	n = findFrozenMorkNode( frozen->tableScopes, frozen->tableScopeCnt, tableScope );
+	if( n )	n = findFrozenMorkNode( frozen->tables + n->first, n->cnt, tableId );
+	if( n )	n = findFrozenMorkNode( frozen->rowScopes + n->first, n->cnt, rowScope );
+	if( n )	n = findFrozenMorkNode( frozen->rows + n->first, n->cnt, rowId );
+	if( !n )	return (morkCellEntry *) 0;
+	*cnt = n->cnt;
+	return frozen->cells + n->first;
+}
@@ -0,0 +1,230 @@
+/*-----------------------------------------------------------------------------
+ *    MorkJson.c - JSON Lines export of Mork databases
+ *
+ *    dumpJsonLines() writes one JSON object per row, each on a line of
+ *    its own, with the row's keys and its cells as column name/value
+ *    pairs:
+ *
+ *	{"tableScope":128,"tableId":1,"rowScope":128,"rowId":1,
+ *	 "cells":{"FirstName":"Jane","LastName":"Doe"}}
+ *
+ *    dumpMorkSkips() writes the input a recovering parse skipped over,
+ *    a line for each stretch with where it was in the file and why:
+ *
+ *	{"source":"abook.mab","start":1042,"end":1377,"bytes":335,
+ *	 "error":"row","char":88,"group":null}
+ *
+ *    The output is built up in a large buffer and handed to fwrite()
+ *    a buffer at a time. Strings are escaped a run at a time, bytes
+ *    that need no escape are found with a table and copied together.
+ *    Bytes above 0x7f are copied as they are when the string is valid
+ *    UTF-8. When it is not they are taken as ISO-8859-1, as the vCard
+ *    export does, and written as \u00XX so the line is still valid.
+ *
+ ----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "parseMork.h"
+#include "vCard.h"
+
+#define	morkErr(...)	if( morkErrfp ) fprintf( morkErrfp, ##__VA_ARGS__ )
+
+// Size of the output buffer
+#define	MORKJSONBUFSIZE	65536
+// Room always left for the longest thing added without a check
+// (an escaped byte or a number)
+#define	MORKJSONSLACK	32
+
+// The buffered writer
+typedef struct {
+	FILE	*ofp;
+	char	*buf;
+	int	len;
+} morkJsonWriter;
+
+// Escape for each byte, 0 if it is copied as it is, 'u' if it is
+// written as \u00XX, otherwise the letter following the backslash
+static const char morkJsonEscapes[256] = {
+	'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+	'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+	'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+	'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+	0, 0, '"', 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, '\\', 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,
+	// 0x80 - 0xff are copied in UTF-8 strings, \u00XX in others
+};
+
+static void flushMorkJson( morkJsonWriter *w ) {
+	if( w->len ) fwrite( w->buf, 1, w->len, w->ofp );
+	w->len = 0;
+}
+// Make sure there is room for n more bytes
+static void reserveMorkJson( morkJsonWriter *w, int n ) {
+	if( w->len + n > MORKJSONBUFSIZE )	flushMorkJson( w );
+}
+static void writeMorkJsonBytes( morkJsonWriter *w, const char *s, size_t n ) {
+	while( n > 0 ) {
+		size_t room = MORKJSONBUFSIZE - w->len;
+		if( !room ) {
+			flushMorkJson( w );
+			room = MORKJSONBUFSIZE;
+		}
+		if( room > n )	room = n;
+		memcpy( w->buf + w->len, s, room );
+		w->len += room;
+		s += room;
+		n -= room;
+	}
+}
+#define	writeMorkJsonLiteral(w,s)	writeMorkJsonBytes( w, s, sizeof(s) - 1 )
+
+static void writeMorkJsonId( morkJsonWriter *w, morkId id ) {
+	char digits[24];
+	unsigned long long u = id < 0 ? -(unsigned long long) id : id;
+	int n = 0;
+	reserveMorkJson( w, MORKJSONSLACK );
+	if( id < 0 )	w->buf[w->len++] = '-';
+	do {
+		digits[n++] = '0' + u % 10;
+		u /= 10;
+	} while( u );
+	while( n )	w->buf[w->len++] = digits[--n];
+}
+// Writes the string in quotes with the escapes JSON needs
+static void writeMorkJsonString( morkJsonWriter *w, const char *s ) {
+	static const char hex[] = "0123456789abcdef";
+	const unsigned char *p = (const unsigned char *) s;
+	// Bytes at or above this are written as \u00XX
+	unsigned int latin1 = vCardIsUtf8( s, strlen( s ) ) ? 0x100 : 0x80;
+	reserveMorkJson( w, MORKJSONSLACK );
+	w->buf[w->len++] = '"';
+	for( ;; ) {
+		// Copy the run of bytes that need nothing done
+		const unsigned char *run = p;
+		while( *p && !morkJsonEscapes[*p] && *p < latin1 )	++p;
+		writeMorkJsonBytes( w, (const char *) run, p - run );
+		if( !*p )	break;
+		reserveMorkJson( w, MORKJSONSLACK );
+		w->buf[w->len++] = '\\';
+		if( *p >= latin1 || morkJsonEscapes[*p] == 'u' ) {
+			w->buf[w->len++] = 'u';
+			w->buf[w->len++] = '0';
+			w->buf[w->len++] = '0';
+			w->buf[w->len++] = hex[*p >> 4];
+			w->buf[w->len++] = hex[*p & 0xf];
+		} else {
+			w->buf[w->len++] = morkJsonEscapes[*p];
+		}
+		++p;
+	}
+	reserveMorkJson( w, MORKJSONSLACK );
+	w->buf[w->len++] = '"';
+}
+static void writeMorkJsonRow( morkJsonWriter *w, morkDb *mork, morkId tableScope,
+		morkId tableId, morkId rowScope, morkId rowId, morkCells *cells ) {
+	int i;
+	writeMorkJsonLiteral( w, "{\"tableScope\":" );
+	writeMorkJsonId( w, tableScope );
+	writeMorkJsonLiteral( w, ",\"tableId\":" );
+	writeMorkJsonId( w, tableId );
+	writeMorkJsonLiteral( w, ",\"rowScope\":" );
+	writeMorkJsonId( w, rowScope );
+	writeMorkJsonLiteral( w, ",\"rowId\":" );
+	writeMorkJsonId( w, rowId );
+	writeMorkJsonLiteral( w, ",\"cells\":{" );
+	for( i = 0; i < cells->cnt; ++i ) {
+		if( i )	writeMorkJsonLiteral( w, "," );
+		writeMorkJsonString( w, getMorkCellColumn( mork, cells, i ) );
+		writeMorkJsonLiteral( w, ":" );
+		writeMorkJsonString( w, getMorkCellValue( mork, cells, i ) );
+	}
+	writeMorkJsonLiteral( w, "}}\n" );
+}
+
+// Writes every row of the Mork database as a line of JSON.
+// Returns the number of rows written.
+int dumpJsonLines( FILE *ofp, morkDb *mork ) {
+	morkJsonWriter	w;
+	int		rows = 0;
+	int		i, j, k, l;
+
+	if( !mork ) {
+		morkErr( "***** error: request to dump JSON from NULL Mork database\n" );
+		return 0;
+	}
+	w.ofp = ofp;
+	w.len = 0;
+	w.buf = malloc( MORKJSONBUFSIZE );
+	if( !w.buf ) {
+		morkErr( "***** error: unable to allocate JSON output buffer\n" );
+		return 0;
+	}
+	for( i = 0; i < mork->cnt; ++i ) {
+		morkTableMap *tableMap = mork->entries[i];
+		for( j = 0; j < tableMap->cnt; ++j ) {
+			rowScopeMap *scopeMap = tableMap->entries[j];
+			for( k = 0; k < scopeMap->cnt; ++k ) {
+				morkRowMap *rowMap = scopeMap->entries[k];
+				for( l = 0; l < rowMap->cnt; ++l, ++rows ) {
+					writeMorkJsonRow( &w, mork, mork->keys[i],
+						tableMap->keys[j], scopeMap->keys[k],
+						rowMap->keys[l], rowMap->entries[l] );
+				}
+			}
+		}
+	}
+	flushMorkJson( &w );
+	free( w.buf );
+	return rows;
+}
+// Writes a line of JSON for each stretch of input skipped by a parse
+// that recovered from errors. Returns the number of lines written.
+int dumpMorkSkips( FILE *ofp, morkDb *mork, const char *source ) {
+	morkJsonWriter	w;
+	int		i;
+
+	if( !mork ) {
+		morkErr( "***** error: request to dump skips from NULL Mork database\n" );
+		return 0;
+	}
+	w.ofp = ofp;
+	w.len = 0;
+	w.buf = malloc( MORKJSONBUFSIZE );
+	if( !w.buf ) {
+		morkErr( "***** error: unable to allocate JSON output buffer\n" );
+		return 0;
+	}
+	for( i = 0; i < mork->skipCnt; ++i ) {
+		morkSkip *s = &mork->skips[i];
+		writeMorkJsonLiteral( &w, "{\"source\":" );
+		writeMorkJsonString( &w, source ? source : "" );
+		writeMorkJsonLiteral( &w, ",\"start\":" );
+		writeMorkJsonId( &w, s->start );
+		writeMorkJsonLiteral( &w, ",\"end\":" );
+		writeMorkJsonId( &w, s->end );
+		writeMorkJsonLiteral( &w, ",\"bytes\":" );
+		writeMorkJsonId( &w, s->end - s->start );
+		writeMorkJsonLiteral( &w, ",\"error\":" );
+		writeMorkJsonString( &w, s->error );
+		writeMorkJsonLiteral( &w, ",\"char\":" );
+		writeMorkJsonId( &w, (unsigned char) s->errorChar );
+		writeMorkJsonLiteral( &w, ",\"group\":" );
+		if( s->groupId >= 0 )	writeMorkJsonId( &w, s->groupId );
+		else			writeMorkJsonLiteral( &w, "null" );
+		writeMorkJsonLiteral( &w, "}\n" );
+	}
+	flushMorkJson( &w );
+	free( w.buf );
+	return mork->skipCnt;
+}
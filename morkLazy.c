@@ -0,0 +1,431 @@
+/*-----------------------------------------------------------------------------
+ *    MorkLazy.c - Parse the tables of a Mork file as they are wanted
+ *
+ *    openMorkLazyFile() runs the file through the lexer only, with the
+ *    row cells skipped undecoded as countMorkStream() does, and notes
+ *    where each dictionary, table and top level row ends. The file is
+ *    cut into parts at those ends and each part goes from the end of
+ *    the last one to the end of its own construct. The parts in a
+ *    group are only kept once the group commits, the parts of an
+ *    aborted group are dropped as the parser would drop them.
+ *
+ *    The dictionary parts are fed to a push parser as soon as the file
+ *    has been gone through. The parser is kept and the parts of a table
+ *    are read back from the file and fed to it the first time the table
+ *    is asked for, so only the bytes of the tables wanted are parsed.
+ *    Rows can not move from one table to another so a table parsed on
+ *    its own ends up the same as in a parse of the whole file. The ids
+ *    given to literal values depend on the order the tables are loaded
+ *    in, but they are only ever used to look the values up.
+ *
+ *    The bytes skipped after an error (when recovering from them) go
+ *    with the part the error was in and are noted as the part is
+ *    parsed, those in an aborted group never are. A table the file
+ *    ends in the middle of, or that a parse not recovering from errors
+ *    stopped in, keeps the rows up to the last whole one. Any other
+ *    construct cut short is left out. The file must not change while
+ *    it is open.
+ *
+ ----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "parseMork.h"
+#include "morkLexer.h"
+
+typedef int	bool;
+#define	true	1
+#define	false	0
+
+#define	morkErr(...)	if( morkErrfp ) fprintf( morkErrfp, ##__VA_ARGS__ )
+
+// From parseMork.c
+void parseScopeId( const char *textId, morkId *id, morkId *scope );
+void reportMorkLexError( morkLexer *lex );
+void seekMorkParser( morkParser *p, long long offset );
+
+// What a part of the file ends with
+typedef enum {
+	MLNone,
+	MLDict,		// A dictionary
+	MLTable,	// A table or top level rows, of the table noted
+	MLRow,		// (While indexing, a top level row is open)
+	MLOther,	// Bytes skipped after an error at the top level
+} morkLazyKind;
+// A part of the file
+typedef struct {
+	long long	start;
+	long long	end;
+	morkLazyKind	kind;
+	morkId		tableScope;	// Table the rows are in (MLTable)
+	morkId		tableId;
+	int		groupId;	// Group it was in, -1 if none
+	bool		cut;		// The table does not end, a '}' ends it
+} morkLazyPart;
+struct morkLazyDb {
+	FILE		*ifp;
+	morkParser	*parser;	// Has the dictionaries and loaded tables
+	int		partCnt;
+	int		partSize;
+	morkLazyPart	*parts;		// In the order the parser applies them
+	int		tableCnt;
+	int		tableSize;
+	morkLazyTable	*tables;	// In key order
+};
+
+// The indexing state
+typedef struct {
+	morkLazyDb	*lazy;
+	morkLexer	lex;
+	long long	pos;		// Where the next part starts
+	morkLazyKind	open;		// Construct open at the top level
+	morkId		tableScope;	// Table of the open table or row
+	morkId		tableId;
+	long long	rowEnd;		// End of the last whole row of the table
+	bool		justEnded;	// The last token ended a part
+	bool		inGroup;
+	int		groupId;
+	int		groupFirst;	// First part of the open group
+} morkLazyIndexer;
+
+// Notes the part ending here, a part of the same table right after
+// the last one is added to it
+static void endMorkLazyPart( morkLazyIndexer *k, morkLazyKind kind ) {
+	morkLazyDb *lazy = k->lazy;
+	morkLazyPart *last = lazy->partCnt ? &lazy->parts[lazy->partCnt-1] : (morkLazyPart *) 0;
+	long long end = k->lex.offset;
+	int groupId = k->inGroup ? k->groupId : -1;
+	if( kind == MLTable && last && last->kind == MLTable && last->end == k->pos &&
+	    last->tableScope == k->tableScope && last->tableId == k->tableId &&
+	    last->groupId == groupId && (!k->inGroup || lazy->partCnt > k->groupFirst) ) {
+		last->end = end;
+	} else {
+		if( lazy->partCnt >= lazy->partSize ) {
+			lazy->partSize = lazy->partSize ? lazy->partSize * 2 : 64;
+			lazy->parts = realloc( lazy->parts, lazy->partSize * sizeof(*lazy->parts) );
+		}
+		last = &lazy->parts[lazy->partCnt++];
+		last->start = k->pos;
+		last->end = end;
+		last->kind = kind;
+		last->tableScope = kind == MLTable ? k->tableScope : 0;
+		last->tableId = kind == MLTable ? k->tableId : 0;
+		last->groupId = groupId;
+		last->cut = false;
+	}
+	k->pos = end;
+	k->open = MLNone;
+	k->justEnded = true;
+}
+// Group markers are not in any part, what is in the group is dropped
+// unless it commits as parseMorkToken() has it
+static void indexMorkGroup( morkLazyIndexer *k, const morkToken *token ) {
+	k->pos = k->lex.offset;
+	if( morkDoNotParseGroups )	return;
+	switch( token->type ) {
+	case MTGroupStart:
+		if( k->inGroup )	k->lazy->partCnt = k->groupFirst;
+		k->inGroup = true;
+		k->groupId = token->id;
+		k->groupFirst = k->lazy->partCnt;
+		break;
+	case MTGroupCommit:
+		if( k->inGroup && token->id != k->groupId )
+			k->lazy->partCnt = k->groupFirst;
+		k->inGroup = false;
+		break;
+	default:
+		if( k->inGroup )	k->lazy->partCnt = k->groupFirst;
+		k->inGroup = false;
+		break;
+	}
+}
+static int indexMorkToken( void *arg, const morkToken *token ) {
+	morkLazyIndexer *k = (morkLazyIndexer *) arg;
+	bool justEnded = k->justEnded;
+	k->justEnded = false;
+	switch( token->type ) {
+	case MTDictOpen:
+		k->open = MLDict;
+		break;
+	case MTDictClose:
+		endMorkLazyPart( k, MLDict );
+		break;
+	case MTTableOpen:
+		k->open = MLTable;
+		k->tableId = 0;
+		k->tableScope = 0;
+		parseScopeId( token->text, &k->tableId, &k->tableScope );
+		if( !k->tableScope )	k->tableScope = MORKDEFAULTSCOPE;
+		k->rowEnd = 0;
+		break;
+	case MTTableClose:
+		if( k->open == MLTable )	endMorkLazyPart( k, MLTable );
+		break;
+	case MTRowOpen:
+		// A row outside of any table is in table 0 of the default scope
+		if( k->open == MLNone ) {
+			k->open = MLRow;
+			k->tableId = 0;
+			k->tableScope = MORKDEFAULTSCOPE;
+		}
+		break;
+	case MTRowClose:
+		if( k->open == MLRow )	endMorkLazyPart( k, MLTable );
+		else if( k->open == MLTable )	k->rowEnd = k->lex.offset;
+		break;
+	case MTOid:
+		if( k->open == MLTable )	k->rowEnd = k->lex.offset;
+		break;
+	case MTSkipped:
+		if( justEnded ) {
+			// The row the error was in was just closed
+			k->lazy->parts[k->lazy->partCnt-1].end = k->lex.offset;
+			k->pos = k->lex.offset;
+		} else if( k->open == MLTable && k->lex.skipInTable ) {
+			// The table goes on, or its end comes next
+			k->rowEnd = k->lex.offset;
+		} else {
+			endMorkLazyPart( k, k->open == MLNone ? MLOther :
+					    k->open == MLDict ? MLDict : MLTable );
+		}
+		break;
+	case MTGroupStart:
+	case MTGroupCommit:
+	case MTGroupAbort:
+		indexMorkGroup( k, token );
+		break;
+	default:
+		break;
+	}
+	return true;
+}
+// Skips the values of row cells, the index does not need them
+static int skipMorkLazyCell( void *arg, const char *column, int columnLen, int flags ) {
+	return false;
+}
+
+// Index of the first table not before the key
+static int findMorkLazyTable( morkLazyDb *lazy, morkId tableScope, morkId tableId ) {
+	int lo = 0, hi = lazy->tableCnt;
+	while( lo < hi ) {
+		int mid = lo + (hi - lo) / 2;
+		morkLazyTable *t = &lazy->tables[mid];
+		if( t->tableScope < tableScope ||
+		    (t->tableScope == tableScope && t->tableId < tableId) )
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+// Lists the tables of the parts
+static void listMorkLazyTables( morkLazyDb *lazy ) {
+	int i, j;
+	for( i = 0; i < lazy->partCnt; ++i ) {
+		morkLazyPart *s = &lazy->parts[i];
+		morkLazyTable *t;
+		if( s->kind != MLTable )	continue;
+		j = findMorkLazyTable( lazy, s->tableScope, s->tableId );
+		if( j >= lazy->tableCnt || lazy->tables[j].tableScope != s->tableScope ||
+		    lazy->tables[j].tableId != s->tableId ) {
+			if( lazy->tableCnt >= lazy->tableSize ) {
+				lazy->tableSize = lazy->tableSize ? lazy->tableSize * 2 : 16;
+				lazy->tables = realloc( lazy->tables, lazy->tableSize * sizeof(*lazy->tables) );
+			}
+			memmove( lazy->tables + j + 1, lazy->tables + j,
+				(lazy->tableCnt - j) * sizeof(*lazy->tables) );
+			lazy->tableCnt++;
+			t = &lazy->tables[j];
+			memset( t, 0, sizeof(*t) );
+			t->tableScope = s->tableScope;
+			t->tableId = s->tableId;
+		}
+		t = &lazy->tables[j];
+		t->bytes += s->end - s->start;
+	}
+}
+// Puts the skips noted from first on in file order with the others
+// and in the part's group, the parser was not in it
+static void placeMorkLazySkips( morkDb *mork, int first, int groupId ) {
+	int i, j;
+	for( i = first; i < mork->skipCnt; ++i ) {
+		morkSkip s = mork->skips[i];
+		s.groupId = groupId;
+		for( j = i; j > 0 && mork->skips[j-1].start > s.start; --j )
+			mork->skips[j] = mork->skips[j-1];
+		mork->skips[j] = s;
+	}
+}
+// Reads a part back from the file and feeds it to the parser
+static bool feedMorkLazyPart( morkLazyDb *lazy, const morkLazyPart *s ) {
+	morkDb		*mork = morkParserDb( lazy->parser );
+	char		*buf = malloc( MORKREADSIZE );
+	long long	left = s->end - s->start;
+	int		skipCnt = mork->skipCnt;
+	bool		ok = buf && fseek( lazy->ifp, s->start, SEEK_SET ) == 0;
+
+	seekMorkParser( lazy->parser, s->start );
+	while( ok && left > 0 ) {
+		size_t n = fread( buf, 1, left < MORKREADSIZE ? left : MORKREADSIZE, lazy->ifp );
+		if( !n )	break;
+		ok = morkParserFeed( lazy->parser, buf, n );
+		left -= n;
+	}
+	free( buf );
+	if( ok && !left && s->cut )	ok = morkParserFeed( lazy->parser, "}", 1 );
+	// A skip running to the end of the part ends with it
+	seekMorkParser( lazy->parser, s->end );
+	placeMorkLazySkips( mork, skipCnt, s->groupId );
+	return ok && !left;
+}
+// The rows of a table of the Mork database, NULL if it has none
+static rowScopeMap *findMorkLazyRows( morkDb *mork, morkId tableScope, morkId tableId ) {
+	int i, j;
+	for( i = 0; i < mork->cnt; ++i ) {
+		morkTableMap *tableMap = mork->entries[i];
+		if( mork->keys[i] != tableScope )	continue;
+		for( j = 0; j < tableMap->cnt; ++j ) {
+			if( tableMap->keys[j] == tableId )	return tableMap->entries[j];
+		}
+	}
+	return (rowScopeMap *) 0;
+}
+
+// Notes where the parts of the file are and parses the dictionaries.
+// Returns NULL if it is not a Mork file. The options are kept for the
+// tables as they are loaded, except for progress calls and presize.
+morkLazyDb *openMorkLazyFile( const char *filename, const morkParseOptions *options ) {
+	morkLazyIndexer		k;
+	morkParseOptions	lazyOptions;
+	morkLazyDb		*lazy;
+	char			*buf;
+	size_t			n;
+	bool			ok = true;
+	int			i;
+
+	memset( &lazyOptions, 0, sizeof(lazyOptions) );
+	if( options )	lazyOptions = *options;
+	lazyOptions.progress = NULL;
+	lazyOptions.presize = false;
+	lazy = calloc( 1, sizeof(*lazy) );
+	buf = malloc( MORKREADSIZE );
+	if( !lazy || !buf ) {
+		morkErr( "***** error: unable to allocate lazy Mork file\n" );
+		free( lazy );
+		free( buf );
+		return (morkLazyDb *) 0;
+	}
+	lazy->ifp = fopen( filename, "r" );
+	if( !lazy->ifp ) {
+		morkErr( "error: unable to read file \"%s\"\n", filename );
+		free( lazy );
+		free( buf );
+		return (morkLazyDb *) 0;
+	}
+
+	// Find the parts
+	memset( &k, 0, sizeof(k) );
+	k.lazy = lazy;
+	k.pos = strlen( MorkMagicHeader );
+	morkLexerInit( &k.lex, indexMorkToken, &k );
+	k.lex.filter = skipMorkLazyCell;
+	k.lex.resync = lazyOptions.recover;
+	while( ok && (n = fread( buf, 1, MORKREADSIZE, lazy->ifp )) > 0 )
+		ok = morkLexerFeed( &k.lex, buf, n );
+	if( ok )	morkLexerFinish( &k.lex );
+	free( buf );
+	if( k.lex.error == LEHeader ) {
+		reportMorkLexError( &k.lex );
+		morkLexerFree( &k.lex );
+		freeMorkLazyDb( lazy );
+		return (morkLazyDb *) 0;
+	}
+	if( k.lex.error )	reportMorkLexError( &k.lex );
+	// A table cut short keeps its whole rows
+	if( k.open == MLTable && k.rowEnd ) {
+		k.lex.offset = k.rowEnd;
+		endMorkLazyPart( &k, MLTable );
+		lazy->parts[lazy->partCnt-1].cut = true;
+	}
+	// A group that never ended is dropped
+	if( k.inGroup )		lazy->partCnt = k.groupFirst;
+	morkLexerFree( &k.lex );
+	listMorkLazyTables( lazy );
+
+	// Parse the dictionaries
+	lazy->parser = morkParserCreate();
+	if( !lazy->parser || !morkParserSetOptions( lazy->parser, &lazyOptions ) ) {
+		morkErr( "***** error: unable to allocate mork database structure\n" );
+		freeMorkLazyDb( lazy );
+		return (morkLazyDb *) 0;
+	}
+	morkParserFeed( lazy->parser, MorkMagicHeader, strlen( MorkMagicHeader ) );
+	for( i = 0; i < lazy->partCnt; ++i ) {
+		if( lazy->parts[i].kind == MLTable )	continue;
+		if( !feedMorkLazyPart( lazy, &lazy->parts[i] ) )	break;
+	}
+	return lazy;
+}
+// The Mork database with the dictionaries and the tables loaded so far.
+// It is still the lazy file's.
+morkDb *getMorkLazyDb( morkLazyDb *lazy ) {
+	return morkParserDb( lazy->parser );
+}
+// The tables of the file, in key order
+const morkLazyTable *getMorkLazyTables( morkLazyDb *lazy, int *cnt ) {
+	*cnt = lazy->tableCnt;
+	return lazy->tables;
+}
+// Parses the rows of the table if they have not been yet. Returns them,
+// or NULL if the file does not have the table. A table scope of 0 is
+// the default scope.
+rowScopeMap *loadMorkLazyTable( morkLazyDb *lazy, morkId tableScope, morkId tableId ) {
+	morkLazyTable *t;
+	int i;
+	if( !tableScope )	tableScope = MORKDEFAULTSCOPE;
+	i = findMorkLazyTable( lazy, tableScope, tableId );
+	if( i >= lazy->tableCnt || lazy->tables[i].tableScope != tableScope ||
+	    lazy->tables[i].tableId != tableId )
+		return (rowScopeMap *) 0;
+	t = &lazy->tables[i];
+	if( !t->loaded ) {
+		t->loaded = true;
+		for( i = 0; i < lazy->partCnt; ++i ) {
+			morkLazyPart *s = &lazy->parts[i];
+			if( s->kind != MLTable || s->tableScope != tableScope || s->tableId != tableId )
+				continue;
+			if( !feedMorkLazyPart( lazy, s ) )	break;
+		}
+	}
+	return findMorkLazyRows( morkParserDb( lazy->parser ), tableScope, tableId );
+}
+// Parses the rows of every table not loaded yet, in file order.
+// Returns false if a part could not be read.
+int loadMorkLazyTables( morkLazyDb *lazy ) {
+	bool ok = true;
+	int i, j;
+	for( i = 0; ok && i < lazy->partCnt; ++i ) {
+		morkLazyPart *s = &lazy->parts[i];
+		if( s->kind != MLTable )	continue;
+		j = findMorkLazyTable( lazy, s->tableScope, s->tableId );
+		if( !lazy->tables[j].loaded )	ok = feedMorkLazyPart( lazy, s );
+	}
+	for( j = 0; j < lazy->tableCnt; ++j )	lazy->tables[j].loaded = true;
+	return ok;
+}
+// Closes the file and returns the Mork database with what was loaded
+morkDb *finishMorkLazyFile( morkLazyDb *lazy ) {
+	morkDb *mork = morkParserFinish( lazy->parser );
+	lazy->parser = (morkParser *) 0;
+	freeMorkLazyDb( lazy );
+	return mork;
+}
+void freeMorkLazyDb( morkLazyDb *lazy ) {
+	if( !lazy )	return;
+	morkParserFree( lazy->parser );
+	if( lazy->ifp )	fclose( lazy->ifp );
+	free( lazy->parts );
+	free( lazy->tables );
+	free( lazy );
+}
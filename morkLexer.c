@@ -0,0 +1,634 @@
+/*-----------------------------------------------------------------------------
+ *    MorkLexer.c - Table driven tokenizer for Mork (abook.mab) files
+ *
+ *    The grammar handled here is the one the original per-construct
+ *    parsing functions accepted:
+ *
+ *	top	: '<' dict '>' | '//' comment | '{' table '}' | '[' row ']'
+ *		| '@' group '@'
+ *	dict	: ( '<' meta '>' | '(' cell ')' | '//' comment )*
+ *	cell	: ['^'] column ( '=' literal | '^' oid )
+ *	table	: id ( '{' meta '}' | '[' row ']' | oid | '-' | '+' )*
+ *	row	: id ( '(' cell ')' | '[' meta ']' )*
+ *
+ *    In literals '\' escapes the next character (or hides a line
+ *    break) and '$XX' is a hex encoded byte.
+ *
+ *    When there is a cell filter it is asked about each row cell once
+ *    its column is known and the value of a cell it turns down is
+ *    skipped over without being decoded or stored.
+ *
+ ----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "parseMork.h"
+#include "morkLexer.h"
+
+typedef int	bool;
+#define	true	1
+#define	false	0
+
+// Lexer states
+enum {
+	LHeader,	// Matching the magic header
+	LTop,		// Between top level constructs
+	LComment1,	// Got the first '/' of a comment
+	LComment,	// In a comment, until the end of the line
+	LDict,		// In a dictionary
+	LDictMeta,	// In a '<...>' inside a dictionary
+	LCellColumn,	// In the column part of a cell
+	LCellValue,	// In the value part of a cell
+	LCellEscape,	// Got a '\' in a cell value
+	LCellHex1,	// Got a '$' in a cell value
+	LCellHex2,	// Got the first hex digit of a '$XX'
+	LCellSkip,	// In the value of a cell the filter turned down
+	LCellSkipEscape,// Got a '\' in a skipped value
+	LTableId,	// Getting a table id
+	LTableBody,	// Between the constructs in a table
+	LTableOid,	// Getting a row reference in a table
+	LTableMeta,	// In a '{...}' inside a table
+	LRowId,		// Getting a row id
+	LRowBody,	// Between the cells of a row
+	LRowMeta,	// In a '[...]' inside a row
+	LGroup,		// Between the '@'s of a group marker
+	LSkip,		// Skipping after an error (resync set)
+	LSkipEscape,	// Got a '\' while skipping
+	LSkipEol,	// Got a line end while skipping
+	LDone,		// Hit a '\0', ignore everything else
+	LError,		// Stopped on an error
+	LNumStates
+};
+
+// Character classes
+enum {
+	COther,
+	CSpace,		// Blanks that are not line ends
+	CEol,		// '\r' and '\n'
+	CNul,		// '\0'
+	CLt,		// '<'
+	CGt,		// '>'
+	CLParen,	// '('
+	CRParen,	// ')'
+	CLBrace,	// '{'
+	CRBrace,	// '}'
+	CLBracket,	// '['
+	CRBracket,	// ']'
+	CSlash,		// '/'
+	CAt,		// '@'
+	CEq,		// '='
+	CCaret,		// '^'
+	CBackslash,	// '\'
+	CDollar,	// '$'
+	CSign,		// '+' and '-'
+	CNumClasses
+};
+
+// Actions, the first three are the only ones that can run over
+// more than one byte at a time
+enum {
+	AIgnore,
+	AAppendText,
+	AAppendValue,
+	AError,
+	AColumnCaret,
+	AColumnEq,
+	ACellSkipped,
+	AHex1,
+	AHex2,
+	ACommentStart,
+	AComment,
+	ADictOpen,
+	ADictClose,
+	ADictMeta,
+	ACellStart,
+	ACell,
+	ATableOpen,
+	ATableOpenRow,
+	ATableOpenClose,
+	ATableClose,
+	ATableMeta,
+	AOid,
+	AOidRow,
+	AOidClose,
+	ARowStart,
+	ARowOpen,
+	ARowOpenCell,
+	ARowOpenClose,
+	ARowClose,
+	ARowMeta,
+	AGroup,
+	AResync,
+};
+
+// A transition is the action in the high byte and the next state
+// in the low byte
+typedef unsigned short	morkTransition;
+#define	T(action,next)	(((action) << 8) | (next))
+#define	TAction(t)	((t) >> 8)
+#define	TNext(t)	((t) & 0xff)
+
+static const unsigned char morkCharClass[256] = {
+	[0 ... 255]	= COther,
+	['\0']	= CNul,
+	[' ']	= CSpace,
+	['\t']	= CSpace,
+	['\v']	= CSpace,
+	['\f']	= CSpace,
+	['\r']	= CEol,
+	['\n']	= CEol,
+	['<']	= CLt,
+	['>']	= CGt,
+	['(']	= CLParen,
+	[')']	= CRParen,
+	['{']	= CLBrace,
+	['}']	= CRBrace,
+	['[']	= CLBracket,
+	[']']	= CRBracket,
+	['/']	= CSlash,
+	['@']	= CAt,
+	['=']	= CEq,
+	['^']	= CCaret,
+	['\\']	= CBackslash,
+	['$']	= CDollar,
+	['+']	= CSign,
+	['-']	= CSign,
+};
+
+static const signed char morkHexValue[256] = {
+	[0 ... 255] = -1,
+	['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4,
+	['5'] = 5, ['6'] = 6, ['7'] = 7, ['8'] = 8, ['9'] = 9,
+	['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15,
+	['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15,
+};
+
+// Every state ends on a '\0' just like the original loops did
+#define	ALL		[0 ... CNumClasses-1]
+#define	BLANKS(s)	[CSpace] = T(AIgnore,s), [CEol] = T(AIgnore,s)
+#define	NUL		[CNul] = T(AIgnore,LDone)
+
+static const morkTransition morkTransitions[LNumStates][CNumClasses] = {
+	[LTop] = {
+		ALL		= T(AError,LError),
+		BLANKS(LTop), NUL,
+		[CLt]		= T(ADictOpen,LDict),
+		[CSlash]	= T(ACommentStart,LComment1),
+		[CLBrace]	= T(AIgnore,LTableId),
+		[CLBracket]	= T(ARowStart,LRowId),
+		[CAt]		= T(AIgnore,LGroup),
+	},
+	[LComment1] = {
+		ALL		= T(AError,LError),
+		NUL,
+		[CSlash]	= T(AIgnore,LComment),
+	},
+	[LComment] = {
+		ALL		= T(AAppendText,LComment),
+		NUL,
+		[CEol]		= T(AComment,LTop),
+	},
+	[LDict] = {
+		ALL		= T(AIgnore,LDict),
+		NUL,
+		[CGt]		= T(ADictClose,LTop),
+		[CLt]		= T(AIgnore,LDictMeta),
+		[CLParen]	= T(ACellStart,LCellColumn),
+		[CSlash]	= T(ACommentStart,LComment1),
+	},
+	[LDictMeta] = {
+		ALL		= T(AAppendText,LDictMeta),
+		NUL,
+		[CGt]		= T(ADictMeta,LDict),
+	},
+	[LCellColumn] = {
+		ALL		= T(AAppendText,LCellColumn),
+		BLANKS(LCellColumn), NUL,
+		[CCaret]	= T(AColumnCaret,LCellColumn),
+		[CEq]		= T(AColumnEq,LCellValue),
+		[CRParen]	= T(ACell,LTop),
+	},
+	[LCellValue] = {
+		ALL		= T(AAppendValue,LCellValue),
+		NUL,
+		[CRParen]	= T(ACell,LTop),
+		[CBackslash]	= T(AIgnore,LCellEscape),
+		[CDollar]	= T(AIgnore,LCellHex1),
+	},
+	[LCellEscape] = {
+		ALL		= T(AAppendValue,LCellValue),
+		NUL,
+		[CEol]		= T(AIgnore,LCellValue),
+	},
+	[LCellHex1] = {
+		ALL		= T(AHex1,LCellHex2),
+		NUL,
+	},
+	[LCellHex2] = {
+		ALL		= T(AHex2,LCellValue),
+		NUL,
+	},
+	[LCellSkip] = {
+		ALL		= T(AIgnore,LCellSkip),
+		NUL,
+		[CRParen]	= T(ACellSkipped,LTop),
+		[CBackslash]	= T(AIgnore,LCellSkipEscape),
+	},
+	[LCellSkipEscape] = {
+		ALL		= T(AIgnore,LCellSkip),
+		NUL,
+	},
+	[LTableId] = {
+		ALL		= T(AAppendText,LTableId),
+		BLANKS(LTableId), NUL,
+		[CLBrace]	= T(ATableOpen,LTableMeta),
+		[CLBracket]	= T(ATableOpenRow,LRowId),
+		[CRBrace]	= T(ATableOpenClose,LTop),
+	},
+	[LTableBody] = {
+		ALL		= T(AAppendText,LTableOid),
+		BLANKS(LTableBody), NUL,
+		[CLBrace]	= T(AIgnore,LTableMeta),
+		[CLBracket]	= T(ARowStart,LRowId),
+		[CRBrace]	= T(ATableClose,LTop),
+		[CSign]		= T(AIgnore,LTableBody),
+	},
+	[LTableOid] = {
+		ALL		= T(AAppendText,LTableOid),
+		[CSpace]	= T(AOid,LTableBody),
+		[CEol]		= T(AOid,LTableBody),
+		[CNul]		= T(AOid,LDone),
+		[CLBrace]	= T(AOid,LTableMeta),
+		[CLBracket]	= T(AOidRow,LRowId),
+		[CRBrace]	= T(AOidClose,LTop),
+	},
+	[LTableMeta] = {
+		ALL		= T(AAppendText,LTableMeta),
+		NUL,
+		[CRBrace]	= T(ATableMeta,LTableBody),
+	},
+	[LRowId] = {
+		ALL		= T(AAppendText,LRowId),
+		BLANKS(LRowId), NUL,
+		[CLParen]	= T(ARowOpenCell,LCellColumn),
+		[CLBracket]	= T(ARowOpen,LRowMeta),
+		[CRBracket]	= T(ARowOpenClose,LTop),
+	},
+	[LRowBody] = {
+		ALL		= T(AError,LError),
+		BLANKS(LRowBody), NUL,
+		[CLParen]	= T(ACellStart,LCellColumn),
+		[CLBracket]	= T(AIgnore,LRowMeta),
+		[CRBracket]	= T(ARowClose,LTop),
+	},
+	[LRowMeta] = {
+		ALL		= T(AAppendText,LRowMeta),
+		NUL,
+		[CRBracket]	= T(ARowMeta,LRowBody),
+	},
+	[LGroup] = {
+		ALL		= T(AAppendText,LGroup),
+		NUL,
+		[CAt]		= T(AGroup,LTop),
+	},
+	// After an error, a line starting with the start of a top level
+	// construct is where to pick up again. An escaped line end is
+	// inside a cell value. A '\0' does not end it, it may just be
+	// more of the damage. The rows of a table are often indented.
+	[LSkip] = {
+		ALL		= T(AIgnore,LSkip),
+		[CEol]		= T(AIgnore,LSkipEol),
+		[CBackslash]	= T(AIgnore,LSkipEscape),
+	},
+	[LSkipEscape] = {
+		ALL		= T(AIgnore,LSkip),
+	},
+	[LSkipEol] = {
+		ALL		= T(AIgnore,LSkip),
+		BLANKS(LSkipEol),
+		[CBackslash]	= T(AIgnore,LSkipEscape),
+		[CLt]		= T(AResync,LTop),
+		[CLBrace]	= T(AResync,LTop),
+		[CLBracket]	= T(AResync,LTop),
+		[CAt]		= T(AResync,LTop),
+	},
+	[LDone] = {
+		ALL		= T(AIgnore,LDone),
+	},
+	[LError] = {
+		ALL		= T(AIgnore,LError),
+	},
+};
+
+void morkLexerInit( morkLexer *lex, morkTokenHandler handler, void *arg ) {
+	memset( lex, 0, sizeof(*lex) );
+	lex->state = LHeader;
+	lex->returnState = LTop;
+	lex->rowReturn = LTop;
+	lex->textSize = 64;
+	lex->text = malloc( lex->textSize );
+	lex->valueSize = 64;
+	lex->value = malloc( lex->valueSize );
+	lex->handler = handler;
+	lex->arg = arg;
+}
+void morkLexerFree( morkLexer *lex ) {
+	free( lex->text );
+	lex->text = NULL;
+	free( lex->value );
+	lex->value = NULL;
+	lex->textSize = lex->valueSize = 0;
+}
+static void morkLexerAppend( char **buf, int *len, int *size, const unsigned char *src, int n ) {
+	if( *len + n + 1 > *size ) {
+		while( *len + n + 1 > *size )	*size *= 2;
+		*buf = realloc( *buf, *size );
+	}
+	memcpy( *buf + *len, src, n );
+	*len += n;
+}
+// Hand a token to the handler and reset for the next one
+static int morkLexerEmit( morkLexer *lex, morkTokenType type, int id ) {
+	morkToken token;
+	int result;
+	lex->text[lex->textLen] = '\0';
+	lex->value[lex->valueLen] = '\0';
+	token.type = type;
+	token.flags = lex->flags;
+	token.id = id;
+	token.text = lex->text;
+	token.textLen = lex->textLen;
+	token.value = lex->value;
+	token.valueLen = lex->valueLen;
+	result = lex->handler( lex->arg, &token );
+	lex->textLen = 0;
+	lex->valueLen = 0;
+	lex->flags = 0;
+	if( !result )	lex->error = LEHandler;
+	return result;
+}
+// Whether to keep a row cell, asked once its column is known
+static int morkLexerWantCell( morkLexer *lex ) {
+	if( !lex->filter || lex->returnState != LRowBody )	return true;
+	lex->text[lex->textLen] = '\0';
+	return lex->filter( lex->arg, lex->text, lex->textLen, lex->flags );
+}
+// Group markers are '$${id{', '$$}id}' or '$$}~abort~id}'
+static int morkLexerEmitGroup( morkLexer *lex ) {
+	const char *t = lex->text;
+	int n = lex->textLen;
+	lex->text[n] = '\0';
+	if( n > 4 && t[n-1] == '{' && strncmp( t, "$${", 3 ) == 0 &&
+	    morkHexValue[(unsigned char) t[3]] >= 0 ) {
+		return morkLexerEmit( lex, MTGroupStart, strtol( &t[3], NULL, 16 ) );
+	}
+	if( n > 4 && t[n-1] == '}' && strncmp( t, "$$}", 3 ) == 0 &&
+	    morkHexValue[(unsigned char) t[3]] >= 0 ) {
+		return morkLexerEmit( lex, MTGroupCommit, strtol( &t[3], NULL, 16 ) );
+	}
+	if( n > 10 && t[n-1] == '}' && strncmp( t, "$$}~abort~", 10 ) == 0 &&
+	    morkHexValue[(unsigned char) t[10]] >= 0 ) {
+		return morkLexerEmit( lex, MTGroupAbort, strtol( &t[10], NULL, 16 ) );
+	}
+	if( strncmp( t, "$$}", 3 ) == 0 ) {
+		return morkLexerEmit( lex, MTGroupAbort, -1 );
+	}
+	return morkLexerEmit( lex, MTMeta, 0 );
+}
+int morkLexerFeed( morkLexer *lex, const char *buf, size_t len ) {
+	const unsigned char *p = (const unsigned char *) buf;
+	const unsigned char *end = p + len;
+	long start = lex->offset;
+	bool ok = true;
+
+	if( lex->error )	return false;
+
+	// It should start with the MorkMagicHeader
+	while( lex->state == LHeader && p < end ) {
+		morkLexerAppend( &lex->text, &lex->textLen, &lex->textSize, p, 1 );
+		if( *p != (unsigned char) MorkMagicHeader[lex->headerPos] ) {
+			lex->text[lex->textLen] = '\0';
+			lex->error = LEHeader;
+			lex->state = LError;
+			return false;
+		}
+		++p;
+		if( !MorkMagicHeader[++lex->headerPos] ) {
+			lex->textLen = 0;
+			lex->state = LTop;
+		}
+	}
+
+	while( ok && p < end ) {
+		int state = lex->state;
+		morkTransition t = morkTransitions[state][morkCharClass[*p]];
+		int next = TNext(t);
+
+		switch( TAction(t) ) {
+		case AIgnore:
+		case AAppendText:
+		case AAppendValue: {
+			// Take the whole run of bytes with the same transition
+			const morkTransition *row = morkTransitions[next];
+			const unsigned char *run = p++;
+			while( p < end && row[morkCharClass[*p]] == t )	++p;
+			if( TAction(t) == AAppendText ) {
+				morkLexerAppend( &lex->text, &lex->textLen,
+					&lex->textSize, run, p - run );
+			} else if( TAction(t) == AAppendValue ) {
+				morkLexerAppend( &lex->value, &lex->valueLen,
+					&lex->valueSize, run, p - run );
+			}
+			lex->state = next;
+			continue;
+			}
+		case AError:
+			lex->errorChar = *p;
+			lex->error = state == LComment1 ? LEComment :
+				     state == LRowBody ? LERow : LEFormat;
+			if( !lex->resync ) {
+				ok = false;
+				break;
+			}
+			// Close the row it was in and skip ahead
+			lex->skipError = lex->error;
+			lex->skipStart = start + (p - (const unsigned char *) buf);
+			lex->skipInTable = state == LRowBody && lex->rowReturn == LTableBody;
+			lex->error = LENone;
+			lex->returnState = LTop;
+			lex->rowReturn = LTop;
+			if( state == LRowBody )	ok = morkLexerEmit( lex, MTRowClose, 0 );
+			lex->textLen = 0;
+			lex->flags = 0;
+			next = morkCharClass[*p] == CEol ? LSkipEol : LSkip;
+			break;
+		case AColumnCaret:
+			if( lex->textLen == 0 && !(lex->flags & MTFColumnOid) ) {
+				lex->flags |= MTFColumnOid;
+			} else {
+				lex->flags |= MTFValueOid;
+				next = morkLexerWantCell( lex ) ? LCellValue : LCellSkip;
+			}
+			break;
+		case AColumnEq:
+			if( !morkLexerWantCell( lex ) )	next = LCellSkip;
+			break;
+		case ACellSkipped:
+			lex->textLen = 0;
+			lex->valueLen = 0;
+			lex->flags = 0;
+			next = lex->returnState;
+			break;
+		case AHex1:
+			lex->hex = morkHexValue[*p];
+			break;
+		case AHex2:
+			if( lex->hex >= 0 && morkHexValue[*p] >= 0 ) {
+				lex->hex = lex->hex * 16 + morkHexValue[*p];
+			} else if( lex->hex < 0 ) {
+				lex->hex = 0;
+			}
+			{
+				unsigned char c = lex->hex;
+				morkLexerAppend( &lex->value, &lex->valueLen,
+					&lex->valueSize, &c, 1 );
+			}
+			break;
+		case ACommentStart:
+			lex->returnState = state;
+			break;
+		case AComment:
+			ok = morkLexerEmit( lex, MTComment, 0 );
+			next = lex->returnState;
+			break;
+		case ADictOpen:
+			ok = morkLexerEmit( lex, MTDictOpen, 0 );
+			break;
+		case ADictClose:
+			// The handler can tell where each construct ends
+			lex->offset = start + (p + 1 - (const unsigned char *) buf);
+			ok = morkLexerEmit( lex, MTDictClose, 0 );
+			break;
+		case ADictMeta:
+			ok = morkLexerEmit( lex, MTDictMeta, 0 );
+			break;
+		case ACellStart:
+			lex->returnState = state;
+			break;
+		case ACell:
+			ok = morkLexerEmit( lex, MTCell, 0 );
+			next = lex->returnState;
+			break;
+		case ATableOpen:
+			ok = morkLexerEmit( lex, MTTableOpen, 0 );
+			break;
+		case ATableOpenRow:
+			ok = morkLexerEmit( lex, MTTableOpen, 0 );
+			lex->rowReturn = LTableBody;
+			break;
+		case ATableOpenClose:
+			lex->offset = start + (p + 1 - (const unsigned char *) buf);
+			ok = morkLexerEmit( lex, MTTableOpen, 0 ) &&
+			     morkLexerEmit( lex, MTTableClose, 0 );
+			break;
+		case ATableClose:
+			lex->offset = start + (p + 1 - (const unsigned char *) buf);
+			ok = morkLexerEmit( lex, MTTableClose, 0 );
+			break;
+		case ATableMeta:
+			ok = morkLexerEmit( lex, MTTableMeta, 0 );
+			break;
+		case AOid:
+			lex->offset = start + (p - (const unsigned char *) buf);
+			ok = morkLexerEmit( lex, MTOid, 0 );
+			break;
+		case AOidRow:
+			lex->offset = start + (p - (const unsigned char *) buf);
+			ok = morkLexerEmit( lex, MTOid, 0 );
+			lex->rowReturn = LTableBody;
+			break;
+		case AOidClose:
+			lex->offset = start + (p + 1 - (const unsigned char *) buf);
+			ok = morkLexerEmit( lex, MTOid, 0 ) &&
+			     morkLexerEmit( lex, MTTableClose, 0 );
+			break;
+		case ARowStart:
+			lex->rowReturn = state;
+			break;
+		case ARowOpen:
+			ok = morkLexerEmit( lex, MTRowOpen, 0 );
+			break;
+		case ARowOpenCell:
+			ok = morkLexerEmit( lex, MTRowOpen, 0 );
+			lex->returnState = LRowBody;
+			break;
+		case ARowOpenClose:
+			lex->offset = start + (p + 1 - (const unsigned char *) buf);
+			ok = morkLexerEmit( lex, MTRowOpen, 0 ) &&
+			     morkLexerEmit( lex, MTRowClose, 0 );
+			next = lex->rowReturn;
+			break;
+		case ARowClose:
+			lex->offset = start + (p + 1 - (const unsigned char *) buf);
+			ok = morkLexerEmit( lex, MTRowClose, 0 );
+			next = lex->rowReturn;
+			break;
+		case ARowMeta:
+			ok = morkLexerEmit( lex, MTRowMeta, 0 );
+			break;
+		case AGroup:
+			lex->offset = start + (p + 1 - (const unsigned char *) buf);
+			ok = morkLexerEmitGroup( lex );
+			break;
+		case AResync:
+			// This byte starts the next construct, a row goes on in
+			// the table the error was in
+			lex->offset = start + (p - (const unsigned char *) buf);
+			ok = morkLexerEmit( lex, MTSkipped, lex->skipError );
+			if( lex->skipInTable && morkCharClass[*p] == CLBracket ) {
+				next = LTableBody;
+			} else if( ok && lex->skipInTable ) {
+				ok = morkLexerEmit( lex, MTTableClose, 0 );
+			}
+			lex->state = ok ? next : LError;
+			continue;
+		}
+		lex->state = ok ? next : LError;
+		++p;
+	}
+	lex->offset = start + (p - (const unsigned char *) buf);
+	return ok;
+}
+// Called at the end of the input
+int morkLexerFinish( morkLexer *lex ) {
+	if( lex->state == LHeader ) {
+		lex->text[lex->textLen] = '\0';
+		lex->error = LEHeader;
+		lex->state = LError;
+	} else if( lex->state == LTableOid ) {
+		// A row reference running into the end of the input
+		if( morkLexerEmit( lex, MTOid, 0 ) )	lex->state = LDone;
+	} else if( lex->state == LSkip || lex->state == LSkipEscape ||
+		   lex->state == LSkipEol ) {
+		// Skipped all the way to the end of the input
+		if( morkLexerEmit( lex, MTSkipped, lex->skipError ) &&
+		    (!lex->skipInTable || morkLexerEmit( lex, MTTableClose, 0 )) )
+			lex->state = LDone;
+	}
+	return lex->error == LENone;
+}
+// Ends a skip after an error here, as the next construct starting
+// would. For input fed in pieces that do not follow one another in
+// the file (see morkLazy.c), a skip that ran to the end of one piece
+// is over before the next. Returns false if the handler stops.
+int morkLexerResync( morkLexer *lex ) {
+	if( lex->state != LSkip && lex->state != LSkipEscape && lex->state != LSkipEol )
+		return true;
+	lex->state = LTop;
+	if( !morkLexerEmit( lex, MTSkipped, lex->skipError ) ||
+	    (lex->skipInTable && !morkLexerEmit( lex, MTTableClose, 0 )) ) {
+		lex->state = LError;
+		return false;
+	}
+	return true;
+}
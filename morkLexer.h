@@ -0,0 +1,128 @@
+/*-----------------------------------------------------------------------------
+ *    MorkLexer.h - Table driven tokenizer for Mork (abook.mab) files
+ *
+ *    The lexer is a single state machine that is fed the raw bytes of
+ *    a Mork file and hands a stream of tokens to a handler function.
+ *    Every byte is classified once through a character class table
+ *    and the next state and action come from a transition table
+ *    indexed by the current state and that class.
+ *
+ *    Setting the filter function lets the owner skip row cells it
+ *    does not want before their values are decoded.
+ *
+ *    Setting resync makes the lexer carry on after an error. A row it
+ *    was in is closed with what it had so far. It skips to the next
+ *    line that starts (after any blanks) with '<', '{', '[' or '@' and
+ *    hands over an MTSkipped token for the bytes it skipped. A row
+ *    there goes on in the table the error was in, anything else closes
+ *    that table and picks up at the top level.
+ *
+ *    All of the lexer state lives in the morkLexer structure so input
+ *    can be fed in pieces of any size, splitting anywhere.
+ *
+ *    Example usage:
+ *       morkLexer lex;
+ *       morkLexerInit( &lex, myTokenHandler, myArg );
+ *       while( (n = fread( buf, 1, sizeof(buf), ifp )) > 0 )
+ *           if( !morkLexerFeed( &lex, buf, n ) ) break;
+ *       morkLexerFinish( &lex );
+ *       morkLexerFree( &lex );
+ *
+ ----------------------------------------------------------------------------*/
+#ifndef __MorkLexer_h__
+#define __MorkLexer_h__
+
+#include <stddef.h>
+
+// Token types handed to the token handler
+typedef enum {
+	MTDictOpen,	// '<' starting a dictionary
+	MTDictClose,	// '>' ending a dictionary
+	MTDictMeta,	// '<...>' in a dictionary, text is the contents
+	MTCell,		// '(col=literal)' or '(^col^oid)', text is the
+			// column and value is the literal or the object id
+	MTTableOpen,	// '{id', text is the table id
+	MTTableClose,	// '}' ending a table
+	MTTableMeta,	// '{...}' in a table, text is the contents
+	MTOid,		// A row reference in a table, text is the row id
+	MTRowOpen,	// '[id', text is the row id
+	MTRowClose,	// ']' ending a row
+	MTRowMeta,	// '[...]' in a row, text is the contents
+	MTGroupStart,	// '@$${id{@', id is the group id
+	MTGroupCommit,	// '@$$}id}@', id is the group id
+	MTGroupAbort,	// '@$$}~abort~id}@', id is the group id or -1
+			// when the group end was not recognizable
+	MTComment,	// '// ...' to the end of the line
+	MTMeta,		// Any other '@...@' sequence
+	MTSkipped,	// Input skipped after an error (resync set), id
+			// is the error, the bytes skipped are from
+			// skipStart up to offset
+} morkTokenType;
+
+// Token flags
+#define	MTFColumnOid	0x01	// The cell column was given as ^oid
+#define	MTFValueOid	0x02	// The cell value was given as ^oid
+
+// A token, text and value are '\0' terminated and only valid
+// for the duration of the call to the token handler
+typedef struct {
+	morkTokenType	type;
+	int		flags;
+	int		id;
+	const char	*text;
+	int		textLen;
+	const char	*value;
+	int		valueLen;
+} morkToken;
+
+// Returns false to stop the lexer
+typedef int (*morkTokenHandler)( void *arg, const morkToken *token );
+// Asked about each cell of a row once its column is known (column is
+// the column text and flags has MTFColumnOid if it was given as ^oid).
+// Returns false to skip the cell.
+typedef int (*morkCellFilter)( void *arg, const char *column, int columnLen, int flags );
+
+// Lexer errors
+typedef enum {
+	LENone,
+	LEHeader,	// The magic header did not match
+	LEFormat,	// Unexpected character at the top level
+	LEComment,	// A '/' not followed by another '/'
+	LERow,		// Unexpected character in a row
+	LEHandler,	// The token handler asked to stop
+} morkLexError;
+
+// The complete lexer state
+typedef struct {
+	int		state;		// Current state
+	int		returnState;	// State after a cell or comment
+	int		rowReturn;	// State after a row
+	int		headerPos;	// Magic header bytes matched
+	int		hex;		// Value of a '$XX' escape so far
+	int		flags;		// Token flags collected so far
+	char		*text;		// Column, id, meta or comment text
+	int		textLen;
+	int		textSize;
+	char		*value;		// Cell value text
+	int		valueLen;
+	int		valueSize;
+	long		offset;		// Bytes consumed so far, at the end
+					// of a construct up to just past it
+	morkLexError	error;
+	int		errorChar;	// The character causing the error
+	int		resync;		// Skip past errors instead of stopping
+	morkLexError	skipError;	// The error being skipped past
+	long		skipStart;	// Offset of its character
+	int		skipInTable;	// It was in a row of a table
+	morkTokenHandler handler;
+	morkCellFilter	filter;		// NULL to keep every cell
+	void		*arg;		// Passed to the handler and filter
+} morkLexer;
+
+void morkLexerInit( morkLexer *lex, morkTokenHandler handler, void *arg );
+int morkLexerFeed( morkLexer *lex, const char *buf, size_t len );
+int morkLexerFinish( morkLexer *lex );
+int morkLexerResync( morkLexer *lex );
+void morkLexerFree( morkLexer *lex );
+
+#endif // __MorkLexer_h__
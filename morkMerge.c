@@ -0,0 +1,243 @@
+/*-----------------------------------------------------------------------------
+ *    MorkMerge.c - Merge the contacts of several Mork address books
+ *
+ *    People keep the same contacts in more than one address book
+ *    (abook.mab, history.mab, ...) and an address book can hold both
+ *    the edited and the pre-edit copy of a card in tables 0 and 1 of
+ *    scope 128. mergeMorkFiles() loads the files in parallel, one
+ *    thread per file, and mergeMorkDbs() then goes over the rows of
+ *    every database once, putting each card into a hash table keyed on
+ *    its normalized e-mail address and display name. The first card
+ *    seen with a key is kept, so the order of the files sets which
+ *    copy wins and within a file table 0 (the edited copy) comes
+ *    first. dumpMorkMergeVcards() writes the kept cards as vCards.
+ *
+ ----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include "parseMork.h"
+
+typedef int	bool;
+#define	true	1
+#define	false	0
+
+#define	morkErr(...)	if( morkErrfp ) fprintf( morkErrfp, ##__VA_ARGS__ )
+
+// What a thread loading a file needs
+typedef struct {
+	pthread_t	thread;
+	const char	*filename;
+	morkDb		*mork;
+	bool		started;
+} morkMergeLoad;
+
+static void *loadMorkMergeFile( void *arg ) {
+	morkMergeLoad *load = (morkMergeLoad *) arg;
+	load->mork = parseMorkFile( load->filename );
+	// The keys read every card's fields
+	if( load->mork )	resolveMorkDb( load->mork );
+	return NULL;
+}
+
+// Appends the text to the key lower cased, with runs of white space
+// made into one space and none at the ends
+static void appendMorkMergeKey( char **key, int *len, int *size, const char *s ) {
+	bool space = false;
+	if( !s )	return;
+	while( isspace( (unsigned char) *s ) )	++s;
+	for( ; *s; ++s ) {
+		if( isspace( (unsigned char) *s ) ) {
+			space = true;
+			continue;
+		}
+		if( *len + 3 > *size ) {
+			*size = *size ? *size * 2 : 64;
+			*key = realloc( *key, *size );
+		}
+		if( space )	(*key)[(*len)++] = ' ';
+		space = false;
+		(*key)[(*len)++] = tolower( (unsigned char) *s );
+	}
+}
+// The normalized e-mail address and display name of a card (the first
+// and last names when it has no display name), NULL if it has neither
+static char *makeMorkMergeKey( morkDb *mork, morkCells *cells ) {
+	char	*key = (char *) 0;
+	int	len = 0, size = 0;
+	char	*name = valueForColumnId( getColumnId( mork, "DisplayName" ), cells, mork );
+
+	appendMorkMergeKey( &key, &len, &size, valueForColumnId(
+		getColumnId( mork, "PrimaryEmail" ), cells, mork ) );
+	appendMorkMergeKey( &key, &len, &size, "\001" );
+	if( name && *name ) {
+		appendMorkMergeKey( &key, &len, &size, name );
+	} else {
+		appendMorkMergeKey( &key, &len, &size, valueForColumnId(
+			getColumnId( mork, "FirstName" ), cells, mork ) );
+		appendMorkMergeKey( &key, &len, &size, " " );
+		appendMorkMergeKey( &key, &len, &size, valueForColumnId(
+			getColumnId( mork, "LastName" ), cells, mork ) );
+	}
+	if( len <= 1 ) {
+		free( key );
+		return (char *) 0;
+	}
+	key[len] = '\0';
+	return key;
+}
+static unsigned long long hashMorkMergeKey( const char *s ) {
+	unsigned long long h = 0xcbf29ce484222325ULL;
+	for( ; *s; ++s ) {
+		h ^= (unsigned char) *s;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+// Doubles the hash table and puts the contacts back in it
+static void growMorkMergeTable( morkMerge *merge ) {
+	int i, mask;
+	free( merge->table );
+	merge->tableSize = merge->tableSize ? merge->tableSize * 2 : 1024;
+	merge->table = malloc( merge->tableSize * sizeof(*merge->table) );
+	for( i = 0; i < merge->tableSize; ++i )	merge->table[i] = -1;
+	mask = merge->tableSize - 1;
+	for( i = 0; i < merge->cnt; ++i ) {
+		int slot = merge->entries[i].hash & mask;
+		while( merge->table[slot] >= 0 )	slot = (slot + 1) & mask;
+		merge->table[slot] = i;
+	}
+}
+// Adds a card unless one with the same key is already there
+static void addMorkMergeRow( morkMerge *merge, morkDb *mork, morkCells *cells ) {
+	morkMergeEntry	*e;
+	char		*key;
+	unsigned long long hash;
+	int		slot, mask;
+
+	++merge->rowCnt;
+	key = makeMorkMergeKey( mork, cells );
+	if( !key )	return;
+	hash = hashMorkMergeKey( key );
+	// Keep the table at most half full
+	if( 2 * (merge->cnt + 1) > merge->tableSize )	growMorkMergeTable( merge );
+	mask = merge->tableSize - 1;
+	for( slot = hash & mask; merge->table[slot] >= 0; slot = (slot + 1) & mask ) {
+		e = &merge->entries[merge->table[slot]];
+		if( e->hash == hash && strcmp( e->key, key ) == 0 ) {
+			++e->copies;
+			free( key );
+			return;
+		}
+	}
+	if( merge->cnt >= merge->size ) {
+		merge->size = merge->size ? merge->size * 2 : 64;
+		merge->entries = realloc( merge->entries, merge->size * sizeof(*merge->entries) );
+	}
+	e = &merge->entries[merge->cnt];
+	e->mork = mork;
+	e->cells = cells;
+	e->key = key;
+	e->hash = hash;
+	e->copies = 1;
+	merge->table[slot] = merge->cnt++;
+}
+
+// Merges the cards of the databases, which stay owned by the caller.
+// Earlier databases win over later ones.
+morkMerge *mergeMorkDbs( morkDb **dbs, int cnt ) {
+	morkMerge	*merge = calloc( 1, sizeof(*merge) );
+	int		d, i, j, k, l;
+
+	if( !merge ) {
+		morkErr( "***** error: unable to allocate Mork merge\n" );
+		return merge;
+	}
+	for( d = 0; d < cnt; ++d ) {
+		morkDb *mork = dbs[d];
+		if( !mork )	continue;
+		for( i = 0; i < mork->cnt; ++i ) {
+			morkTableMap *tableMap = mork->entries[i];
+			for( j = 0; j < tableMap->cnt; ++j ) {
+				rowScopeMap *scopeMap = tableMap->entries[j];
+				for( k = 0; k < scopeMap->cnt; ++k ) {
+					morkRowMap *rowMap = scopeMap->entries[k];
+					for( l = 0; l < rowMap->cnt; ++l ) {
+						if( !isMorkCellsVcard( mork, rowMap->entries[l] ) )
+							continue;
+						addMorkMergeRow( merge, mork, rowMap->entries[l] );
+					}
+				}
+			}
+		}
+	}
+	return merge;
+}
+// Loads the files, one thread each, and merges their cards. The merge
+// owns the databases. Files that do not load are reported and left out.
+morkMerge *mergeMorkFiles( const char **filenames, int cnt ) {
+	morkMergeLoad	*loads = calloc( cnt + 1, sizeof(*loads) );
+	morkDb		**dbs = calloc( cnt + 1, sizeof(*dbs) );
+	morkMerge	*merge;
+	int		i;
+
+	if( !loads || !dbs ) {
+		morkErr( "***** error: unable to allocate Mork merge\n" );
+		free( loads );
+		free( dbs );
+		return (morkMerge *) 0;
+	}
+	for( i = 0; i < cnt; ++i ) {
+		loads[i].filename = filenames[i];
+		loads[i].started = !pthread_create( &loads[i].thread, NULL,
+			loadMorkMergeFile, &loads[i] );
+		// Load it here if there is no thread for it
+		if( !loads[i].started )	loadMorkMergeFile( &loads[i] );
+	}
+	for( i = 0; i < cnt; ++i ) {
+		if( loads[i].started )	pthread_join( loads[i].thread, NULL );
+		dbs[i] = loads[i].mork;
+	}
+	free( loads );
+	merge = mergeMorkDbs( dbs, cnt );
+	if( !merge ) {
+		for( i = 0; i < cnt; ++i ) {
+			if( !dbs[i] )	continue;
+			freeMorkDb( dbs[i] );
+			free( dbs[i] );
+		}
+		free( dbs );
+		return merge;
+	}
+	merge->dbs = dbs;
+	merge->dbCnt = cnt;
+	return merge;
+}
+void freeMorkMerge( morkMerge *merge ) {
+	int i;
+	if( !merge )	return;
+	for( i = 0; i < merge->cnt; ++i )	free( merge->entries[i].key );
+	for( i = 0; i < merge->dbCnt; ++i ) {
+		if( !merge->dbs[i] )	continue;
+		freeMorkDb( merge->dbs[i] );
+		free( merge->dbs[i] );
+	}
+	free( merge->dbs );
+	free( merge->entries );
+	free( merge->table );
+	free( merge );
+}
+// Writes each of the merged cards as a vCard
+void dumpMorkMergeVcards( FILE *ofp, morkMerge *merge ) {
+	int i;
+	if( !merge ) {
+		morkErr( "***** error: request to dump a NULL Mork merge\n" );
+		return;
+	}
+	for( i = 0; i < merge->cnt; ++i ) {
+		writeMorkCellsAsVcard3_0( ofp, merge->entries[i].mork,
+			merge->entries[i].cells, NULL );
+	}
+}
@@ -0,0 +1,463 @@
+/*-----------------------------------------------------------------------------
+ *    MorkPipe.c - Write vCards on another thread while the file is parsed
+ *
+ *    parseMorkFileWithVcards() parses the file on the calling thread
+ *    and writes the vCards on a writer thread at the same time, so the
+ *    time taken is about the longer of the two instead of both added
+ *    up. Each row is handed over as it is completed, through the row
+ *    complete callback, so the parse still loads in bulk. The rows of
+ *    a group are not applied until the group commits, so they are only
+ *    handed over then and the rows of an aborted group never are.
+ *
+ *    A row goes over as a copy of its keys, column names and values in
+ *    one block, so the writer never looks at the database while the
+ *    parser is changing it. The writer keeps one block and one vCard
+ *    for each row, in a hash table on the row's keys, and a column
+ *    dictionary made from the column names it gets. A row given again
+ *    has its new cells merged with the old ones into a new block, and
+ *    the old block and vCard are freed.
+ *
+ *    The rows go through a ring of MORKPIPESIZE pointers with one
+ *    thread putting in and the other taking out, so the two only share
+ *    the indexes at each end. Each thread only moves its own index.
+ *    When the ring is full or empty it yields to the other a few times
+ *    and then sleeps until woken, so a parse waiting on slow input
+ *    does not keep the writer spinning.
+ *
+ *    The vCards are made into memory as the rows come and written out
+ *    once the parse is done, in key order, so they are the ones
+ *    dumpVcards() writes.
+ *
+ ----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include "parseMork.h"
+
+typedef int	bool;
+#define	true	1
+#define	false	0
+
+#define	morkErr(...)	if( morkErrfp ) fprintf( morkErrfp, ##__VA_ARGS__ )
+
+// Rows that can be on their way to the writer at once, a power of two
+#define	MORKPIPESIZE	1024
+// Times a thread yields waiting on the other before it sleeps
+#define	MORKPIPESPINS	64
+
+// From parseMork.c
+void initializeTableScopeMap( morkDb *mork );
+void setMorkDictEntry( morkDict *dict, morkDictEntry *e, morkId key, const char *value );
+
+// A completed row, its keys, its cells and their text in one block
+typedef struct {
+	morkId		tableScope;
+	morkId		tableId;
+	morkId		rowScope;
+	morkId		rowId;
+	int		cnt;		// -1 if the row filter dropped the row
+	morkCellEntry	*entries;	// Column id and cell number of each cell
+	morkResolvedCell *resolved;	// Column name and value of each cell
+} morkPipeRow;
+// The writer's row and vCard for one row key
+typedef struct {
+	morkPipeRow	*row;		// NULL for an empty slot
+	char		*vCard;		// NULL if the row was dropped
+	size_t		len;
+} morkPipeCard;
+// Hash table of the writer's rows on their keys
+typedef struct {
+	size_t		size;		// Slots, a power of two
+	size_t		cnt;
+	morkPipeCard	*slots;
+} morkPipeCards;
+
+// The ring of rows from the parser to the writer
+typedef struct {
+	morkPipeRow	*ring[MORKPIPESIZE];
+	atomic_size_t	head;		// Next row to take, moved by the writer
+	atomic_size_t	tail;		// Next slot to fill, moved by the parser
+	atomic_int	done;		// The parser has put in its last row
+	atomic_int	sleepers;	// Threads asleep on cond
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+} morkPipeQueue;
+
+// What the parser's row filter and the writer thread need
+typedef struct {
+	morkPipeQueue	queue;
+	FILE		*ofp;
+	morkRowCallback	rowComplete;	// The caller's own callback
+	void		*rowCompleteArg;
+	pthread_t	thread;
+} morkPipe;
+
+// Wakes the other thread if it is asleep. Each index is moved before
+// sleepers is looked at, and a thread going to sleep counts itself in
+// before it looks at the index again, so one of the two sees the other.
+static void wakeMorkPipe( morkPipeQueue *q ) {
+	if( !atomic_load( &q->sleepers ) )	return;
+	pthread_mutex_lock( &q->lock );
+	pthread_cond_broadcast( &q->cond );
+	pthread_mutex_unlock( &q->lock );
+}
+// Parser side, waits while the ring is full
+static void putMorkPipeRow( morkPipeQueue *q, morkPipeRow *row ) {
+	size_t tail = atomic_load_explicit( &q->tail, memory_order_relaxed );
+	int spins = 0;
+	while( tail - atomic_load( &q->head ) >= MORKPIPESIZE ) {
+		if( ++spins < MORKPIPESPINS ) {
+			sched_yield();
+			continue;
+		}
+		pthread_mutex_lock( &q->lock );
+		atomic_fetch_add( &q->sleepers, 1 );
+		while( tail - atomic_load( &q->head ) >= MORKPIPESIZE )
+			pthread_cond_wait( &q->cond, &q->lock );
+		atomic_fetch_sub( &q->sleepers, 1 );
+		pthread_mutex_unlock( &q->lock );
+	}
+	q->ring[tail & (MORKPIPESIZE - 1)] = row;
+	atomic_store( &q->tail, tail + 1 );
+	wakeMorkPipe( q );
+}
+// Writer side, waits while the ring is empty. NULL once the parser is
+// done and every row has been taken.
+static morkPipeRow *takeMorkPipeRow( morkPipeQueue *q ) {
+	size_t head = atomic_load_explicit( &q->head, memory_order_relaxed );
+	morkPipeRow *row;
+	int spins = 0;
+	while( head == atomic_load( &q->tail ) ) {
+		if( atomic_load( &q->done ) && head == atomic_load( &q->tail ) )
+			return (morkPipeRow *) 0;
+		if( ++spins < MORKPIPESPINS ) {
+			sched_yield();
+			continue;
+		}
+		pthread_mutex_lock( &q->lock );
+		atomic_fetch_add( &q->sleepers, 1 );
+		while( head == atomic_load( &q->tail ) && !atomic_load( &q->done ) )
+			pthread_cond_wait( &q->cond, &q->lock );
+		atomic_fetch_sub( &q->sleepers, 1 );
+		pthread_mutex_unlock( &q->lock );
+	}
+	row = q->ring[head & (MORKPIPESIZE - 1)];
+	atomic_store( &q->head, head + 1 );
+	wakeMorkPipe( q );
+	return row;
+}
+// Parser side, no more rows are coming
+static void finishMorkPipeRows( morkPipeQueue *q ) {
+	atomic_store( &q->done, true );
+	wakeMorkPipe( q );
+}
+
+// Copies the row's cells and their text into one block
+static morkPipeRow *copyMorkPipeRow( morkDb *mork, morkCells *cells ) {
+	morkPipeRow	*row;
+	int		cnt = cells ? cells->cnt : 0;
+	size_t		len = sizeof(*row) + cnt * (sizeof(*row->entries) + sizeof(*row->resolved));
+	char		*text;
+	int		i;
+
+	for( i = 0; i < cnt; ++i ) {
+		len += strlen( getMorkCellColumn( mork, cells, i ) ) + 1;
+		len += strlen( getMorkCellValue( mork, cells, i ) ) + 1;
+	}
+	row = malloc( len );
+	if( !row )	return row;
+	row->cnt = cells ? cnt : -1;
+	row->entries = (morkCellEntry *) (row + 1);
+	row->resolved = (morkResolvedCell *) (row->entries + cnt);
+	text = (char *) (row->resolved + cnt);
+	for( i = 0; i < cnt; ++i ) {
+		const char *column = getMorkCellColumn( mork, cells, i );
+		const char *value = getMorkCellValue( mork, cells, i );
+		row->entries[i].key = cells->entries[i].key;
+		row->entries[i].value = i;
+		row->resolved[i].column = strcpy( text, column );
+		text += strlen( column ) + 1;
+		row->resolved[i].value = strcpy( text, value );
+		text += strlen( value ) + 1;
+	}
+	return row;
+}
+// Row complete callback that hands each completed row to the writer
+static void sendMorkPipeRow( void *arg, morkDb *mork, morkId tableScope,
+		morkId tableId, morkId rowScope, morkId rowId, morkCells *cells ) {
+	morkPipe *pipe = (morkPipe *) arg;
+	morkPipeRow *row;
+	if( pipe->rowComplete )
+		pipe->rowComplete( pipe->rowCompleteArg, mork, tableScope, tableId,
+			rowScope, rowId, cells );
+	row = copyMorkPipeRow( mork, cells );
+	if( !row ) {
+		morkErr( "***** error: unable to allocate row for vCard writer\n" );
+		return;
+	}
+	row->tableScope = tableScope;
+	row->tableId = tableId;
+	row->rowScope = rowScope;
+	row->rowId = rowId;
+	putMorkPipeRow( &pipe->queue, row );
+}
+
+// Puts the row's column names in the writer's column dictionary
+static void learnMorkPipeColumns( morkDict *columns, morkPipeRow *row ) {
+	int i, j;
+	for( i = 0; i < row->cnt; ++i ) {
+		morkId key = row->entries[i].key;
+		for( j = columns->cnt; j > 0 && columns->entries[j-1].key > key; --j )
+			;
+		if( j > 0 && columns->entries[j-1].key == key ) {
+			if( strcmp( morkDictEntryValue( &columns->entries[j-1] ), row->resolved[i].column ) )
+				setMorkDictEntry( columns, &columns->entries[j-1], key, row->resolved[i].column );
+			continue;
+		}
+		if( columns->cnt >= columns->size ) {
+			columns->size = columns->size ? columns->size * 2 : 64;
+			columns->entries = realloc( columns->entries, columns->size * sizeof(*columns->entries) );
+		}
+		memmove( columns->entries + j + 1, columns->entries + j,
+			(columns->cnt - j) * sizeof(*columns->entries) );
+		setMorkDictEntry( columns, &columns->entries[j], key, row->resolved[i].column );
+		columns->cnt++;
+	}
+}
+// Makes one block of the old row's cells with the new row's put over
+// them. The cells of both are in column order. Returns NULL if it ran
+// out of memory.
+static morkPipeRow *mergeMorkPipeRows( morkPipeRow *old, morkPipeRow *row ) {
+	morkPipeRow	*merged = (morkPipeRow *) 0;
+	size_t		len = sizeof(*merged);
+	char		*text = (char *) 0;
+	int		i, j, cnt, pass;
+
+	// Sized on the first pass, filled on the second
+	for( pass = 0; pass < 2; ++pass ) {
+		for( i = j = cnt = 0; i < old->cnt || j < row->cnt; ++cnt ) {
+			morkPipeRow *from = row;
+			int k;
+			if( j >= row->cnt || (i < old->cnt && old->entries[i].key < row->entries[j].key) ) {
+				from = old;
+				k = i++;
+			} else {
+				if( i < old->cnt && old->entries[i].key == row->entries[j].key )	++i;
+				k = j++;
+			}
+			if( !pass ) {
+				len += strlen( from->resolved[k].column ) + 1;
+				len += strlen( from->resolved[k].value ) + 1;
+				continue;
+			}
+			merged->entries[cnt].key = from->entries[k].key;
+			merged->entries[cnt].value = cnt;
+			merged->resolved[cnt].column = strcpy( text, from->resolved[k].column );
+			text += strlen( text ) + 1;
+			merged->resolved[cnt].value = strcpy( text, from->resolved[k].value );
+			text += strlen( text ) + 1;
+		}
+		if( pass )	break;
+		len += cnt * (sizeof(*merged->entries) + sizeof(*merged->resolved));
+		merged = malloc( len );
+		if( !merged )	return merged;
+		*merged = *row;
+		merged->cnt = cnt;
+		merged->entries = (morkCellEntry *) (merged + 1);
+		merged->resolved = (morkResolvedCell *) (merged->entries + cnt);
+		text = (char *) (merged->resolved + cnt);
+	}
+	return merged;
+}
+static unsigned long long hashMorkPipeRow( const morkPipeRow *row ) {
+	unsigned long long h = row->tableScope;
+	h = h * 0x9e3779b97f4a7c15ULL + row->tableId;
+	h = h * 0x9e3779b97f4a7c15ULL + row->rowScope;
+	h = h * 0x9e3779b97f4a7c15ULL + row->rowId;
+	return h ^ (h >> 29);
+}
+static bool sameMorkPipeRow( const morkPipeRow *x, const morkPipeRow *y ) {
+	return x->tableScope == y->tableScope && x->tableId == y->tableId &&
+		x->rowScope == y->rowScope && x->rowId == y->rowId;
+}
+// The slot of the row's keys, an empty one if they are not there
+static morkPipeCard *findMorkPipeCard( morkPipeCards *cards, const morkPipeRow *row ) {
+	size_t i = hashMorkPipeRow( row ) & (cards->size - 1);
+	while( cards->slots[i].row && !sameMorkPipeRow( cards->slots[i].row, row ) )
+		i = (i + 1) & (cards->size - 1);
+	return &cards->slots[i];
+}
+// Doubles the table. Returns false if it ran out of memory.
+static bool growMorkPipeCards( morkPipeCards *cards ) {
+	morkPipeCards	grown;
+	size_t		i;
+	grown.size = cards->size ? cards->size * 2 : 1024;
+	grown.cnt = cards->cnt;
+	grown.slots = calloc( grown.size, sizeof(*grown.slots) );
+	if( !grown.slots )	return false;
+	for( i = 0; i < cards->size; ++i ) {
+		if( cards->slots[i].row )
+			*findMorkPipeCard( &grown, cards->slots[i].row ) = cards->slots[i];
+	}
+	free( cards->slots );
+	*cards = grown;
+	return true;
+}
+static int compareMorkPipeCards( const void *a, const void *b ) {
+	const morkPipeRow *x = ((const morkPipeCard *) a)->row;
+	const morkPipeRow *y = ((const morkPipeCard *) b)->row;
+	if( x->tableScope != y->tableScope )	return x->tableScope < y->tableScope ? -1 : 1;
+	if( x->tableId != y->tableId )		return x->tableId < y->tableId ? -1 : 1;
+	if( x->rowScope != y->rowScope )	return x->rowScope < y->rowScope ? -1 : 1;
+	if( x->rowId != y->rowId )		return x->rowId < y->rowId ? -1 : 1;
+	return 0;
+}
+// Takes the row into the writer's table, merged with the row's
+// earlier cells, and makes its vCard
+static void keepMorkPipeRow( morkDb *mork, morkPipeCards *cards, FILE *textfp, char **text, morkPipeRow *row ) {
+	morkPipeCard	*card;
+	morkCells	cells;
+	long		len;
+
+	if( cards->cnt * 2 >= cards->size && !growMorkPipeCards( cards ) ) {
+		morkErr( "***** error: unable to allocate vCard writer rows\n" );
+		free( row );
+		return;
+	}
+	card = findMorkPipeCard( cards, row );
+	if( !card->row ) {
+		cards->cnt++;
+	} else {
+		// A dropped row given again starts over
+		if( row->cnt >= 0 && card->row->cnt >= 0 ) {
+			morkPipeRow *merged = mergeMorkPipeRows( card->row, row );
+			if( !merged ) {
+				morkErr( "***** error: unable to allocate vCard writer row\n" );
+				free( row );
+				return;
+			}
+			free( row );
+			row = merged;
+		}
+		free( card->row );
+		free( card->vCard );
+	}
+	card->row = row;
+	card->vCard = (char *) 0;
+	card->len = 0;
+	if( row->cnt < 0 )	return;
+	learnMorkPipeColumns( mork->columns, row );
+	memset( &cells, 0, sizeof(cells) );
+	cells.cnt = cells.size = row->cnt;
+	cells.entries = row->entries;
+	cells.resolved = row->resolved;
+	rewind( textfp );
+	writeMorkCellsAsVcard3_0( textfp, mork, &cells, NULL );
+	len = ftell( textfp );
+	fflush( textfp );
+	card->vCard = malloc( len );
+	if( len && !card->vCard ) {
+		morkErr( "***** error: unable to allocate vCard\n" );
+		return;
+	}
+	memcpy( card->vCard, *text, len );
+	card->len = len;
+}
+
+// Writer thread, makes the vCards of the rows as they come and writes
+// them out in key order once the parser is done
+static void *writeMorkPipeRows( void *arg ) {
+	morkPipe	*pipe = (morkPipe *) arg;
+	morkPipeCards	cards;
+	morkPipeRow	*row;
+	morkDb		*mork = calloc( 1, sizeof(*mork) );
+	char		*text = (char *) 0;
+	size_t		textSize = 0, i, cnt;
+	FILE		*textfp = open_memstream( &text, &textSize );
+
+	memset( &cards, 0, sizeof(cards) );
+	if( mork )	initializeTableScopeMap( mork );
+	if( !mork || !mork->columns || !textfp || !growMorkPipeCards( &cards ) ) {
+		morkErr( "***** error: unable to start vCard writer\n" );
+		// Keep taking the rows so the parser is not left waiting
+		while( (row = takeMorkPipeRow( &pipe->queue )) )
+			free( row );
+	}
+	while( cards.slots && (row = takeMorkPipeRow( &pipe->queue )) )
+		keepMorkPipeRow( mork, &cards, textfp, &text, row );
+
+	// Packed to the front of the table for sorting
+	for( i = cnt = 0; i < cards.size; ++i ) {
+		if( cards.slots[i].row )	cards.slots[cnt++] = cards.slots[i];
+	}
+	if( cnt )	qsort( cards.slots, cnt, sizeof(*cards.slots), compareMorkPipeCards );
+	for( i = 0; i < cnt; ++i ) {
+		if( cards.slots[i].vCard )
+			fwrite( cards.slots[i].vCard, 1, cards.slots[i].len, pipe->ofp );
+		free( cards.slots[i].vCard );
+		free( cards.slots[i].row );
+	}
+	free( cards.slots );
+	if( textfp )	fclose( textfp );
+	free( text );
+	if( mork ) {
+		freeMorkDb( mork );
+		free( mork );
+	}
+	return NULL;
+}
+
+// Parses the stream and writes the vCards of its rows to ofp as the
+// rows are completed. Returns the Mork database or NULL if it could
+// not be parsed. The vCards are all written when it returns.
+morkDb *parseMorkStreamWithVcards( FILE *ifp, FILE *ofp, const morkParseOptions *options ) {
+	morkParseOptions	pipeOptions;
+	morkPipe		*pipe = calloc( 1, sizeof(*pipe) );
+	morkDb			*mork;
+
+	if( !pipe ) {
+		morkErr( "***** error: unable to allocate vCard writer\n" );
+		return (morkDb *) 0;
+	}
+	memset( &pipeOptions, 0, sizeof(pipeOptions) );
+	if( options )	pipeOptions = *options;
+	pipe->ofp = ofp;
+	pipe->rowComplete = pipeOptions.rowComplete;
+	pipe->rowCompleteArg = pipeOptions.rowCompleteArg;
+	pipeOptions.rowComplete = sendMorkPipeRow;
+	pipeOptions.rowCompleteArg = pipe;
+	atomic_init( &pipe->queue.head, 0 );
+	atomic_init( &pipe->queue.tail, 0 );
+	atomic_init( &pipe->queue.done, false );
+	atomic_init( &pipe->queue.sleepers, 0 );
+	pthread_mutex_init( &pipe->queue.lock, NULL );
+	pthread_cond_init( &pipe->queue.cond, NULL );
+	if( pthread_create( &pipe->thread, NULL, writeMorkPipeRows, pipe ) ) {
+		morkErr( "***** error: unable to start vCard writer thread\n" );
+		pthread_cond_destroy( &pipe->queue.cond );
+		pthread_mutex_destroy( &pipe->queue.lock );
+		free( pipe );
+		return (morkDb *) 0;
+	}
+	mork = parseMorkStreamWithOptions( ifp, &pipeOptions );
+	finishMorkPipeRows( &pipe->queue );
+	pthread_join( pipe->thread, NULL );
+	pthread_cond_destroy( &pipe->queue.cond );
+	pthread_mutex_destroy( &pipe->queue.lock );
+	free( pipe );
+	return mork;
+}
+morkDb *parseMorkFileWithVcards( const char *filename, FILE *ofp, const morkParseOptions *options ) {
+	morkDb	*mork;
+	FILE	*ifp = fopen( filename, "r" );
+	if( !ifp ) {
+		morkErr( "error: unable to read file \"%s\"\n", filename );
+		return 0;
+	}
+	mork = parseMorkStreamWithVcards( ifp, ofp, options );
+	fclose( ifp );
+	return mork;
+}
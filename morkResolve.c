@@ -0,0 +1,78 @@
+/*-----------------------------------------------------------------------------
+ *    MorkResolve.c - Resolve the cell ids of a loaded Mork database
+ *
+ *    The cells of a row hold column and value ids that are looked up
+ *    in the dictionaries on every read. resolveMorkDb() does all of
+ *    those lookups once, after loading, and gives each row an array
+ *    beside its cells with pointers to the column name and value text
+ *    of each cell. The ids stay in the cells so the rows can still be
+ *    written back out or compared by id.
+ *
+ *    getMorkCellColumn() and getMorkCellValue() use the pointers when
+ *    a row has them and the dictionaries when it does not.
+ *
+ *    The pointers are into the dictionary entries, so changing a
+ *    dictionary drops them all, and changing a row drops its own.
+ *
+ ----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "parseMork.h"
+
+#define	morkErr(...)	if( morkErrfp ) fprintf( morkErrfp, ##__VA_ARGS__ )
+
+// Resolves the cells of every row. Returns false if it ran out of memory
+// (leaving the rows that were not done to use the dictionaries).
+int resolveMorkDb( morkDb *mork ) {
+	int i, j, k, l, m;
+	if( !mork ) {
+		morkErr( "***** error: request to resolve a NULL Mork database\n" );
+		return 0;
+	}
+	// Set first so that the rows done before running out of memory
+	// are still dropped when a dictionary changes
+	mork->resolved = 1;
+	for( i = 0; i < mork->cnt; ++i ) {
+		morkTableMap *tableMap = mork->entries[i];
+		for( j = 0; j < tableMap->cnt; ++j ) {
+			rowScopeMap *scopeMap = tableMap->entries[j];
+			for( k = 0; k < scopeMap->cnt; ++k ) {
+				morkRowMap *rowMap = scopeMap->entries[k];
+				for( l = 0; l < rowMap->cnt; ++l ) {
+					morkCells *cells = rowMap->entries[l];
+					if( cells->resolved )	continue;
+					cells->resolved = malloc( (cells->cnt + 1) * sizeof(*cells->resolved) );
+					if( !cells->resolved ) {
+						morkErr( "***** error: unable to allocate resolved cells\n" );
+						return 0;
+					}
+					for( m = 0; m < cells->cnt; ++m ) {
+						cells->resolved[m].column = getColumn( mork, cells->entries[m].key );
+						cells->resolved[m].value = getValue( mork, cells->entries[m].value );
+					}
+				}
+			}
+		}
+	}
+	return 1;
+}
+// Drops the resolved cells of every row
+void freeMorkResolved( morkDb *mork ) {
+	int i, j, k, l;
+	if( !mork->resolved )	return;
+	for( i = 0; i < mork->cnt; ++i ) {
+		morkTableMap *tableMap = mork->entries[i];
+		for( j = 0; j < tableMap->cnt; ++j ) {
+			rowScopeMap *scopeMap = tableMap->entries[j];
+			for( k = 0; k < scopeMap->cnt; ++k ) {
+				morkRowMap *rowMap = scopeMap->entries[k];
+				for( l = 0; l < rowMap->cnt; ++l ) {
+					free( rowMap->entries[l]->resolved );
+					rowMap->entries[l]->resolved = NULL;
+				}
+			}
+		}
+	}
+	mork->resolved = 0;
+}
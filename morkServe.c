@@ -0,0 +1,1119 @@
+/*-----------------------------------------------------------------------------
+ *    MorkServe.c - Serve address book look ups over a Unix domain socket
+ *
+ *    serveMorkFiles() loads the address books once and keeps them
+ *    loaded, so the processes that want to look someone up ask it
+ *    instead of each parsing the files again. It answers look ups by
+ *    e-mail address or name and requests for a card's vCard.
+ *
+ *    A thread watches the files' directories with inotify. Each file
+ *    has a push parser that is kept open, so when a file only grows
+ *    (Thunderbird appends each change as a group) just the new bytes
+ *    are fed to it. A file that was written over is parsed again from
+ *    the start. The parse recovers from errors, a damaged change does
+ *    not lose the rest of the book.
+ *
+ *    The answers come from a snapshot of the cards of every book that
+ *    is never changed once it is made. After a book changes the watcher
+ *    makes new cards for it and swaps a new snapshot in. The parser's
+ *    row complete callback notes the rows the new bytes gave, only
+ *    their cards are made again and the rest, with their text, are
+ *    kept from the last snapshot. A book parsed again from the start,
+ *    or with a dictionary entry given a new value, has all its cards
+ *    made again, as does one whose text is mostly of old cards.
+ *
+ *    The thread answering requests notes which snapshot it is reading
+ *    and the watcher waits until it is no longer that one before
+ *    freeing the old snapshot, so requests never wait for a reload.
+ *
+ *    The sockets do not block. A client that does not read its answers
+ *    gets no more of its requests answered until it does, without
+ *    holding up the others.
+ *
+ *    All integers are little endian. A request is:
+ *
+ *	u8 op				'E' e-mail, 'N' name, 'V' vCard
+ *	u16 len
+ *	u8 key[len]			see below
+ *
+ *    'E' looks up the cards with the e-mail address (primary or second)
+ *    and 'N' the cards with a display, first, last or nick name that
+ *    starts with the key. Case and runs of white space do not matter.
+ *    'V' gets the vCard of a card, its key is the card's id as the
+ *    look ups give it. The answer is:
+ *
+ *	u8 status			0 ok, 1 no such card, 2 bad request
+ *	u32 generation			snapshot the answer came from
+ *	u32 cnt				cards (or vCards) that follow
+ *
+ *    followed for 'E' and 'N' by each card (at most MORKSERVEMAXCARDS):
+ *
+ *	u32 book			index of the file served
+ *	u64 tableScope, tableId,	the card's id
+ *	    rowScope, rowId
+ *	u16 len, u8 name[len]		display name (or first and last)
+ *	u16 len, u8 email[len]		primary e-mail address
+ *
+ *    and for 'V' by:
+ *
+ *	u32 len, u8 vCard[len]
+ *
+ ----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
+#include "parseMork.h"
+
+typedef int	bool;
+#define	true	1
+#define	false	0
+
+#define	morkLog(...)	if( morkLogfp ) fprintf( morkLogfp, ##__VA_ARGS__ )
+#define	morkErr(...)	if( morkErrfp ) fprintf( morkErrfp, ##__VA_ARGS__ )
+
+// Bytes before the end of what was parsed that must be the same for a
+// file that grew to be taken as appended to
+#define	MORKSERVETAIL		64
+// Most cards in the answer to a look up
+#define	MORKSERVEMAXCARDS	100
+// Longest request, the header and a key
+#define	MORKSERVEREQUEST	(3 + 65535)
+// Bytes of answers waiting to be sent to a client before no more of
+// its requests are answered until it reads them
+#define	MORKSERVEBACKLOG	65536
+// How often the threads look for a request to stop
+#define	MORKSERVEPOLLMS		500
+// Most text blocks the cards of a book are kept in before they are
+// all made again into one
+#define	MORKSERVETEXTS		64
+
+// The keys of a row
+typedef struct {
+	morkId		tableScope;
+	morkId		tableId;
+	morkId		rowScope;
+	morkId		rowId;
+} morkServeId;
+// Text of cards, shared by the snapshots with cards in it
+typedef struct {
+	int		refs;		// Only the watcher changes it
+	char		*text;
+	size_t		len;
+} morkServeText;
+// A card of a book, its text is in one of the book's text blocks
+typedef struct {
+	morkServeId	id;
+	const char	*name;
+	const char	*email;
+	const char	*vCard;
+	int		vCardLen;
+	size_t		textLen;	// Bytes of its text and keys
+} morkServeCard;
+// A key the cards are looked up by
+typedef struct {
+	const char	*key;		// Lower case with single spaces
+	int		card;
+} morkServeKey;
+// The cards of one book as they were at one time, never changed
+typedef struct {
+	int		cnt;
+	morkServeCard	*cards;		// In id order
+	int		emailCnt;
+	morkServeKey	*emails;	// In key order
+	int		nameCnt;
+	morkServeKey	*names;		// In key order
+	int		textCnt;	// Blocks with names, e-mail addresses,
+	morkServeText	**texts;	// keys and vCards
+	size_t		textLen;	// Bytes in the blocks
+	size_t		liveLen;	// Bytes of them the cards use
+} morkServeCards;
+// The cards of every book
+typedef struct {
+	unsigned	generation;
+	int		cnt;
+	morkServeCards	**books;
+} morkServeSnapshot;
+// A row the parser completed, its cells are the parser's
+typedef struct {
+	morkServeId	id;
+	morkCells	*cells;
+} morkServeRow;
+// A file being followed, only the watcher thread uses it
+typedef struct {
+	const char	*path;
+	char		*name;		// File name in its directory
+	int		wd;		// Watch of the directory
+	morkParser	*parser;	// Still open, fed what is appended
+	dev_t		dev;
+	ino_t		ino;
+	long long	fed;		// Bytes of the file parsed
+	char		tail[MORKSERVETAIL]; // The last of them
+	int		tailLen;
+	bool		reloaded;	// Parsed from the start since the
+					// cards were made
+	int		rowCnt;		// Rows completed since then
+	int		rowSize;
+	morkServeRow	*rows;
+	long long	dictChanges;	// The parser's when the cards were
+	int		columnCnt;	// made
+} morkServeFile;
+// What the two threads share
+typedef struct {
+	int		cnt;
+	morkServeFile	*files;
+	int		inotifyFd;
+	_Atomic(morkServeSnapshot *) current;
+	_Atomic(morkServeSnapshot *) reading;	// Snapshot a request is using
+	atomic_int	stop;
+	pthread_t	watcher;
+} morkServer;
+// An answer being put together
+typedef struct {
+	unsigned char	*buf;
+	size_t		len;
+	size_t		size;
+} morkServeReply;
+// A connection, the part of a request read so far and the answers
+// not sent yet
+typedef struct {
+	int		fd;
+	bool		eof;		// It has sent all its requests
+	int		len;
+	unsigned char	buf[MORKSERVEREQUEST];
+	morkServeReply	out;
+	size_t		sent;		// Bytes of out already sent
+} morkServeClient;
+
+static volatile sig_atomic_t	morkServeSignalled = 0;
+
+static void stopMorkServe( int sig ) {
+	morkServeSignalled = 1;
+}
+
+// Appends the text lower cased, with runs of white space made into one
+// space and none at the ends, and a '\0'
+static void putMorkServeKey( FILE *ofp, const char *s ) {
+	bool space = false;
+	while( isspace( (unsigned char) *s ) )	++s;
+	for( ; *s; ++s ) {
+		if( isspace( (unsigned char) *s ) ) {
+			space = true;
+			continue;
+		}
+		if( space )	fputc( ' ', ofp );
+		space = false;
+		fputc( tolower( (unsigned char) *s ), ofp );
+	}
+	fputc( '\0', ofp );
+}
+// The same for a key that was asked for
+static void makeMorkServeKey( char *key, const unsigned char *s, int len ) {
+	bool space = false;
+	int n = 0;
+	while( len && isspace( *s ) ) {
+		++s;
+		--len;
+	}
+	for( ; len; ++s, --len ) {
+		if( isspace( *s ) ) {
+			space = true;
+			continue;
+		}
+		if( space )	key[n++] = ' ';
+		space = false;
+		key[n++] = tolower( *s );
+	}
+	key[n] = '\0';
+}
+static int compareMorkServeKeys( const void *a, const void *b ) {
+	const morkServeKey *x = (const morkServeKey *) a;
+	const morkServeKey *y = (const morkServeKey *) b;
+	int c = strcmp( x->key, y->key );
+	return c ? c : x->card - y->card;
+}
+
+static int compareMorkServeIds( const morkServeId *x, const morkServeId *y ) {
+	if( x->tableScope != y->tableScope )	return x->tableScope < y->tableScope ? -1 : 1;
+	if( x->tableId != y->tableId )		return x->tableId < y->tableId ? -1 : 1;
+	if( x->rowScope != y->rowScope )	return x->rowScope < y->rowScope ? -1 : 1;
+	if( x->rowId != y->rowId )		return x->rowId < y->rowId ? -1 : 1;
+	return 0;
+}
+static int compareMorkServeRows( const void *a, const void *b ) {
+	return compareMorkServeIds( &((const morkServeRow *) a)->id, &((const morkServeRow *) b)->id );
+}
+
+// A key of a card while the cards are being made, its text offset
+typedef struct {
+	size_t		key;
+	int		card;
+} morkServeKeyOffset;
+// Cards being made, with their text offsets until the text is done
+typedef struct {
+	morkDb			*mork;
+	morkId			displayCol, firstCol, lastCol, nickCol, emailCol, email2Col;
+	int			cnt;
+	int			size;
+	morkServeCard		*cards;
+	size_t			*offsets;	// Name, e-mail and vCard of each card
+	int			emailCnt, emailSize;
+	morkServeKeyOffset	*emails;
+	int			nameCnt, nameSize;
+	morkServeKeyOffset	*names;
+	morkServeText		*text;
+	FILE			*ofp;
+} morkServeMaker;
+static void addMorkServeKeyOffset( morkServeKeyOffset **keys, int *cnt, int *size,
+		FILE *ofp, const char *s, int card ) {
+	if( !s || !*s )	return;
+	if( *cnt >= *size ) {
+		*size = *size ? *size * 2 : 256;
+		*keys = realloc( *keys, *size * sizeof(**keys) );
+	}
+	(*keys)[*cnt].key = ftell( ofp );
+	(*keys)[*cnt].card = card;
+	++*cnt;
+	putMorkServeKey( ofp, s );
+}
+// Turns the key offsets into pointers into the text and sorts them
+static morkServeKey *sortMorkServeKeys( morkServeKeyOffset *offsets, int cnt, const char *text ) {
+	morkServeKey *keys = malloc( (cnt ? cnt : 1) * sizeof(*keys) );
+	int i;
+	if( !keys )	return keys;
+	for( i = 0; i < cnt; ++i ) {
+		keys[i].key = text + offsets[i].key;
+		keys[i].card = offsets[i].card;
+	}
+	qsort( keys, cnt, sizeof(*keys), compareMorkServeKeys );
+	return keys;
+}
+static void freeMorkServeCards( morkServeCards *c ) {
+	int i;
+	if( !c )	return;
+	for( i = 0; i < c->textCnt; ++i ) {
+		if( --c->texts[i]->refs )	continue;
+		free( c->texts[i]->text );
+		free( c->texts[i] );
+	}
+	free( c->texts );
+	free( c->cards );
+	free( c->emails );
+	free( c->names );
+	free( c );
+}
+static bool startMorkServeMaker( morkServeMaker *m, morkDb *mork ) {
+	memset( m, 0, sizeof(*m) );
+	m->mork = mork;
+	m->text = calloc( 1, sizeof(*m->text) );
+	if( !m->text )	return false;
+	m->ofp = open_memstream( &m->text->text, &m->text->len );
+	if( !m->ofp ) {
+		free( m->text );
+		return false;
+	}
+	m->displayCol = getColumnId( mork, "DisplayName" );
+	m->firstCol = getColumnId( mork, "FirstName" );
+	m->lastCol = getColumnId( mork, "LastName" );
+	m->nickCol = getColumnId( mork, "NickName" );
+	m->emailCol = getColumnId( mork, "PrimaryEmail" );
+	m->email2Col = getColumnId( mork, "SecondEmail" );
+	return true;
+}
+// Makes the card of a row, if it has one
+static void addMorkServeCard( morkServeMaker *m, const morkServeId *id, morkCells *cells ) {
+	morkDb		*mork = m->mork;
+	FILE		*ofp = m->ofp;
+	morkServeCard	*card;
+	size_t		*offsets, start;
+	char		*display, *first, *last, *email;
+
+	if( !isMorkCellsVcard( mork, cells ) )	return;
+	if( m->cnt >= m->size ) {
+		m->size = m->size ? m->size * 2 : 256;
+		m->cards = realloc( m->cards, m->size * sizeof(*m->cards) );
+		m->offsets = realloc( m->offsets, m->size * 3 * sizeof(*m->offsets) );
+	}
+	card = &m->cards[m->cnt];
+	offsets = &m->offsets[m->cnt * 3];
+	card->id = *id;
+	display = valueForColumnId( m->displayCol, cells, mork );
+	first = valueForColumnId( m->firstCol, cells, mork );
+	last = valueForColumnId( m->lastCol, cells, mork );
+	email = valueForColumnId( m->emailCol, cells, mork );
+	start = offsets[0] = ftell( ofp );
+	if( display && *display ) {
+		fputs( display, ofp );
+	} else {
+		if( first )	fputs( first, ofp );
+		if( first && *first && last && *last )	fputc( ' ', ofp );
+		if( last )	fputs( last, ofp );
+	}
+	fputc( '\0', ofp );
+	offsets[1] = ftell( ofp );
+	if( email )	fputs( email, ofp );
+	fputc( '\0', ofp );
+	offsets[2] = ftell( ofp );
+	writeMorkCellsAsVcard3_0( ofp, mork, cells, NULL );
+	card->vCardLen = ftell( ofp ) - offsets[2];
+	fputc( '\0', ofp );
+	addMorkServeKeyOffset( &m->emails, &m->emailCnt, &m->emailSize, ofp, email, m->cnt );
+	addMorkServeKeyOffset( &m->emails, &m->emailCnt, &m->emailSize, ofp,
+		valueForColumnId( m->email2Col, cells, mork ), m->cnt );
+	addMorkServeKeyOffset( &m->names, &m->nameCnt, &m->nameSize, ofp, display, m->cnt );
+	addMorkServeKeyOffset( &m->names, &m->nameCnt, &m->nameSize, ofp, first, m->cnt );
+	addMorkServeKeyOffset( &m->names, &m->nameCnt, &m->nameSize, ofp, last, m->cnt );
+	addMorkServeKeyOffset( &m->names, &m->nameCnt, &m->nameSize, ofp,
+		valueForColumnId( m->nickCol, cells, mork ), m->cnt );
+	card->textLen = ftell( ofp ) - start;
+	m->cnt++;
+}
+// The cards made, in one new text block
+static morkServeCards *finishMorkServeMaker( morkServeMaker *m ) {
+	morkServeCards	*c = calloc( 1, sizeof(*c) );
+	int		i;
+
+	fclose( m->ofp );
+	if( c ) {
+		c->cnt = m->cnt;
+		c->cards = m->cards;
+		m->cards = (morkServeCard *) 0;
+		c->emails = sortMorkServeKeys( m->emails, m->emailCnt, m->text->text );
+		c->emailCnt = m->emailCnt;
+		c->names = sortMorkServeKeys( m->names, m->nameCnt, m->text->text );
+		c->nameCnt = m->nameCnt;
+		c->texts = malloc( sizeof(*c->texts) );
+	}
+	if( !c || !m->text->text || !c->emails || !c->names || !c->texts ) {
+		morkErr( "***** error: unable to allocate served cards\n" );
+		if( c ) {
+			free( c->texts );
+			c->texts = (morkServeText **) 0;
+			freeMorkServeCards( c );
+		}
+		free( m->text->text );
+		free( m->text );
+		c = (morkServeCards *) 0;
+	} else {
+		c->textCnt = 1;
+		c->texts[0] = m->text;
+		m->text->refs = 1;
+		c->textLen = c->liveLen = m->text->len;
+		for( i = 0; i < c->cnt; ++i ) {
+			c->cards[i].name = m->text->text + m->offsets[i * 3];
+			c->cards[i].email = m->text->text + m->offsets[i * 3 + 1];
+			c->cards[i].vCard = m->text->text + m->offsets[i * 3 + 2];
+		}
+	}
+	free( m->cards );
+	free( m->offsets );
+	free( m->emails );
+	free( m->names );
+	return c;
+}
+// Makes the cards of a book from the rows of its Mork database
+static morkServeCards *makeMorkServeCards( morkDb *mork ) {
+	morkServeMaker	m;
+	morkServeId	id;
+	int		i, j, k, l;
+
+	if( !startMorkServeMaker( &m, mork ) ) {
+		morkErr( "***** error: unable to allocate served cards\n" );
+		return (morkServeCards *) 0;
+	}
+	for( i = 0; i < mork->cnt; ++i ) {
+		morkTableMap *tableMap = mork->entries[i];
+		id.tableScope = mork->keys[i];
+		for( j = 0; j < tableMap->cnt; ++j ) {
+			rowScopeMap *scopeMap = tableMap->entries[j];
+			id.tableId = tableMap->keys[j];
+			for( k = 0; k < scopeMap->cnt; ++k ) {
+				morkRowMap *rowMap = scopeMap->entries[k];
+				id.rowScope = scopeMap->keys[k];
+				for( l = 0; l < rowMap->cnt; ++l ) {
+					id.rowId = rowMap->keys[l];
+					addMorkServeCard( &m, &id, rowMap->entries[l] );
+				}
+			}
+		}
+	}
+	return finishMorkServeMaker( &m );
+}
+// Merges the old keys still in use with the new ones, each with the
+// index its card has in the merged cards
+static morkServeKey *mergeMorkServeKeys( const morkServeKey *old, int oldCnt, const int *oldAt,
+		const morkServeKey *made, int madeCnt, const int *madeAt, int *cnt ) {
+	morkServeKey	*keys = malloc( (oldCnt + madeCnt + 1) * sizeof(*keys) );
+	morkServeKey	x, y;
+	int		i = 0, j = 0, n = 0;
+
+	if( !keys )	return keys;
+	for( ;; ) {
+		while( i < oldCnt && oldAt[old[i].card] < 0 )	++i;
+		if( i >= oldCnt && j >= madeCnt )	break;
+		if( i < oldCnt ) {
+			x = old[i];
+			x.card = oldAt[x.card];
+		}
+		if( j < madeCnt ) {
+			y = made[j];
+			y.card = madeAt[y.card];
+		}
+		if( j >= madeCnt || (i < oldCnt && compareMorkServeKeys( &x, &y ) < 0) ) {
+			keys[n++] = x;
+			++i;
+		} else {
+			keys[n++] = y;
+			++j;
+		}
+	}
+	*cnt = n;
+	return keys;
+}
+// The old cards with those of the rows completed since put in their
+// place. The rows are in id order, a row that no longer has a card
+// has its old one dropped. The new and old cards share their text.
+static morkServeCards *mergeMorkServeCards( morkServeCards *old, morkServeCards *made,
+		const morkServeRow *rows, int rowCnt ) {
+	morkServeCards	*c = calloc( 1, sizeof(*c) );
+	int		*oldAt = malloc( (old->cnt + 1) * sizeof(*oldAt) );
+	int		*madeAt = malloc( (made->cnt + 1) * sizeof(*madeAt) );
+	int		i = 0, j = 0, r = 0;
+
+	if( c ) {
+		c->cards = malloc( (old->cnt + made->cnt + 1) * sizeof(*c->cards) );
+		c->texts = malloc( (old->textCnt + made->textCnt) * sizeof(*c->texts) );
+	}
+	if( !c || !oldAt || !madeAt || !c->cards || !c->texts ) {
+		morkErr( "***** error: unable to allocate served cards\n" );
+		if( c ) {
+			free( c->cards );
+			free( c->texts );
+			free( c );
+		}
+		free( oldAt );
+		free( madeAt );
+		return (morkServeCards *) 0;
+	}
+	c->liveLen = old->liveLen;
+	while( i < old->cnt || j < made->cnt ) {
+		if( i < old->cnt ) {
+			while( r < rowCnt && compareMorkServeIds( &rows[r].id, &old->cards[i].id ) < 0 )
+				++r;
+			if( r < rowCnt && !compareMorkServeIds( &rows[r].id, &old->cards[i].id ) ) {
+				c->liveLen -= old->cards[i].textLen;
+				oldAt[i++] = -1;
+				continue;
+			}
+		}
+		if( j >= made->cnt || (i < old->cnt &&
+		    compareMorkServeIds( &old->cards[i].id, &made->cards[j].id ) < 0) ) {
+			c->cards[c->cnt] = old->cards[i];
+			oldAt[i++] = c->cnt++;
+		} else {
+			c->cards[c->cnt] = made->cards[j];
+			madeAt[j++] = c->cnt++;
+		}
+	}
+	c->liveLen += made->liveLen;
+	c->emails = mergeMorkServeKeys( old->emails, old->emailCnt, oldAt,
+		made->emails, made->emailCnt, madeAt, &c->emailCnt );
+	c->names = mergeMorkServeKeys( old->names, old->nameCnt, oldAt,
+		made->names, made->nameCnt, madeAt, &c->nameCnt );
+	for( i = 0; i < old->textCnt; ++i )	c->texts[c->textCnt++] = old->texts[i];
+	for( i = 0; i < made->textCnt; ++i )	c->texts[c->textCnt++] = made->texts[i];
+	for( i = 0; i < c->textCnt; ++i ) {
+		c->texts[i]->refs++;
+		c->textLen += c->texts[i]->len;
+	}
+	free( oldAt );
+	free( madeAt );
+	if( !c->emails || !c->names ) {
+		morkErr( "***** error: unable to allocate served cards\n" );
+		freeMorkServeCards( c );
+		return (morkServeCards *) 0;
+	}
+	return c;
+}
+// Makes the cards of the book after its file was parsed further, from
+// the last ones and the rows completed since if it can
+static morkServeCards *remakeMorkServeCards( morkServeFile *f, morkServeCards *old ) {
+	morkDb		*mork = morkParserDb( f->parser );
+	morkServeCards	*c = (morkServeCards *) 0;
+	morkServeMaker	m;
+	int		i, n;
+
+	if( old && !f->reloaded && mork->dictChanges == f->dictChanges &&
+	    mork->columns->cnt == f->columnCnt && startMorkServeMaker( &m, mork ) ) {
+		// Each row once, its cells are the same each time
+		if( f->rowCnt )	qsort( f->rows, f->rowCnt, sizeof(*f->rows), compareMorkServeRows );
+		for( i = n = 0; i < f->rowCnt; ++i ) {
+			if( n && !compareMorkServeIds( &f->rows[n-1].id, &f->rows[i].id ) )	continue;
+			f->rows[n++] = f->rows[i];
+		}
+		for( i = 0; i < n; ++i )	addMorkServeCard( &m, &f->rows[i].id, f->rows[i].cells );
+		c = finishMorkServeMaker( &m );
+		if( c ) {
+			morkServeCards *made = c;
+			c = mergeMorkServeCards( old, made, f->rows, n );
+			freeMorkServeCards( made );
+		}
+		// Text mostly of cards made again since is let go
+		if( c && (c->textCnt > MORKSERVETEXTS || c->liveLen < c->textLen / 2) ) {
+			freeMorkServeCards( c );
+			c = (morkServeCards *) 0;
+		}
+		if( c )	morkLog( "Made %d cards of \"%s\" again\n", n, f->path );
+	}
+	if( !c )	c = makeMorkServeCards( mork );
+	f->reloaded = false;
+	f->rowCnt = 0;
+	f->dictChanges = mork->dictChanges;
+	f->columnCnt = mork->columns->cnt;
+	return c;
+}
+// Row complete callback, notes the rows completed since the cards
+// were made
+static void noteMorkServeRow( void *arg, morkDb *mork, morkId tableScope,
+		morkId tableId, morkId rowScope, morkId rowId, morkCells *cells ) {
+	morkServeFile *f = (morkServeFile *) arg;
+	morkServeRow *row;
+	if( f->reloaded || !cells )	return;
+	if( f->rowCnt >= f->rowSize ) {
+		morkServeRow *rows;
+		int size = f->rowSize ? f->rowSize * 2 : 256;
+		rows = realloc( f->rows, size * sizeof(*rows) );
+		if( !rows ) {
+			// Too many to make again one at a time
+			f->reloaded = true;
+			return;
+		}
+		f->rows = rows;
+		f->rowSize = size;
+	}
+	row = &f->rows[f->rowCnt++];
+	row->id.tableScope = tableScope;
+	row->id.tableId = tableId;
+	row->id.rowScope = rowScope;
+	row->id.rowId = rowId;
+	row->cells = cells;
+}
+
+// Keeps the last bytes fed to the parser
+static void keepMorkServeTail( morkServeFile *f, const char *buf, size_t n ) {
+	int keep;
+	if( n >= MORKSERVETAIL ) {
+		memcpy( f->tail, buf + n - MORKSERVETAIL, MORKSERVETAIL );
+		f->tailLen = MORKSERVETAIL;
+		return;
+	}
+	keep = f->tailLen < MORKSERVETAIL - (int) n ? f->tailLen : MORKSERVETAIL - (int) n;
+	memmove( f->tail, f->tail + f->tailLen - keep, keep );
+	memcpy( f->tail + keep, buf, n );
+	f->tailLen = keep + n;
+}
+// Brings the parse of the file up to date. If the file only grew the
+// new bytes are fed to the open parser, otherwise it is parsed again
+// from the start. Returns false if nothing changed.
+static bool updateMorkServeFile( morkServeFile *f ) {
+	morkParseOptions	options;
+	struct stat		st;
+	char			*buf;
+	FILE			*ifp;
+	size_t			n;
+	bool			append = false;
+
+	if( stat( f->path, &st ) )	return false;
+	if( f->parser && st.st_dev == f->dev && st.st_ino == f->ino && st.st_size >= f->fed ) {
+		if( st.st_size == f->fed )	return false;
+		append = true;
+	}
+	ifp = fopen( f->path, "rb" );
+	buf = malloc( MORKREADSIZE );
+	if( !ifp || !buf ) {
+		morkErr( "error: unable to read file \"%s\"\n", f->path );
+		if( ifp )	fclose( ifp );
+		free( buf );
+		return false;
+	}
+	// What was parsed last must still be there to go on from it
+	if( append && (fseek( ifp, f->fed - f->tailLen, SEEK_SET ) ||
+	    fread( buf, 1, f->tailLen, ifp ) != f->tailLen ||
+	    memcmp( buf, f->tail, f->tailLen )) ) {
+		append = false;
+		rewind( ifp );
+	}
+	if( !append ) {
+		morkParserFree( f->parser );
+		memset( &options, 0, sizeof(options) );
+		options.recover = true;
+		options.rowComplete = noteMorkServeRow;
+		options.rowCompleteArg = f;
+		f->parser = morkParserCreate();
+		if( !f->parser || !morkParserSetOptions( f->parser, &options ) ) {
+			morkErr( "***** error: unable to allocate mork database structure\n" );
+			morkParserFree( f->parser );
+			f->parser = (morkParser *) 0;
+			fclose( ifp );
+			free( buf );
+			return false;
+		}
+		f->dev = st.st_dev;
+		f->ino = st.st_ino;
+		f->fed = 0;
+		f->tailLen = 0;
+		// Rows noted from the last parser are gone with it
+		f->reloaded = true;
+		f->rowCnt = 0;
+	}
+	morkLog( "%s \"%s\" from byte %lld\n", append ? "Appending" : "Loading",
+		f->path, f->fed );
+	while( (n = fread( buf, 1, MORKREADSIZE, ifp )) > 0 ) {
+		morkParserFeed( f->parser, buf, n );
+		keepMorkServeTail( f, buf, n );
+		f->fed += n;
+	}
+	fclose( ifp );
+	free( buf );
+	return true;
+}
+
+// Swaps in a snapshot with new cards for the book and frees the old
+// one once no request is using it
+static void publishMorkServeCards( morkServer *srv, int book, morkServeCards *cards ) {
+	morkServeSnapshot *old = atomic_load( &srv->current );
+	morkServeSnapshot *next = malloc( sizeof(*next) + srv->cnt * sizeof(*next->books) );
+	if( !next ) {
+		morkErr( "***** error: unable to allocate served snapshot\n" );
+		freeMorkServeCards( cards );
+		return;
+	}
+	next->books = (morkServeCards **) (next + 1);
+	next->cnt = srv->cnt;
+	memcpy( next->books, old->books, srv->cnt * sizeof(*next->books) );
+	next->books[book] = cards;
+	next->generation = old->generation + 1;
+	atomic_store( &srv->current, next );
+	while( atomic_load( &srv->reading ) == old )	sched_yield();
+	freeMorkServeCards( old->books[book] );
+	free( old );
+	morkLog( "Serving %d cards of \"%s\" in generation %u\n",
+		cards ? cards->cnt : 0, srv->files[book].path, next->generation );
+}
+// The watcher thread, updates the books as their files change
+static void *watchMorkServeFiles( void *arg ) {
+	morkServer	*srv = (morkServer *) arg;
+	char		buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct pollfd	pfd;
+	bool		*changed = calloc( srv->cnt, sizeof(*changed) );
+	int		i;
+
+	if( !changed ) {
+		morkErr( "***** error: unable to allocate file watcher\n" );
+		return NULL;
+	}
+	pfd.fd = srv->inotifyFd;
+	pfd.events = POLLIN;
+	while( !atomic_load( &srv->stop ) ) {
+		ssize_t n;
+		char *p;
+		if( poll( &pfd, 1, MORKSERVEPOLLMS ) <= 0 )	continue;
+		n = read( srv->inotifyFd, buf, sizeof(buf) );
+		for( p = buf; n > 0 && p < buf + n; ) {
+			struct inotify_event *ev = (struct inotify_event *) p;
+			for( i = 0; i < srv->cnt; ++i ) {
+				if( (ev->mask & IN_Q_OVERFLOW) || (ev->wd == srv->files[i].wd &&
+				    ev->len && strcmp( ev->name, srv->files[i].name ) == 0) )
+					changed[i] = true;
+			}
+			p += sizeof(*ev) + ev->len;
+		}
+		// Each book once for all the events read together
+		for( i = 0; i < srv->cnt; ++i ) {
+			if( !changed[i] )	continue;
+			changed[i] = false;
+			if( updateMorkServeFile( &srv->files[i] ) ) {
+				morkServeSnapshot *s = atomic_load( &srv->current );
+				publishMorkServeCards( srv, i,
+					remakeMorkServeCards( &srv->files[i], s->books[i] ) );
+			}
+		}
+	}
+	free( changed );
+	return NULL;
+}
+
+// Little endian integers for the answers
+static void putMorkServeInt( morkServeReply *r, unsigned long long v, int len ) {
+	int i;
+	if( r->len + len > r->size ) {
+		while( r->len + len > r->size )	r->size = r->size ? r->size * 2 : 4096;
+		r->buf = realloc( r->buf, r->size );
+	}
+	for( i = 0; i < len; ++i, v >>= 8 )	r->buf[r->len++] = v & 0xff;
+}
+static void putMorkServeBytes( morkServeReply *r, const char *s, size_t len ) {
+	if( r->len + len > r->size ) {
+		while( r->len + len > r->size )	r->size = r->size ? r->size * 2 : 4096;
+		r->buf = realloc( r->buf, r->size );
+	}
+	memcpy( r->buf + r->len, s, len );
+	r->len += len;
+}
+static unsigned long long getMorkServeInt( const unsigned char *b, int len ) {
+	unsigned long long v = 0;
+	while( len-- )	v = v << 8 | b[len];
+	return v;
+}
+static void putMorkServeHeader( morkServeReply *r, int status, unsigned generation, int cnt ) {
+	r->len = 0;
+	putMorkServeInt( r, status, 1 );
+	putMorkServeInt( r, generation, 4 );
+	putMorkServeInt( r, cnt, 4 );
+}
+static void putMorkServeCard( morkServeReply *r, int book, morkServeCards *c, int i ) {
+	morkServeCard *card = &c->cards[i];
+	size_t len;
+	putMorkServeInt( r, book, 4 );
+	putMorkServeInt( r, card->id.tableScope, 8 );
+	putMorkServeInt( r, card->id.tableId, 8 );
+	putMorkServeInt( r, card->id.rowScope, 8 );
+	putMorkServeInt( r, card->id.rowId, 8 );
+	len = strlen( card->name );
+	if( len > 65535 )	len = 65535;
+	putMorkServeInt( r, len, 2 );
+	putMorkServeBytes( r, card->name, len );
+	len = strlen( card->email );
+	if( len > 65535 )	len = 65535;
+	putMorkServeInt( r, len, 2 );
+	putMorkServeBytes( r, card->email, len );
+}
+// Index of the first key not less than the key asked for
+static int findMorkServeKey( const morkServeKey *keys, int cnt, const char *key ) {
+	int lo = 0, hi = cnt;
+	while( lo < hi ) {
+		int mid = (lo + hi) / 2;
+		if( strcmp( keys[mid].key, key ) < 0 )	lo = mid + 1;
+		else					hi = mid;
+	}
+	return lo;
+}
+// Answers a look up, the whole key for e-mail addresses and the start
+// of one for names
+static void lookupMorkServeCards( morkServeReply *r, morkServeSnapshot *s, int op,
+		const unsigned char *key, int len ) {
+	char	*want = malloc( len + 1 );
+	int	found[MORKSERVEMAXCARDS];
+	int	total = 0;
+	int	book, i;
+
+	if( !want ) {
+		putMorkServeHeader( r, 2, s->generation, 0 );
+		return;
+	}
+	makeMorkServeKey( want, key, len );
+	len = strlen( want );
+	putMorkServeHeader( r, 0, s->generation, 0 );
+	for( book = 0; book < s->cnt && total < MORKSERVEMAXCARDS; ++book ) {
+		morkServeCards *c = s->books[book];
+		const morkServeKey *keys;
+		int cnt, n = 0;
+		if( !c || !len )	continue;
+		keys = op == 'E' ? c->emails : c->names;
+		cnt = op == 'E' ? c->emailCnt : c->nameCnt;
+		for( i = findMorkServeKey( keys, cnt, want ); i < cnt &&
+		     n < MORKSERVEMAXCARDS - total; ++i ) {
+			int j;
+			if( op == 'E' ? strcmp( keys[i].key, want ) :
+					strncmp( keys[i].key, want, len ) )
+				break;
+			// A card can have more than one key that matches
+			for( j = 0; j < n && found[j] != keys[i].card; ++j )
+				;
+			if( j == n )	found[n++] = keys[i].card;
+		}
+		for( i = 0; i < n; ++i )	putMorkServeCard( r, book, c, found[i] );
+		total += n;
+	}
+	free( want );
+	// The count goes after the status and generation
+	for( i = 0; i < 4; ++i )	r->buf[5 + i] = (total >> (8 * i)) & 0xff;
+}
+// Answers a request for a card's vCard
+static void fetchMorkServeVcard( morkServeReply *r, morkServeSnapshot *s,
+		const unsigned char *key, int len ) {
+	morkServeCards *c;
+	morkServeId id;
+	int book, lo, hi;
+
+	if( len != 36 ) {
+		putMorkServeHeader( r, 2, s->generation, 0 );
+		return;
+	}
+	book = getMorkServeInt( key, 4 );
+	id.tableScope = getMorkServeInt( key + 4, 8 );
+	id.tableId = getMorkServeInt( key + 12, 8 );
+	id.rowScope = getMorkServeInt( key + 20, 8 );
+	id.rowId = getMorkServeInt( key + 28, 8 );
+	c = book >= 0 && book < s->cnt ? s->books[book] : (morkServeCards *) 0;
+	lo = 0;
+	hi = c ? c->cnt : 0;
+	// The cards are in id order
+	while( lo < hi ) {
+		int mid = (lo + hi) / 2;
+		morkServeCard *card = &c->cards[mid];
+		int cmp = compareMorkServeIds( &card->id, &id );
+		if( !cmp ) {
+			putMorkServeHeader( r, 0, s->generation, 1 );
+			putMorkServeInt( r, card->vCardLen, 4 );
+			putMorkServeBytes( r, card->vCard, card->vCardLen );
+			return;
+		}
+		if( cmp < 0 )	lo = mid + 1;
+		else		hi = mid;
+	}
+	putMorkServeHeader( r, 1, s->generation, 0 );
+}
+// Answers one request from the snapshot being served
+static void answerMorkServeRequest( morkServer *srv, morkServeReply *r,
+		const unsigned char *req, int len ) {
+	morkServeSnapshot *s;
+	// Say which snapshot is being read before reading it, the watcher
+	// does not free that one
+	do {
+		s = atomic_load( &srv->current );
+		atomic_store( &srv->reading, s );
+	} while( s != atomic_load( &srv->current ) );
+	switch( req[0] ) {
+	case 'E':
+	case 'N':
+		lookupMorkServeCards( r, s, req[0], req + 3, len );
+		break;
+	case 'V':
+		fetchMorkServeVcard( r, s, req + 3, len );
+		break;
+	default:
+		putMorkServeHeader( r, 2, s->generation, 0 );
+		break;
+	}
+	atomic_store( &srv->reading, (morkServeSnapshot *) 0 );
+}
+// Answers the whole requests read so far, as long as not too much is
+// waiting to be sent, and sends what can be sent without waiting. The
+// socket does not block so a client that does not read its answers
+// only holds up itself. Returns false when the connection is done.
+static bool answerMorkServeClient( morkServer *srv, morkServeClient *c, morkServeReply *r ) {
+	int used = 0;
+	// What was sent is not kept
+	if( c->sent ) {
+		memmove( c->out.buf, c->out.buf + c->sent, c->out.len - c->sent );
+		c->out.len -= c->sent;
+		c->sent = 0;
+	}
+	while( c->len - used >= 3 && c->out.len < MORKSERVEBACKLOG ) {
+		int len = getMorkServeInt( c->buf + used + 1, 2 );
+		if( c->len - used < 3 + len )	break;
+		answerMorkServeRequest( srv, r, c->buf + used, len );
+		putMorkServeBytes( &c->out, (const char *) r->buf, r->len );
+		used += 3 + len;
+	}
+	memmove( c->buf, c->buf + used, c->len - used );
+	c->len -= used;
+	while( c->sent < c->out.len ) {
+		ssize_t w = send( c->fd, c->out.buf + c->sent, c->out.len - c->sent, MSG_NOSIGNAL );
+		if( w < 0 && errno == EINTR )	continue;
+		if( w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) )	break;
+		if( w <= 0 )	return false;
+		c->sent += w;
+	}
+	if( c->sent == c->out.len )	c->sent = c->out.len = 0;
+	// Done once it has sent everything and had all the answers
+	return !c->eof || c->out.len || (c->len >= 3 &&
+		c->len >= 3 + (int) getMorkServeInt( c->buf + 1, 2 ));
+}
+// Reads what the client sent. Returns false if the connection failed.
+static bool readMorkServeClient( morkServeClient *c ) {
+	ssize_t n = read( c->fd, c->buf + c->len, sizeof(c->buf) - c->len );
+	if( n < 0 )	return errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK;
+	if( n == 0 )	c->eof = true;
+	c->len += n;
+	return true;
+}
+// What to wait for from the client
+static short pollMorkServeClient( morkServeClient *c ) {
+	short events = 0;
+	if( !c->eof && c->len < sizeof(c->buf) && c->out.len < MORKSERVEBACKLOG )
+		events |= POLLIN;
+	if( c->out.len )	events |= POLLOUT;
+	return events;
+}
+static void freeMorkServeClient( morkServeClient *c ) {
+	close( c->fd );
+	free( c->out.buf );
+	free( c );
+}
+
+// Loads the books, publishes the first snapshot and starts watching
+static bool startMorkServer( morkServer *srv, const char **files, int cnt ) {
+	morkServeSnapshot *s;
+	int i;
+
+	srv->cnt = cnt;
+	srv->files = calloc( cnt, sizeof(*srv->files) );
+	s = calloc( 1, sizeof(*s) + cnt * sizeof(*s->books) );
+	srv->inotifyFd = inotify_init1( IN_CLOEXEC );
+	if( !srv->files || !s || srv->inotifyFd < 0 ) {
+		morkErr( "***** error: unable to start watching the files\n" );
+		free( s );
+		return false;
+	}
+	s->books = (morkServeCards **) (s + 1);
+	s->cnt = cnt;
+	s->generation = 1;
+	for( i = 0; i < cnt; ++i ) {
+		morkServeFile *f = &srv->files[i];
+		char *dir = strdup( files[i] );
+		char *slash = dir ? strrchr( dir, '/' ) : (char *) 0;
+		f->path = files[i];
+		f->name = strdup( slash ? slash + 1 : files[i] );
+		if( slash )	slash[slash == dir ? 1 : 0] = '\0';
+		// The directory is watched so files written over are seen
+		f->wd = inotify_add_watch( srv->inotifyFd, slash ? dir : ".",
+			IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE );
+		if( f->wd < 0 )	morkErr( "error: unable to watch file \"%s\"\n", f->path );
+		free( dir );
+		if( updateMorkServeFile( f ) )
+			s->books[i] = remakeMorkServeCards( f, (morkServeCards *) 0 );
+		morkLog( "Serving %d cards of \"%s\"\n",
+			s->books[i] ? s->books[i]->cnt : 0, f->path );
+	}
+	atomic_init( &srv->current, s );
+	atomic_init( &srv->reading, (morkServeSnapshot *) 0 );
+	atomic_init( &srv->stop, false );
+	if( pthread_create( &srv->watcher, NULL, watchMorkServeFiles, srv ) ) {
+		morkErr( "***** error: unable to start file watcher thread\n" );
+		return false;
+	}
+	return true;
+}
+static void freeMorkServer( morkServer *srv ) {
+	morkServeSnapshot *s = atomic_load( &srv->current );
+	int i;
+	if( s ) {
+		for( i = 0; i < s->cnt; ++i )	freeMorkServeCards( s->books[i] );
+		free( s );
+	}
+	for( i = 0; srv->files && i < srv->cnt; ++i ) {
+		morkParserFree( srv->files[i].parser );
+		free( srv->files[i].name );
+		free( srv->files[i].rows );
+	}
+	free( srv->files );
+	if( srv->inotifyFd >= 0 )	close( srv->inotifyFd );
+}
+
+// Serves the files on the socket until it is sent SIGINT or SIGTERM.
+// Returns false if it could not start.
+int serveMorkFiles( const char *socketPath, const char **files, int cnt ) {
+	morkServer		srv;
+	morkServeReply		reply;
+	morkServeClient		**clients = (morkServeClient **) 0;
+	struct pollfd		*pfds = (struct pollfd *) 0;
+	struct sockaddr_un	addr;
+	struct stat		st;
+	int			clientCnt = 0, clientSize = 0;
+	int			listenFd;
+	int			i;
+
+	memset( &srv, 0, sizeof(srv) );
+	memset( &reply, 0, sizeof(reply) );
+	memset( &addr, 0, sizeof(addr) );
+	if( strlen( socketPath ) >= sizeof(addr.sun_path) ) {
+		morkErr( "error: socket name \"%s\" is too long\n", socketPath );
+		return false;
+	}
+	addr.sun_family = AF_UNIX;
+	strcpy( addr.sun_path, socketPath );
+	// Only a socket left from an earlier run is taken away
+	if( lstat( socketPath, &st ) == 0 ) {
+		if( !S_ISSOCK( st.st_mode ) ) {
+			morkErr( "error: \"%s\" is there and is not a socket\n", socketPath );
+			return false;
+		}
+		unlink( socketPath );
+	}
+	listenFd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+	if( listenFd < 0 || bind( listenFd, (struct sockaddr *) &addr, sizeof(addr) ) ||
+	    chmod( socketPath, 0600 ) || listen( listenFd, 16 ) ) {
+		morkErr( "error: unable to listen on socket \"%s\"\n", socketPath );
+		if( listenFd >= 0 )	close( listenFd );
+		return false;
+	}
+	srv.inotifyFd = -1;
+	if( !startMorkServer( &srv, files, cnt ) ) {
+		close( listenFd );
+		unlink( socketPath );
+		freeMorkServer( &srv );
+		return false;
+	}
+	signal( SIGINT, stopMorkServe );
+	signal( SIGTERM, stopMorkServe );
+	while( !morkServeSignalled ) {
+		if( clientCnt + 1 > clientSize ) {
+			clientSize = clientSize ? clientSize * 2 : 16;
+			clients = realloc( clients, clientSize * sizeof(*clients) );
+			pfds = realloc( pfds, (clientSize + 1) * sizeof(*pfds) );
+		}
+		pfds[0].fd = listenFd;
+		pfds[0].events = POLLIN;
+		for( i = 0; i < clientCnt; ++i ) {
+			pfds[i+1].fd = clients[i]->fd;
+			pfds[i+1].events = pollMorkServeClient( clients[i] );
+		}
+		if( poll( pfds, clientCnt + 1, MORKSERVEPOLLMS ) <= 0 )	continue;
+		// Answer the clients, dropping the ones that are done
+		for( i = clientCnt - 1; i >= 0; --i ) {
+			short revents = pfds[i+1].revents;
+			bool ok = true;
+			if( !revents )	continue;
+			if( revents & POLLIN )	ok = readMorkServeClient( clients[i] );
+			else if( revents & (POLLERR | POLLHUP | POLLNVAL) )	ok = false;
+			if( ok && answerMorkServeClient( &srv, clients[i], &reply ) )	continue;
+			freeMorkServeClient( clients[i] );
+			clients[i] = clients[--clientCnt];
+		}
+		if( pfds[0].revents & POLLIN ) {
+			int fd = accept( listenFd, NULL, NULL );
+			morkServeClient *c = fd >= 0 ? calloc( 1, sizeof(*c) ) : (morkServeClient *) 0;
+			if( c && fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) | O_NONBLOCK ) == 0 ) {
+				c->fd = fd;
+				clients[clientCnt++] = c;
+			} else if( fd >= 0 ) {
+				close( fd );
+				free( c );
+			}
+		}
+	}
+	atomic_store( &srv.stop, true );
+	pthread_join( srv.watcher, NULL );
+	for( i = 0; i < clientCnt; ++i )	freeMorkServeClient( clients[i] );
+	free( clients );
+	free( pfds );
+	free( reply.buf );
+	close( listenFd );
+	unlink( socketPath );
+	freeMorkServer( &srv );
+	return true;
+}
@@ -13,12 +13,16 @@
  *    After getting this generally working based on the referenced code,
  *    reverse engineering, etc., I found some documentation on the file
  *    format at: https://developer.mozilla.org/en-US/docs/Mork_Structure
+ *
+ *    The characters are turned into tokens by the lexer in morkLexer.c,
+ *    the functions here just apply those tokens to the Mork database.
  ----------------------------------------------------------------------------*/
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include "parseMork.h"
+#include "morkLexer.h"
 #include "vCard.h"
 //
 // OK, in table scope 128 there seems to be two tables, 0 and 1
@@ -42,79 +46,161 @@ const char MorkDictColumnMeta[] = "<(a=c)>";
 #define	morkLog(...)	if( morkLogfp ) fprintf( morkLogfp, ##__VA_ARGS__ )
 #define	morkErr(...)	if( morkErrfp ) fprintf( morkErrfp, ##__VA_ARGS__ )
 
+// Sizes of the blocks of the dictionaries' string pools, the first
+// block and then the most they double up to
+#define	MORKPOOLFIRSTSIZE	1024
+#define	MORKPOOLBLOCKSIZE	65536
+// Bytes between progress calls when the options do not say
+#define	MORKPROGRESSBYTES	(1024 * 1024)
+// Literal cell values are put in the values dictionary with ids
+// counting up from here, well above the ids used in the files, so
+// they always go on the end of it
+#define	MORKLITERALIDBASE	(1LL << 62)
+// Most cells of a bulk loaded row sorted by insertion, longer rows are
+// merge sorted
+#define	MORKSORTCELLS		16
+
+// A token held back while its group is still open
+typedef struct {
+	morkTokenType	type;
+	int		flags;
+	int		id;
+	int		textOff;
+	int		textLen;
+	int		valueOff;
+	int		valueLen;
+} morkSavedToken;
+// The tokens of an open group (with all their text in one buffer)
+typedef struct {
+	int		cnt;
+	int		size;
+	morkSavedToken	*entries;
+	char		*text;
+	int		textLen;
+	int		textSize;
+} morkTokenQueue;
+// The parser state carried from one call to the next, nothing
+// is kept on the stack between calls to morkParserFeed()
+struct morkParser {
+	morkDb		*mork;
+	morkLexer	lex;
+	morkId		tableId;	// Current table, 0 when not in one
+	morkId		tableScope;
+	bool		inGroup;	// Holding tokens for a group
+	int		groupId;
+	morkTokenQueue	group;
+	// Column projection, only row cells for these columns are kept
+	char		**wantNames;	// Column names, NULL to keep all
+	int		wantNameCnt;
+	morkId		*wantIds;	// Column ids, sorted
+	int		wantIdCnt;
+	int		wantIdSize;
+	bool		inColumnDict;	// The lexer is in the column dictionary
+	// Row filter, rows it turns down are dropped as they are completed
+	morkRowFilter	rowFilter;
+	void		*rowFilterArg;
+	morkId		rowFirstValueId; // First literal value id of the open row
+	morkRowCallback	rowComplete;
+	void		*rowCompleteArg;
+	bool		rowOpen;	// A row was started and not ended
+	// Progress calls, the parse is cancelled when one returns false
+	morkProgressCallback progress;
+	void		*progressArg;
+	long long	progressBytes;	// Bytes between calls
+	int		progressGroups;	// Groups between calls, 0 for none
+	long long	nextProgress;	// Byte offset of the next call
+	morkProgress	done;		// How far the parse has got
+	bool		cancelled;
+};
+
 // Internally used function declarations
-int parseMorkDict( FILE *ifp, morkDb *mork );
-  int parseMorkCell( FILE *ifp, morkDb *mork );
-  void storeInMorkDict( morkDb *mork, morkDict *dict, int key, char *value );
-int parseMorkTable( FILE *ifp, morkDb *mork );
-int parseMorkRow( FILE *ifp, morkDb *mork, int a, int b );
-void setCurrentRow( morkDb *mork, int TableScope, int TableId, int RowScope, int RowId );
+static morkTokenHandler selectMorkTokenHandler( void );
+  void noteMorkWantedColumn( morkParser *p, const morkToken *token );
+int wantMorkCell( void *arg, const char *column, int columnLen, int flags );
+static void addMorkWantedId( morkParser *p, morkId id );
+static int findMorkKey( const morkId *keys, int cnt, morkId key );
+  void filterMorkRow( morkParser *p, morkId firstValueId );
+  void completeMorkRow( morkParser *p );
+  void completeOpenMorkRow( morkParser *p );
+  void queueMorkToken( morkTokenQueue *q, const morkToken *token );
+  void freeMorkTokenQueue( morkTokenQueue *q );
+void reportMorkLexError( morkLexer *lex );
+  int reportMorkProgress( morkParser *p );
+  void noteMorkSkip( morkParser *p, const morkToken *token );
 morkCells *makeMorkCells();
-void storeInMorkCell( morkCells *cells, int key, int value );
+void freeMorkCells( morkCells *cells );
+void storeInMorkCell( morkCells *cells, morkId key, morkId value );
+  void sortMorkBulkCells( morkCells *cells );
+void trimMorkCells( morkCells *cells );
 morkRowMap *makeMorkRowMap();
-morkCells *getMorkCells( morkRowMap *morkRowMap, int rowId );
+morkCells *getMorkCells( morkRowMap *morkRowMap, morkId rowId );
+morkCells *appendMorkCells( morkRowMap *morkRowMap, morkId rowId );
+static int sortMorkBulkDict( morkDict *dict );
+static void finishMorkBulkLoad( morkDb *mork );
 rowScopeMap *makeRowScopeMap();
-morkRowMap *getMorkRowMap( rowScopeMap *rowScopeMap, int rowScope );
+morkRowMap *getMorkRowMap( rowScopeMap *rowScopeMap, morkId rowScope );
 morkTableMap *makeMorkTableMap();
 void freeMorkTableMap( morkTableMap *morkTableMap );
-rowScopeMap *getRowScopeMapEntry( morkDb *m, morkTableMap *morkTableMap, int tableId );
+rowScopeMap *getRowScopeMapEntry( morkDb *m, morkTableMap *morkTableMap, morkId tableId );
 void initializeTableScopeMap( morkDb *mork );
-morkTableMap *getMorkTableMapEntry( morkDb *mork, int tableScope );
-int parseMorkComment( FILE *ifp );
-  void parseScopeId( const char *textId, int *Id, int *Scope );
-  int parseMorkGroup( FILE *ifp );
-  int parseMorkMeta( FILE *ifp, char c );
-int parseMorkGroup( FILE *ifp );
+morkTableMap *getMorkTableMapEntry( morkDb *mork, morkId tableScope );
+void parseScopeId( const char *textId, morkId *Id, morkId *Scope );
+// From morkCount.c
+void presizeMorkDicts( morkDb *mork, const morkCounts *counts );
+void presizeMorkRowMap( morkRowMap *map, const morkCounts *counts,
+		morkId tableScope, morkId tableId, morkId rowScope );
 // MorkDict interface functions
 void initializeDict( morkDict *dict );
 void dumpMorkDict( FILE *ofp, morkDict *dict );
-char *getMorkDictValue( morkDict *dict, int key );
-int getMorkDictKey( morkDict *dict, const char *value );
+char *getMorkDictValue( morkDict *dict, morkId key );
+morkId getMorkDictKey( morkDict *dict, const char *value );
 void freeMorkDict( morkDict *dict );
-void freeMorkDictEntry( morkDictEntry *e );
-char *getValue( morkDb *mork, int objectId );
-char *getColumn( morkDb *morkDb, int objectId );
-int getColumnId( morkDb *morkDb, const char *value );
-
-// Read the characters through a function so that
-// I can add position counting in the input stream
-// and character buffering to use if groups are
-// properly implemented (need to go back and read
-// them again if not ~abort~'d).
-int morkgetc( FILE *ifp ) {
-	return fgetc( ifp );
-}
-int morkungetc( int c, FILE *ifp ) {
-	return ungetc( c, ifp );
-}
+void setMorkDictEntry( morkDict *dict, morkDictEntry *e, morkId key, const char *value );
+static void unpoolMorkString( morkDict *dict, const char *text );
 
 void freeMorkDb( morkDb *mork ) {
 	freeMorkDict( mork->columns );
+	free( mork->columns );
 	mork->columns = NULL;
 	freeMorkDict( mork->values );
+	free( mork->values );
 	mork->values = NULL;
 	mork->activeCells = NULL;
+	mork->activeRowMap = NULL;
+	mork->resolved = 0;
+	free( mork->skips );
+	mork->skips = NULL;
+	mork->skipCnt = mork->skipSize = 0;
+	if( mork->slots ) {
+		free( mork->slots->slotOf );
+		free( mork->slots );
+		mork->slots = NULL;
+	}
 	if( mork->entries ) {
 		int i;
 		for( i = 0; i < mork->cnt; ++i ) {
 			freeMorkTableMap( mork->entries[i] );
+			free( mork->entries[i] );
 		}
 	}
 	free( mork->entries );
 	mork->entries = NULL;
 	free( mork->keys );
 	mork->keys = NULL;
-	mork->cnt = 0;
+	mork->cnt = mork->size = 0;
 }
 
 morkDb *parseMorkFile( const char *filename ) {
+	return parseMorkFileWithOptions( filename, (morkParseOptions *) 0 );
+}
+morkDb *parseMorkFileWithOptions( const char *filename, const morkParseOptions *options ) {
 	morkDb	*mork;
 	FILE	*ifp = fopen( filename, "r" );
 	if( !ifp ) {
 		morkErr( "error: unable to read file \"%s\"\n", filename );
 		return 0;
 	}
-	mork = parseMorkStream( ifp );
+	mork = parseMorkStreamWithOptions( ifp, options );
 	fclose( ifp );
 
 	// Print some info about what we loaded
@@ -130,615 +216,508 @@ morkDb *parseMorkFile( const char *filename ) {
 }
 
 morkDb *parseMorkStream( FILE *ifp ) {
-	morkDb	*mork;
-	bool	result	= true;	// Boolean result flag
-	int	cur	= 0;	// The current character
+	return parseMorkStreamWithOptions( ifp, (morkParseOptions *) 0 );
+}
+morkDb *parseMorkStreamWithOptions( FILE *ifp, const morkParseOptions *options ) {
+	morkParser	*parser;
+	morkCounts	counts;
+	morkDb		*mork;
+	char		*buf;
+	size_t		n;
+	long		start = -1;
 
-	// Create and initialize the mork database object
-	mork = (morkDb *) calloc( 1, sizeof(*mork) );
-	if( !mork ) {
+	memset( &counts, 0, sizeof(counts) );
+	// Count what is in the file first and go back to the start,
+	// unless the stream cannot be gone back on
+	if( options && options->presize && (start = ftell( ifp )) >= 0 ) {
+		if( !countMorkStream( ifp, &counts ) || fseek( ifp, start, SEEK_SET ) ) {
+			freeMorkCounts( &counts );
+			if( fseek( ifp, start, SEEK_SET ) )	return (morkDb *) 0;
+			start = -1;
+		}
+	}
+	parser = morkParserCreate();
+	buf = malloc( MORKREADSIZE );
+	if( !parser || !buf || !morkParserSetOptions( parser, options ) ) {
 		morkErr( "***** error: unable to allocate mork database structure\n" );
+		morkParserFree( parser );
+		freeMorkCounts( &counts );
+		free( buf );
 		return (morkDb *) 0;
 	}
-	initializeTableScopeMap( mork );
-
-	// It should start with the MorkMagicHeader
-	char	magicHeaderBuffer[512];
-	int	bufferPos = 0;
-	do {
-		magicHeaderBuffer[bufferPos++] = morkgetc( ifp );
-	} while( bufferPos < strlen( MorkMagicHeader ) && !feof( ifp ) );
-	magicHeaderBuffer[bufferPos] = '\0';
-	if( strcmp( magicHeaderBuffer, MorkMagicHeader ) != 0 ) {
-		morkErr( "***** error: Mork does not start with \"%s\"\n", magicHeaderBuffer );
-		morkLog( "***** error: magic head mismatch \"%s\"\n",
-			magicHeaderBuffer );
-		free( mork );
-		return (morkDb *) 0;
+	if( start >= 0 ) {
+		presizeMorkDicts( parser->mork, &counts );
+		parser->mork->counts = &counts;
 	}
-	morkLog( "Correct \"%s\" header found\n", magicHeaderBuffer );
-
-	cur = morkgetc( ifp );
-	while( result && cur && !feof( ifp ) ) {
-		if( !isspace( cur ) ) {
-			switch( cur ) {
-			case '<':	// Dict
-				result = parseMorkDict( ifp, mork );
-				if( !result ) morkErr( "***** error: parsing Mork dictionary\n" );
-				break;
-			case '/':	// Comment
-				result = parseMorkComment( ifp );
-				if( !result ) morkErr( "***** error: parsing Mork comment\n" );
-				break;
-			case '{':	// Table
-				result = parseMorkTable( ifp, mork );
-				if( !result ) morkErr( "***** error: parsing Mork table\n" );
-				break;
-			case '[':	// Row
-				result = parseMorkRow( ifp, mork, 0, 0 );
-				if( !result ) morkErr( "***** error: parsing Mork row\n" );
-				break;
-			case '@':	// Group
-				result = parseMorkGroup( ifp );
-				if( !result ) morkErr( "***** error: parsing Mork group\n" );
-				break;
-			default:
-				morkErr( "format error: with '%c', looking for '<', '/', '{', '[', or '@'\n", cur );
-				result = false;
-				break;
-			}
+	// The progress calls can say how much there is, if the stream
+	// can be gone back on
+	if( parser->progress && (start = ftell( ifp )) >= 0 && !fseek( ifp, 0, SEEK_END ) ) {
+		long end = ftell( ifp );
+		if( fseek( ifp, start, SEEK_SET ) ) {
+			morkParserFree( parser );
+			freeMorkCounts( &counts );
+			free( buf );
+			return (morkDb *) 0;
 		}
-		cur = morkgetc( ifp );
+		if( end > start )	parser->done.total = end - start;
+	}
+	// Nothing looks at the rows until the whole file is in, so they
+	// can be sorted once at the end (unless a row filter wants them)
+	parser->mork->bulk = !parser->rowFilter;
+
+	// Run the whole stream through the parser
+	while( (n = fread( buf, 1, MORKREADSIZE, ifp )) > 0 ) {
+		if( !morkParserFeed( parser, buf, n ) )	break;
 	}
+	free( buf );
+	mork = morkParserFinish( parser );
+	if( mork )	mork->counts = (morkCounts *) 0;
+	freeMorkCounts( &counts );
 	return mork;
 }
-// A Mork dictionary starts with '<'
-int parseMorkDict( FILE *ifp, morkDb *m ) {
-	char buf[10];
-	int i;
-	bool result = true;
-	m->nowParsing = NPValues;
-
-	morkLog( "Entering parseMorkDict()\n" );
-	int cur = morkgetc( ifp );
-
-	while( result && cur != '>' && cur && !feof(ifp) ) {
-		if( !isspace( cur ) ) {
-			switch( cur ) {
-			case '<':
-				buf[0] = cur;
-				for( i = 1; i < strlen( MorkDictColumnMeta ); ++i ) {
-					cur = morkgetc( ifp );
-					buf[i] = cur;
-				}
-				buf[i] = '\0';
-				if( strncmp( buf, MorkDictColumnMeta, strlen(MorkDictColumnMeta) ) == 0 ) {
-					m->nowParsing = NPColumns;
-				} else {
-					// What do I do about the input
-					// position? It has been advanced...
-					morkErr( "error: thought we were getting a dictionary but found \"%s\" instead of \"%s\"\n", buf, MorkDictColumnMeta );
-				}
-				break;
-			case '(':	// Cells
-				result = parseMorkCell( ifp, m );
-				break;
-			case '/':	// Comment
-				result = parseMorkComment( ifp );
-				break;
-			default:	// ???
-				morkLog( "---- Ignored '%c' in parseMorkDict()\n", cur );
-				break;
-			}
-		}
-		cur = morkgetc( ifp );
-	}
-	morkLog( "-- Leaving parseMorkDict()\n" );
-	return result;
-}
-// A Mork Cell starts with '('
-int parseMorkCell( FILE *ifp, morkDb *m ) {
-	bool result = true;
-	bool columnIsObjectId = false;
-	bool valueIsObjectId = false;
-	bool bColumn = true;
-	int corners = 0;
-
-	morkLog( "  .  Entering parseMorkCell()" );
-
-	// Column = Value
-	char	column[512];
-	int	colPos = 0;
-	char	text[512];
-	int	textPos = 0;
 
-	// Process cell, start with column (bColumn == true)
-	char cur = morkgetc( ifp );
-	while( result && cur != ')' && cur && !feof(ifp) ) {
-		switch( cur ) {
-		case '^':	// Oids
-			if( bColumn ) {
-				corners++;
-				if( 1 == corners ) {
-					columnIsObjectId = true;
-				} else if( 2 == corners ) {
-					bColumn = false;
-					valueIsObjectId = true;
-				}
-			} else {
-				text[textPos++] = cur;
-			}
-			break;
-		case '=':	// Transitioning from column to value
-			if( bColumn ) {
-				bColumn = false;
-			} else {
-				text[textPos++] = cur;
-			}
-			break;
-		case '\\': {	// Skip the newline if there is one
-				// otherwise it is an escaped character
-			char nextChar = morkgetc( ifp );
-			if( '\r' != nextChar && '\n' != nextChar ) {
-				text[textPos++] = nextChar;
-			} //else morkgetc( ifp );
-			}
-			break;
-		case '$': {	// Hex escape, get next two chars
-			char	hexChar[3];
-			hexChar[0] = morkgetc( ifp );
-			hexChar[1] = morkgetc( ifp );
-			hexChar[2] = '\0';
-			text[textPos++] = (char) strtol( hexChar, (char **) NULL, 16 );
-			}
-			break;
-		default: // Just a char
-			if( bColumn ) {
-				if( !isspace( cur ) )
-					column[colPos++] = cur;
-			} else {
-				text[textPos++] = cur;
-			}
-			break;
-		}
-		cur = morkgetc( ifp );
+// Push parser interface
+//
+// The input can be handed to morkParserFeed() in pieces of any size
+// as it arrives, then morkParserFinish() returns the Mork database.
+morkParser *morkParserCreate( void ) {
+	morkParser *p = (morkParser *) calloc( 1, sizeof(*p) );
+	if( !p )	return p;
+	// Create and initialize the mork database object
+	p->mork = (morkDb *) calloc( 1, sizeof(*p->mork) );
+	if( !p->mork ) {
+		free( p );
+		return (morkParser *) 0;
 	}
-	column[colPos] = '\0';
-	text[textPos] = '\0';
-	morkLog( " => %s%s%s%s\n", columnIsObjectId ? "^" : "", column, valueIsObjectId ? "^" : "=", text );
-
-	// Apply column and text
-	int columnId = strtol( column, (char **) NULL, 16 );
-
-	// If the text field is not empty
-	if( '\0' != text[0] ) {
-		if( NPRows == m->nowParsing ) {
-			// Rows
-			if( valueIsObjectId  ) {
-				int valueId = strtol( text, (char **) NULL, 16 );
-				storeInMorkCell( m->activeCells, columnId,
-						valueId );
-			} else {
-				m->nextAddValueId--;
-				storeInMorkDict( m, m->values,
-					m->nextAddValueId, text );
-				storeInMorkCell( m->activeCells,
-					columnId, m->nextAddValueId );
-			}
-		} else {
-			// Dicts
-			if( NPColumns == m->nowParsing ) {
-				storeInMorkDict( m, m->columns, columnId, text);
-			} else {
-				storeInMorkDict( m, m->values, columnId, text );
-			}
-		}
-	//} else {
-	//	// If the text is empty I should probably be removing
-	//	// any previously set cell for the column...
-	//	// If nothing previously set, then just doing nothing
-	//	// is fine.
-	//	if( NPRows == m->nowParsing ) {
-	//		// Rows
-	//		int i;
-	//		for( i = 0; i < m->activeCells->cnt; ++i ) {
-	//			if( columnId <= m->activeCells->entries[i]->key ) {
-	//				break;
-	//			}
-	//		}
-	//		if( i < m->activeCells->cnt &&
-	//		    m->activeCells->entries[i]->key == columnId ) {
-	//			morkErr( "Changing %X from %X to empty\n",
-	//				columnId, m->activeCells->entries[i]->value );
-	//			morkLog( "Changing %X from %X to empty\n",
-	//				columnId, m->activeCells->entries[i]->value );
-	//		}
-	//	} else {
-	//		// Dicts
-	//		if( NPColumns == m->nowParsing ) {
-	//			morkErr( "Empty value for column dictionary entry %X? Was \"%s\"?\n",
-	//				columnId, getColumn( m, columnId ) );
-	//			morkLog( "Empty value for column dictionary entry %X? Was \"%s\"?\n",
-	//				columnId, getColumn( m, columnId ) );
-	//		} else {
-	//			morkErr( "Empty value for values dictionary entry %X? Was \"%s\"?\n",
-	//				columnId, getValue( m, columnId ) );
-	//			morkLog( "Empty value for values dictionary entry %X? Was \"%s\"?\n",
-	//				columnId, getValue( m, columnId ) );
-	//		}
-	//	}
-	}
-	return result;
-}
-int parseMorkComment( FILE *ifp ) {
-	morkLog( "  Entering parseMorkComment()" );
-	char	cmntBuf[512];
-	int	cmntPos = 0;
-	int cur = morkgetc( ifp );
-	if( '/' != cur ) return false;
-
-	while( cur && cur != '\r' && cur != '\n' ) {
-		cmntBuf[cmntPos++] = cur;
-		cur = morkgetc( ifp );
+	initializeTableScopeMap( p->mork );
+	morkLexerInit( &p->lex, selectMorkTokenHandler(), p );
+	return p;
+}
+// Sets the parse options, before anything is fed to the parser.
+// Returns false if it ran out of memory.
+int morkParserSetOptions( morkParser *p, const morkParseOptions *options ) {
+	int i;
+	if( !options )	return true;
+	p->rowFilter = options->rowFilter;
+	p->rowFilterArg = options->rowFilterArg;
+	p->rowComplete = options->rowComplete;
+	p->rowCompleteArg = options->rowCompleteArg;
+	p->lex.resync = options->recover;
+	if( options->progress ) {
+		p->progress = options->progress;
+		p->progressArg = options->progressArg;
+		p->progressBytes = options->progressBytes > 0 ?
+			options->progressBytes : MORKPROGRESSBYTES;
+		p->progressGroups = options->progressGroups;
+		p->nextProgress = p->progressBytes;
+	}
+	if( !options->columnCnt && !options->columnIdCnt )
+		return true;
+	// Keep copies of the wanted columns, the names are turned into
+	// ids as the column dictionary goes by
+	p->wantNames = calloc( options->columnCnt + 1, sizeof(*p->wantNames) );
+	if( !p->wantNames )	return false;
+	for( i = 0; i < options->columnCnt; ++i ) {
+		p->wantNames[i] = strdup( options->columns[i] );
+		if( !p->wantNames[i] )	return false;
+		p->wantNameCnt++;
 	}
-	cmntBuf[cmntPos] = '\0';
-	morkLog( " => \"%s\"\n", cmntBuf );
+	for( i = 0; i < options->columnIdCnt; ++i )
+		addMorkWantedId( p, options->columnIds[i] );
+	p->lex.filter = wantMorkCell;
 	return true;
 }
-// A Mork table starts with '{'
-int parseMorkTable( FILE *ifp, morkDb *m ) {
-	bool result = true;
-	char	textId[512];
-	int	textPos = 0;
-	int id = 0, scope = 0;
-
-	morkLog( "Entering parseMorkTable()\n" );
-
-	char cur = morkgetc( ifp );
-
-	// Get id
-	while( cur && cur != '{' && cur != '[' && cur != '}' ) {
-		if( !isspace( cur ) ) {
-			textId[textPos++] = cur;
-		}
-		cur = morkgetc( ifp );
+// Adds a column id to the sorted set of wanted ids
+static void addMorkWantedId( morkParser *p, morkId id ) {
+	int i = findMorkKey( p->wantIds, p->wantIdCnt, id );
+	if( i < p->wantIdCnt && p->wantIds[i] == id )	return;
+	if( p->wantIdCnt >= p->wantIdSize ) {
+		p->wantIdSize = p->wantIdSize ? p->wantIdSize * 2 : 16;
+		p->wantIds = realloc( p->wantIds, p->wantIdSize * sizeof(*p->wantIds) );
 	}
-	textId[textPos] = '\0';
-
-	parseScopeId( textId, &id, &scope );
-
-	// Parse the table
-	while( result && cur && cur != '}' ) {
-		if( !isspace( cur ) ) {
-			switch( cur ) {
-			case '{':
-				result = parseMorkMeta( ifp, '}' );
-				break;
-			case '[':
-				result = parseMorkRow( ifp, m, id, scope );
-				break;
-			case '-':
-			case '+':
-				break;
-			default: {
-				char	justId[512];
-				int	justPos = 0;
-				while( cur && !isspace( cur ) ) {
-					justId[justPos++] = cur;
-					cur = morkgetc( ifp );
-
-					if( cur == '}' ) {
-						morkLog( "-- Leaving parseMorkTable()\n" );
-						return result;
-					}
-				}
-				justId[justPos] = '\0';
-
-				int justIdNum = 0, justScopeNum = 0;
-				parseScopeId( justId, &justIdNum, &justScopeNum );
-
-				setCurrentRow( m, scope, id, justScopeNum, justIdNum );
-				}
-				break;
-			}
-		}
-		cur = morkgetc( ifp );
+	memmove( p->wantIds + i + 1, p->wantIds + i,
+		(p->wantIdCnt - i) * sizeof(*p->wantIds) );
+	p->wantIds[i] = id;
+	p->wantIdCnt++;
+}
+// Cell filter for the lexer, keeps the row cells of wanted columns.
+// The column is the hex id, as storeMorkCellToken() reads it.
+int wantMorkCell( void *arg, const char *column, int columnLen, int flags ) {
+	morkParser *p = (morkParser *) arg;
+	morkId id = strtoll( column, (char **) NULL, 16 );
+	int i = findMorkKey( p->wantIds, p->wantIdCnt, id );
+	return i < p->wantIdCnt && p->wantIds[i] == id;
+}
+// Returns false once there has been an error and the
+// rest of the input will be ignored
+int morkParserFeed( morkParser *p, const char *bytes, size_t len ) {
+	if( p->lex.error || p->cancelled )	return false;
+	// Stop for each progress call on the way through
+	while( p->progress && (long long) len >= p->nextProgress - p->lex.offset ) {
+		size_t n = p->nextProgress - p->lex.offset;
+		p->nextProgress += p->progressBytes;
+		if( !morkLexerFeed( &p->lex, bytes, n ) )	break;
+		bytes += n;
+		len -= n;
+		if( !reportMorkProgress( p ) )	return false;
+	}
+	if( p->lex.error || !morkLexerFeed( &p->lex, bytes, len ) ) {
+		if( !p->cancelled )	reportMorkLexError( &p->lex );
+		return false;
 	}
-	morkLog( "-- Leaving parseMorkTable()\n" );
-	return result;
+	return true;
 }
-void setCurrentRow( morkDb *m, int TableScope, int TableId, int RowScope, int RowId ) {
-	if( !RowScope )	  RowScope = m->defaultScope;
-	if( !TableScope ) TableScope = m->defaultScope;
-
-	morkLog( "  Setting active cells to Table ID %d in TableScope "
-		 "%d and Row ID %d in Row Scope %d\n",
-		 TableId, TableScope, RowId, RowScope );
-	morkTableMap *tableMap = getMorkTableMapEntry( m, TableScope );
-	rowScopeMap *rowScopeMap = getRowScopeMapEntry( m, tableMap, TableId );
-	morkRowMap *rowMap = getMorkRowMap( rowScopeMap, RowScope );
-	m->activeCells = getMorkCells( rowMap, RowId );
-}
-void parseScopeId( const char *textId, int *id, int *scope ) {
-	morkLog( "  Entering parseScopeId( \"%s\" ) => ", textId );
-
-	char *colonPos = strchr( textId, ':' );
-	if( colonPos ) {
-		// Terminate the string at the colon and move past
-		*colonPos++ = '\0';
-
-		if( *colonPos && '^' == *colonPos ) {
-			// Delete '^'
-			// --- but what does the '^' mean?
-			++colonPos;
-		}
-		*scope = strtol( colonPos, (char **) NULL, 16 );
-		morkLog( "scope %d for ", *scope );
+// Tells the progress callback how far the parse has got.
+// Returns false if it cancels the parse.
+int reportMorkProgress( morkParser *p ) {
+	p->done.bytes = p->lex.offset;
+	if( p->progress( p->progressArg, &p->done ) )	return true;
+	morkLog( "  . Parse cancelled at byte %lld\n", p->done.bytes );
+	p->cancelled = true;
+	return false;
+}
+// The Mork database as parsed so far, to be read between calls to
+// morkParserFeed(). It is still the parser's. The rows of a group
+// that has not ended yet are not in it.
+morkDb *morkParserDb( morkParser *p ) {
+	return p->mork;
+}
+// The next bytes fed are from offset in the file instead of following
+// the last ones, for a parser fed parts of a file (see morkLazy.c).
+// A skip after an error that ran to the end of the last part ends.
+void seekMorkParser( morkParser *p, long long offset ) {
+	if( !p->lex.error )	morkLexerResync( &p->lex );
+	p->lex.offset = offset;
+}
+// Ends the input and frees the parser. Returns the Mork database or
+// NULL if the input was not a Mork file or the parse was cancelled.
+morkDb *morkParserFinish( morkParser *p ) {
+	morkDb *mork;
+	if( !p->lex.error && !p->cancelled && !morkLexerFinish( &p->lex ) ) {
+		reportMorkLexError( &p->lex );
+	}
+	if( p->inGroup && !p->cancelled ) {
+		morkErr( "Something was corrupt in the group footer?\n" );
+		morkLog( "  . Group %d never ended... trashing contents\n",
+			 p->groupId );
+	}
+	// The last progress call, which can still cancel
+	if( p->progress && !p->cancelled && p->lex.error != LEHeader ) {
+		p->done.done = true;
+		reportMorkProgress( p );
 	}
-	*id = strtol( textId, (char **) NULL, 16 );
-	morkLog( "id %d\n", *id );
+	if( p->lex.error == LEHeader || p->cancelled ) {
+		freeMorkDb( p->mork );
+		free( p->mork );
+		p->mork = (morkDb *) 0;
+	}
+	completeOpenMorkRow( p );
+	if( p->mork && p->mork->bulk )	finishMorkBulkLoad( p->mork );
+	mork = p->mork;
+	p->mork = (morkDb *) 0;
+	morkParserFree( p );
+	return mork;
+}
+// Frees the parser along with anything parsed so far
+void morkParserFree( morkParser *p ) {
+	if( !p )	return;
+	if( p->mork ) {
+		freeMorkDb( p->mork );
+		free( p->mork );
+	}
+	freeMorkTokenQueue( &p->group );
+	morkLexerFree( &p->lex );
+	if( p->wantNames ) {
+		int i;
+		for( i = 0; i < p->wantNameCnt; ++i )	free( p->wantNames[i] );
+		free( p->wantNames );
+	}
+	free( p->wantIds );
+	free( p );
+}
+void reportMorkLexError( morkLexer *lex ) {
+	switch( lex->error ) {
+	case LEHeader:
+		morkErr( "***** error: Mork does not start with \"%s\"\n", lex->text );
+		morkLog( "***** error: magic head mismatch \"%s\"\n", lex->text );
+		break;
+	case LEFormat:
+		morkErr( "format error: with '%c', looking for '<', '/', '{', '[', or '@'\n", lex->errorChar );
+		break;
+	case LEComment:
+		morkErr( "***** error: parsing Mork comment\n" );
+		break;
+	case LERow:
+		morkErr( "***** error: expected '(' or '[' not '%c' in parseMorkRow\n", lex->errorChar );
+		morkLog( "***** error: expected '(' or '[' not '%c' in parseMorkRow\n", lex->errorChar );
+		morkErr( "***** error: parsing Mork row\n" );
+		break;
+	default:
+		break;
+	}
+	morkLog( "***** error: parsing stopped at byte %ld\n", lex->offset );
+}
+// Notes the input the lexer skipped after an error. The lexer has
+// already closed the row it was in, a group goes on and is still
+// committed or aborted by its end marker.
+void noteMorkSkip( morkParser *p, const morkToken *token ) {
+	morkDb *m = p->mork;
+	morkSkip *s;
+	completeOpenMorkRow( p );
+	if( m->skipCnt >= m->skipSize ) {
+		m->skipSize = m->skipSize ? m->skipSize * 2 : 16;
+		m->skips = realloc( m->skips, m->skipSize * sizeof(*m->skips) );
+	}
+	s = &m->skips[m->skipCnt++];
+	s->start = p->lex.skipStart;
+	s->end = p->lex.offset;
+	s->error = token->id == LERow ? "row" : token->id == LEComment ? "comment" : "format";
+	s->errorChar = p->lex.errorChar;
+	s->groupId = p->inGroup ? p->groupId : -1;
+	morkErr( "***** %s error: unexpected '%c' at byte %lld, skipped to byte %lld\n",
+		s->error, s->errorChar, s->start, s->end );
 }
 //
 // Groups should be processed as a block that can be ignored
-// or included. Since including ignored blocks in the file seems
-// silly we are ignoring groups themselves and just incorporating
-// all the elements found in groups, outside of groups, etc.
+// or included. The tokens of a group are held back until the
+// end of the group is seen and then either applied or thrown
+// away.
 //
 // The syntax is:
 //   @$${n{@		<-- to start the group (the 'n' is a group number)
 //   @$$}n}@		<-- to end an accepted or included group (the 'n'
 //			    matches the one given in the start.
 //   @$$}~abort~n}@	<-- to end and throw away the group content
-int parseMorkGroup( FILE *ifp ) {
-	if( morkDoNotParseGroups ) {
-		return parseMorkMeta( ifp, '@' );
-	}
-	static	const char *startString = "$${.{";
-	static	const char *endString = "$$}.}";
-	static	const char *abortString = "$$}~abort~.}";
-	char	headerBuf[64];
-	int	headerBufPos = 0;
-	char	*contentBuf = (char *) 0;
-	int	contentBufSize = 0;
-	int	contentBufPos = 0;
-	char	footerBuf[64];
-	int	footerBufPos = 0;
-	int	cur;
-	int	startGroupId = 0;
-	int	endGroupId = -1;
-	bool	isCorrupt;
-	bool	groupAborted = false;
+// Build the token handling with and without logging
+#define	MORKCORELOG	0
+#include "parseMorkCore.h"
+#undef	MORKCORELOG
+#define	MORKCORELOG	1
+#include "parseMorkCore.h"
+#undef	MORKCORELOG
 
-	morkLog( "Entering parseMorkGroup()\n" );
-
-	// Load the group header
-	morkLog( "  . Loading the group header: @" );
-	cur = morkgetc( ifp );
-	while( cur != '@' && cur && !feof(ifp) ) {
-		if( headerBufPos < 63 )
-			headerBuf[headerBufPos++] = cur;
-		cur = morkgetc( ifp );
-	}
-	headerBuf[headerBufPos] = '\0';
-	morkLog( "%s", headerBuf );
-	if( headerBufPos > 4 && headerBuf[headerBufPos-1] == '{' &&
-	    strncmp( headerBuf, startString, 3 ) == 0 &&
-	    isxdigit( headerBuf[3] ) ) {
-		startGroupId = strtol( &headerBuf[3], (char **) NULL, 16 );
-		endGroupId = -startGroupId - 1;
-		morkLog( "@\n    + Got the group header with group id of %d\n",
-			startGroupId );
-	} else {
-		morkLog( "@\n    - Failed to recognize a group header\n" );
-		// If it was not a valid header, then we should not be
-		// considered as being in a group. If I just return
-		// it will be the same as skipping it like a meta sequence!
-		return true;	// Not really true but...
+// The token handler for the logging and group handling wanted
+static morkTokenHandler selectMorkTokenHandler( void ) {
+	if( morkLogfp ) {
+		return morkDoNotParseGroups ? parseMorkTokenNoGroupsLogged : parseMorkTokenLogged;
 	}
-
-	// Load the group contents
-	bool notAtTheEnd = true;
-	cur = morkgetc( ifp );
-	while( notAtTheEnd && cur && !feof(ifp) ) {
-		// Make sure there is buffer space for another character
-		if( contentBufPos >= contentBufSize ) {
-			contentBufSize += 512;
-			contentBuf = realloc( contentBuf,
-				contentBufSize * sizeof(*contentBuf) );
-		}
-		switch( cur ) {
-		case '\\':	// Just blindly load the next character...
-			contentBuf[contentBufPos++] = cur;
-			contentBuf[contentBufPos++] = morkgetc( ifp );
-			break;
-		case '@':	// Could be the end...
-			contentBuf[contentBufPos++] = cur;
-			cur = morkgetc( ifp );
-			contentBuf[contentBufPos++] = cur;
-			if( cur == '$' ) {
-				cur = morkgetc( ifp );
-				contentBuf[contentBufPos++] = cur;
-				if( cur == '$' ) {
-					// I believe it is the end!
-					contentBufPos -= 3; // Remove "@$$"
-					if( morkungetc( '$', ifp ) == EOF )
-						morkErr( "Failed to unget "
-							 "the first '$'\n" );
-					if( morkungetc( '$', ifp ) == EOF )
-						morkErr( "Failed to unget "
-							 "the second '$'\n" );
-					if( morkungetc( ' ', ifp ) == EOF )
-						morkErr( "Failed to unget "
-							 "the staring '@'\n" );
-					notAtTheEnd = false;
-				}
+	return morkDoNotParseGroups ? parseMorkTokenNoGroupsQuiet : parseMorkTokenQuiet;
+}
+// For use outside of the token handling, these log if it is on
+void parseScopeId( const char *textId, morkId *id, morkId *scope ) {
+	if( morkLogfp )	parseScopeIdLogged( textId, id, scope );
+	else		parseScopeIdQuiet( textId, id, scope );
+}
+void storeInMorkCell( morkCells *cells, morkId key, morkId value ) {
+	if( morkLogfp )	storeInMorkCellLogged( cells, key, value );
+	else		storeInMorkCellQuiet( cells, key, value );
+}
+// Watches the column dictionaries go by for the ids of the wanted
+// column names. This is done as the lexer reaches them, not when they
+// are applied, because the rows of a group come through the lexer
+// before the group's dictionaries are applied. An id picked up from a
+// group that is then aborted just keeps a few more cells.
+void noteMorkWantedColumn( morkParser *p, const morkToken *token ) {
+	int i;
+	switch( token->type ) {
+	case MTDictOpen:
+		p->inColumnDict = false;
+		break;
+	case MTDictMeta:
+		p->inColumnDict = token->textLen == strlen( MorkDictColumnMeta ) - 2 &&
+		    strncmp( token->text, MorkDictColumnMeta + 1, token->textLen ) == 0;
+		break;
+	case MTDictClose:
+		p->inColumnDict = false;
+		break;
+	case MTCell:
+		if( !p->inColumnDict )	break;
+		for( i = 0; i < p->wantNameCnt; ++i ) {
+			if( strcmp( token->value, p->wantNames[i] ) == 0 ) {
+				addMorkWantedId( p, strtoll( token->text, (char **) NULL, 16 ) );
+				break;
 			}
-			break;
-		default:
-			contentBuf[contentBufPos++] = cur;
-			break;
 		}
-		cur = morkgetc( ifp );
+		break;
+	default:
+		break;
 	}
-	contentBuf[contentBufPos] = '\0';
-	morkLog( "  . Loaded group contents:\n%s\n", contentBuf );
-
-	// I could look for a group header here and recurse if nested
-	// groups are allowed...
+}
+// Asks the row filter about the row just completed and, if it turns
+// the row down, takes the row back out of its row map along with the
+// literal values it added (those are the values from firstValueId on,
+// at the end of the values dictionary).
+void filterMorkRow( morkParser *p, morkId firstValueId ) {
+	morkDb *m = p->mork;
+	morkRowMap *rowMap = m->activeRowMap;
+	int i;
 
-	// Load the group footer
-	morkLog( "  . Loading the group footer: @" );
-	isCorrupt = false;
-	cur = morkgetc( ifp );
-	while( cur != '@' && cur && !feof(ifp) ) {
-		if( footerBufPos < 63 )
-			footerBuf[footerBufPos++] = cur;
-		cur = morkgetc( ifp );
-	}
-	footerBuf[footerBufPos] = '\0';
-	morkLog( "%s", footerBuf );
-	if( footerBufPos > 4 && footerBuf[footerBufPos-1] == '}' &&
-	    strncmp( footerBuf, endString, 3 ) == 0 &&
-	    isxdigit( footerBuf[3] ) ) {
-		endGroupId = strtol( &footerBuf[3], (char **) NULL, 16 );
-		morkLog( "@\n    + Got the group footer with group id of %d\n",
-			endGroupId );
-	} else if( footerBufPos > 10 && footerBuf[footerBufPos-1] == '}' &&
-	    strncmp( footerBuf, abortString, 10 ) == 0 &&
-	    isxdigit( footerBuf[10] ) ) {
-		// This a strict abort match but really anything that
-		// puts the group index anyplace other than at character
-		// position 3 will result in an abort!
-		groupAborted = true;
-		endGroupId = strtol( &footerBuf[10], (char **) NULL, 16 );
-		morkLog( "@\n    + Got the abort group footer with group id of %d\n",
-			endGroupId );
-	} else {
-		isCorrupt = true;
-		morkLog( "@\n    - Failed to recognize a group footer\n" );
-	}
+	if( p->rowFilter( p->rowFilterArg, m, m->activeTableScope, m->activeTableId,
+			m->activeRowScope, m->activeRowId, m->activeCells ) )
+		return;
+	morkLog( "  -- Dropping row %lld\n", m->activeRowId );
+	i = findMorkKey( rowMap->keys, rowMap->cnt, m->activeRowId );
+	freeMorkCells( rowMap->entries[i] );
+	free( rowMap->entries[i] );
+	memmove( rowMap->keys + i, rowMap->keys + i + 1,
+		(rowMap->cnt - i - 1) * sizeof(*rowMap->keys) );
+	memmove( rowMap->entries + i, rowMap->entries + i + 1,
+		(rowMap->cnt - i - 1) * sizeof(*rowMap->entries) );
+	--rowMap->cnt;
+	m->activeCells = (morkCells *) 0;
 
-	// If the group was not aborted then push the content back on the
-	// input to be read by the normal processing
-	if( isCorrupt ) {
-		morkErr( "Something was corrupt in the group footer?\n" );
-		morkLog( "  . Something was wrong... trashing contents\n" );
-	} else if( startGroupId != endGroupId ) {
-		morkErr( "Something's corrupt because the start group ID "
-			 "is %d and the end group ID is %d\n",
-			 startGroupId, endGroupId );
-		morkLog( "  . Start  and end Id's don't match... "
-			 "trashing the contents\n" );
-	} else if( !groupAborted ) {
-		morkLog( "  . Found a good unaborted group... "
-			 "pushing contents to be loaded\n" );
-		while( --contentBufPos >= 0 ) {
-			if( morkungetc( contentBuf[contentBufPos], ifp ) == EOF ) {
-				morkErr( "***** error: failed ungetting "
-					 "group %d content!\n", startGroupId );
-				// Try and fail gracefully...
-				//   I should try and read in all the
-				//   ungotton characters so it will be just
-				//   like an aborted group!
-				contentBufPos = 0;
-			}
-		}
-	} else {
-		morkLog( "  . Found a good group but it was aborted... "
-			 "trashing contents\n" );
+	if( m->resolved )	freeMorkResolved( m );
+	while( m->values->cnt &&
+	       m->values->entries[m->values->cnt-1].key >= firstValueId ) {
+		morkDictEntry *e = &m->values->entries[--m->values->cnt];
+		if( e->value.pooled.isPooled )	unpoolMorkString( m->values, e->value.pooled.text );
 	}
-	// Free that allocated memory...
-	if( contentBuf )	free( contentBuf );
-	return true;
+	m->nextAddValueId = firstValueId;
 }
-int parseMorkMeta( FILE *ifp, char c ) {
-	int cur = morkgetc( ifp );
-	morkLog( "    - Ignoring meta \"" );
-	while( cur != c && cur && !feof(ifp) ) {
-		if( morkLogfp ) fputc( cur, morkLogfp );
-		cur = morkgetc( ifp );
-	}
-	if( morkLogfp ) fputs( "\"\n", morkLogfp );
-	return true;
+// Hands the row just completed to the row complete callback, NULL
+// cells if the row filter dropped it. The cells of a bulk load are
+// looked up in dictionaries that are only sorted at the end, so one
+// that has had a key out of order is sorted first.
+void completeMorkRow( morkParser *p ) {
+	morkDb *m = p->mork;
+	if( m->columns->unsorted )	m->dictChanges += sortMorkBulkDict( m->columns );
+	if( m->values->unsorted )	m->dictChanges += sortMorkBulkDict( m->values );
+	p->rowComplete( p->rowCompleteArg, m, m->activeTableScope, m->activeTableId,
+		m->activeRowScope, m->activeRowId, m->activeCells );
 }
-int parseMorkRow( FILE *ifp, morkDb *m, int tableId, int tableScope ) {
-	bool result = true;
-	char	rowIdText[512];
-	int	textPos = 0;
-	int rowId = 0, rowScope = 0;
-
-	morkLog( "  Entering parseMorkRow()\n" );
-	m->nowParsing = NPRows;
-
-	int cur = morkgetc( ifp );
-
-	// Get the id text description
-	while( cur != '(' && cur != '[' && cur != ']' && cur && !feof(ifp) ) {
-		if( !isspace( cur ) ) {
-			rowIdText[textPos++] = cur;
-		}
-		cur = morkgetc( ifp );
+// A row an error left without its end keeps the cells it got, so the
+// row complete callback is given it as it is
+void completeOpenMorkRow( morkParser *p ) {
+	if( p->rowOpen && p->mork && p->mork->bulk )	sortMorkBulkCells( p->mork->activeCells );
+	if( p->rowOpen && p->rowComplete && p->mork )	completeMorkRow( p );
+	p->rowOpen = false;
+}
+// Save a copy of the token until its group ends
+void queueMorkToken( morkTokenQueue *q, const morkToken *token ) {
+	morkSavedToken *s;
+	int need = q->textLen + token->textLen + token->valueLen + 2;
+	if( q->cnt >= q->size ) {
+		q->size = q->size ? q->size * 2 : 64;
+		q->entries = realloc( q->entries, q->size * sizeof(*(q->entries)) );
 	}
-	rowIdText[textPos] = '\0';
-
-	// Figure out eh row scope and row ID and set it
-	parseScopeId( rowIdText, &rowId, &rowScope );
-	setCurrentRow( m, tableScope, tableId, rowScope, rowId );
-
-	// Now parse the row itself
-	while( result && cur != ']' && cur ) {
-		if( !isspace( cur ) ) {
-			switch( cur ) {
-			case '(':
-				result = parseMorkCell( ifp, m );
-				if( !result ) {
-					morkErr( "***** error: parsing Mork cell in parseMorkRow()\n" );
-					morkLog( "***** error: parsing Mork cell in parseMorkRow()\n" );
-				}
-				break;
-			case '[':
-				result = parseMorkMeta( ifp, ']' );
-				if( !result ) {
-					morkErr( "***** error: parsing Mork meta in parseMorkRow()\n" );
-					morkLog( "***** error: parsing Mork meta in parseMorkRow()\n" );
-				}
-				break;
-			default:
-				morkErr( "***** error: expected '(' or '[' not '%c' in parseMorkRow\n", cur );
-				morkLog( "***** error: expected '(' or '[' not '%c' in parseMorkRow\n", cur );
-				result = false;
-				break;
-			}
-		}
-		cur = morkgetc( ifp );
+	if( need > q->textSize ) {
+		while( need > q->textSize )
+			q->textSize = q->textSize ? q->textSize * 2 : 4096;
+		q->text = realloc( q->text, q->textSize );
 	}
-	return result;
+	s = &q->entries[q->cnt++];
+	s->type = token->type;
+	s->flags = token->flags;
+	s->id = token->id;
+	s->textOff = q->textLen;
+	s->textLen = token->textLen;
+	memcpy( q->text + q->textLen, token->text, token->textLen + 1 );
+	q->textLen += token->textLen + 1;
+	s->valueOff = q->textLen;
+	s->valueLen = token->valueLen;
+	memcpy( q->text + q->textLen, token->value, token->valueLen + 1 );
+	q->textLen += token->valueLen + 1;
+}
+void freeMorkTokenQueue( morkTokenQueue *q ) {
+	free( q->entries );
+	q->entries = NULL;
+	free( q->text );
+	q->text = NULL;
+	q->cnt = q->size = 0;
+	q->textLen = q->textSize = 0;
 }
 
-char *getValue( morkDb *mork, int objectId ) {
+char *getValue( morkDb *mork, morkId objectId ) {
 	return getMorkDictValue( mork->values, objectId );
 }
-char *getColumn( morkDb *morkDb, int objectId ) {
+char *getColumn( morkDb *morkDb, morkId objectId ) {
 	return getMorkDictValue( morkDb->columns, objectId );
 }
-int getColumnId( morkDb *morkDb, const char *value ) {
+morkId getColumnId( morkDb *morkDb, const char *value ) {
 	return getMorkDictKey( morkDb->columns, value );
 }
+// The column name and value text of the i'th cell of a row
+const char *getMorkCellColumn( morkDb *mork, morkCells *cells, int i ) {
+	if( cells->resolved )	return cells->resolved[i].column;
+	return getColumn( mork, cells->entries[i].key );
+}
+const char *getMorkCellValue( morkDb *mork, morkCells *cells, int i ) {
+	if( cells->resolved )	return cells->resolved[i].value;
+	return getValue( mork, cells->entries[i].value );
+}
 
 // morkDictEntry procedures
-morkDictEntry *makeMorkDictEntry( int key, char *value ) {
-	morkDictEntry *e = malloc( sizeof(morkDictEntry) );
-	e->key = key;
-	e->value = strdup( value );
-	return e;
+//
+// A value too long for its entry goes in the dictionary's string
+// pool. The pool is a list of blocks that the values are packed
+// into one after another. The text of a value that is replaced stays
+// until the dictionary is freed, only the last values pooled can be
+// given back. The first block is small so small dictionaries stay small.
+static char *poolMorkString( morkDict *dict, const char *value, size_t len ) {
+	morkPoolBlock	*b = dict->pool;
+	char		*text;
+	if( !b || b->used + len + 1 > b->size ) {
+		// A very long value gets a block of its own, behind the
+		// block being filled
+		bool own = dict->pool && len + 1 > MORKPOOLBLOCKSIZE / 4;
+		size_t size = b ? b->size * 2 : MORKPOOLFIRSTSIZE;
+		if( size > MORKPOOLBLOCKSIZE )	size = MORKPOOLBLOCKSIZE;
+		if( own || size < len + 1 )	size = len + 1;
+		b = malloc( sizeof(*b) + size );
+		if( !b )	return (char *) 0;
+		b->used = 0;
+		b->size = size;
+		if( own ) {
+			b->next = dict->pool->next;
+			dict->pool->next = b;
+		} else {
+			b->next = dict->pool;
+			dict->pool = b;
+		}
+	}
+	text = (char *) (b + 1) + b->used;
+	memcpy( text, value, len + 1 );
+	b->used += len + 1;
+	return text;
 }
-void freeMorkDictEntry( morkDictEntry *e ) {
-	if( e->value )	free( e->value );
-	e->value = NULL;
-	free( e );
+// Gives back the bytes of the last value pooled that is still there,
+// emptied blocks are freed. A block of its own is the one behind the
+// first, any other value ends the used part of the first block.
+static void unpoolMorkString( morkDict *dict, const char *text ) {
+	morkPoolBlock	*b = dict->pool;
+	size_t		len = strlen( text ) + 1;
+	if( !b )	return;
+	if( b->next && (const char *) (b->next + 1) == text ) {
+		morkPoolBlock *own = b->next;
+		b->next = own->next;
+		free( own );
+		return;
+	}
+	if( text + len != (const char *) (b + 1) + b->used )	return;
+	b->used -= len;
+	if( !b->used ) {
+		dict->pool = b->next;
+		free( b );
+	}
+}
+// Puts the key and a copy of the value in the entry
+void setMorkDictEntry( morkDict *dict, morkDictEntry *e, morkId key, const char *value ) {
+	size_t len = strlen( value );
+	e->key = key;
+	memset( &e->value, 0, sizeof(e->value) );
+	if( len < MORKINLINEVALUE ) {
+		memcpy( e->value.text, value, len );
+		return;
+	}
+	e->value.pooled.text = poolMorkString( dict, value, len );
+	if( e->value.pooled.text ) {
+		e->value.pooled.isPooled = 1;
+	} else {
+		morkErr( "***** error: unable to allocate dictionary value\n" );
+	}
 }
 void dumpMorkDictEntry( FILE *ofp, morkDictEntry *dictEntry ) {
-	fprintf( ofp, "  %3d/%2X: \"%s\"\n", dictEntry->key, dictEntry->key, dictEntry->value );
+	fprintf( ofp, "  %3lld/%2llX: \"%s\"\n", dictEntry->key, dictEntry->key, morkDictEntryValue( dictEntry ) );
 }
 // morkDict procedures
 void dumpMorkValues( FILE *ofp, morkDb *mork ) {
@@ -754,92 +733,64 @@ void dumpMorkColumns( FILE *ofp, morkDb *mork ) {
 void dumpMorkDict( FILE *ofp, morkDict *dict ) {
 	int i;
 	for( i = 0; i < dict->cnt; ++i ) {
-		dumpMorkDictEntry( ofp, dict->entries[i] );
+		dumpMorkDictEntry( ofp, &dict->entries[i] );
 	}
 }
 void initializeDict( morkDict *dict ) {
-	dict->cnt = 0;
-	dict->entries = (morkDictEntry **) 0;
+	dict->cnt = dict->size = 0;
+	dict->entries = (morkDictEntry *) 0;
+	dict->pool = (morkPoolBlock *) 0;
+	dict->unsorted = 0;
 }
-char *getMorkDictValue( morkDict *dict, int key ) {
-	int i;
-	for( i = 0; i < dict->cnt; ++i ) {
-		if( dict->entries[i]->key == key )
-			return dict->entries[i]->value;
+// The entries are kept sorted by key so this is a binary search
+char *getMorkDictValue( morkDict *dict, morkId key ) {
+	int lo = 0, hi = dict->cnt - 1;
+	while( lo <= hi ) {
+		int mid = (lo + hi) / 2;
+		morkId midKey = dict->entries[mid].key;
+		if( midKey == key )	return morkDictEntryValue( &dict->entries[mid] );
+		if( midKey < key )	lo = mid + 1;
+		else			hi = mid - 1;
 	}
 	return "";
 }
-int getMorkDictKey( morkDict *dict, const char *value ) {
+morkId getMorkDictKey( morkDict *dict, const char *value ) {
 	int i;
 	for( i = 0; i < dict->cnt; ++i ) {
-		if( strcmp( value, dict->entries[i]->value ) == 0 )
-			return dict->entries[i]->key;
+		if( strcmp( value, morkDictEntryValue( &dict->entries[i] ) ) == 0 )
+			return dict->entries[i].key;
 	}
 	return 0;
 }
 void freeMorkDict( morkDict *dict ) {
-	if( dict->entries ) {
-		int i;
-		for( i = 0; i < dict->cnt; ++i ) {
-			freeMorkDictEntry( dict->entries[i] );
-			dict->entries[i] = NULL;
-		}
-		free( dict->entries );
+	while( dict->pool ) {
+		morkPoolBlock *next = dict->pool->next;
+		free( dict->pool );
+		dict->pool = next;
 	}
+	free( dict->entries );
 	dict->entries = NULL;
-	dict->cnt = 0;
-}
-void storeInMorkDict( morkDb *m, morkDict *dict, int key, char *value ) {
-	int i, j;
-	char *dictName = "unknown";
-	if( dict == m->columns ) {
-		dictName = "columns";
-	} else if( dict == m->values ) {
-		dictName = "values";
-	}
-	morkLog( "     Setting %s dictionary key %3d/%2X to \"%s\"\n", dictName, key, key, value );
-	for( i = 0; i < dict->cnt; ++i ) {
-		if( key <= dict->entries[i]->key ) {
-			break;
-		}
-	}
-	//morkLog( "   This will be at position %d of %d in the dictionary\n", i, dict->cnt );
-	if( i >= dict->cnt || key != dict->entries[i]->key ) {
-		++dict->cnt;
-		dict->entries = realloc( dict->entries, dict->cnt * sizeof(*(dict->entries)) );
-		for( j = dict->cnt - 1; j > i; --j ) {
-			dict->entries[j] = dict->entries[j-1];
-		}
-	} else {
-		morkLog( "     - Changing %3d/%2X from \"%s\" to \"%s\"\n", key, key, dict->entries[i]->value, value );
-		free( dict->entries[i]->value );
-	}
-	//morkLog( "   Putting the entry at %d with the size now %d\n", i, dict->cnt );
-	dict->entries[i] = makeMorkDictEntry( key, value );
+	dict->cnt = dict->size = 0;
 }
 
 // morkCellEntry procedures
-morkCellEntry *makeMorkCellEntry( int key, int value ) {
-	morkCellEntry *e = malloc( sizeof(morkCellEntry) );
-	e->key = key;
-	e->value = value;
-	return e;
-}
-void freeMorkCellEntry( morkCellEntry *cellEntry ) {
-	free( cellEntry );
+void dumpMorkCellEntry( FILE *ofp, morkDb *mork, morkCells *cells, int i ) {
+	fprintf( ofp, "                 \"%s\" = \"%s\" (%lld/%llX = %lld/%llX)\n",
+		getMorkCellColumn( mork, cells, i ),
+		getMorkCellValue( mork, cells, i ),
+		cells->entries[i].key, cells->entries[i].key,
+		cells->entries[i].value, cells->entries[i].value );
 }
-void dumpMorkCellEntry( FILE *ofp, morkDb *mork, morkCellEntry cellEntry ) {
-	fprintf( ofp, "                 \"%s\" = \"%s\" (%d/%X = %d/%X)\n",
-		getColumn( mork, cellEntry.key ),
-		getValue( mork, cellEntry.value ),
-		cellEntry.key, cellEntry.key,
-		cellEntry.value, cellEntry.value );
-}
-char *valueForColumnId( int columnId, morkCells *cells, morkDb *morkDb ) {
+char *valueForColumnId( morkId columnId, morkCells *cells, morkDb *morkDb ) {
 	int i;
+	if( cells->dense && morkDb->slots ) {
+		i = findMorkDenseCell( morkDb, cells, columnId );
+		if( i < 0 )	return (char *) 0;
+		return (char *) getMorkCellValue( morkDb, cells, i );
+	}
 	for( i = 0; i < cells->cnt; ++i ) {
-		if( cells->entries[i]->key == columnId ) {
-			return getValue( morkDb, cells->entries[i]->value );
+		if( cells->entries[i].key == columnId ) {
+			return (char *) getMorkCellValue( morkDb, cells, i );
 		}
 	}
 	return (char *) 0;
@@ -850,56 +801,58 @@ char *valueForColumnId( int columnId, morkCells *cells, morkDb *morkDb ) {
 #define	vCardLine(colId,fmt)	\
 	value = valueForColumnId( colId, cells, morkDb ); \
 	if( value ) fprintf( ofp, fmt, vCardEscapeString( escBuf, value, ESCBUFSIZE ) )
-void writeMorkCellsAsVcard3_0( FILE *ofp, morkDb *morkDb, morkCells *cells ) {
-	int LastNameCol = getColumnId( morkDb, "LastName" );
-	int FirstNameCol = getColumnId( morkDb, "FirstName" );
-	int FNcol = getColumnId( morkDb, "DisplayName" );
-	int EMAILcol = getColumnId( morkDb, "PrimaryEmail" );
-	//int EMAIL2col = getColumnId( morkDb, "SecondEmail" );
-	int WorkPhoneCol = getColumnId( morkDb, "WorkPhone" );
-	int FaxNumberCol = getColumnId( morkDb, "FaxNumber" );
-	int HomePhoneCol = getColumnId( morkDb, "HomePhone" );
-	int PagerNumberCol = getColumnId( morkDb, "PagerNumber" );
-	int CellularNumberCol = getColumnId( morkDb, "CellularNumber" );
-	int HomeAddressCol = getColumnId( morkDb, "HomeAddress" );
-	int HomeAddress2Col = getColumnId( morkDb, "HomeAddress2" );
-	int HomeCityCol = getColumnId( morkDb, "HomeCity" );
-	int HomeStateCol = getColumnId( morkDb, "HomeState" );
-	int HomeZipCodeCol = getColumnId( morkDb, "HomeZipCode" );
-	int HomeCountryCol = getColumnId( morkDb, "HomeCountry" );
-	int WorkAddressCol = getColumnId( morkDb, "WorkAddress" );
-	int WorkAddress2Col = getColumnId( morkDb, "WorkAddress2" );
-	int WorkCityCol = getColumnId( morkDb, "WorkCity" );
-	int WorkStateCol = getColumnId( morkDb, "WorkState" );
-	int WorkZipCodeCol = getColumnId( morkDb, "WorkZipCode" );
-	int WorkCountryCol = getColumnId( morkDb, "WorkCountry" );
-	int JobTitleCol = getColumnId( morkDb, "JobTitle" );
-	//int DepartmentCol = getColumnId( morkDb, "Department" );
-	int CompanyCol = getColumnId( morkDb, "Company" );
-	int NotesCol = getColumnId( morkDb, "Notes" );
+// What is the minimum content to generate a vCard?
+// I have to do something because I am generating empty vCards!
+int isMorkCellsVcard( morkDb *morkDb, morkCells *cells ) {
+	// If there is only one entry then don't write anything
+	if( cells->cnt <= 1 )	return false;
+	return valueForColumnId( getColumnId( morkDb, "PrimaryEmail" ), cells, morkDb ) ||
+	       valueForColumnId( getColumnId( morkDb, "DisplayName" ), cells, morkDb ) ||
+	       valueForColumnId( getColumnId( morkDb, "FirstName" ), cells, morkDb ) ||
+	       valueForColumnId( getColumnId( morkDb, "LastName" ), cells, morkDb );
+}
+// The uid is written as the vCard UID if it is not NULL
+void writeMorkCellsAsVcard3_0( FILE *ofp, morkDb *morkDb, morkCells *cells, const char *uid ) {
+	morkId LastNameCol = getColumnId( morkDb, "LastName" );
+	morkId FirstNameCol = getColumnId( morkDb, "FirstName" );
+	morkId FNcol = getColumnId( morkDb, "DisplayName" );
+	morkId EMAILcol = getColumnId( morkDb, "PrimaryEmail" );
+	//morkId EMAIL2col = getColumnId( morkDb, "SecondEmail" );
+	morkId WorkPhoneCol = getColumnId( morkDb, "WorkPhone" );
+	morkId FaxNumberCol = getColumnId( morkDb, "FaxNumber" );
+	morkId HomePhoneCol = getColumnId( morkDb, "HomePhone" );
+	morkId PagerNumberCol = getColumnId( morkDb, "PagerNumber" );
+	morkId CellularNumberCol = getColumnId( morkDb, "CellularNumber" );
+	morkId HomeAddressCol = getColumnId( morkDb, "HomeAddress" );
+	morkId HomeAddress2Col = getColumnId( morkDb, "HomeAddress2" );
+	morkId HomeCityCol = getColumnId( morkDb, "HomeCity" );
+	morkId HomeStateCol = getColumnId( morkDb, "HomeState" );
+	morkId HomeZipCodeCol = getColumnId( morkDb, "HomeZipCode" );
+	morkId HomeCountryCol = getColumnId( morkDb, "HomeCountry" );
+	morkId WorkAddressCol = getColumnId( morkDb, "WorkAddress" );
+	morkId WorkAddress2Col = getColumnId( morkDb, "WorkAddress2" );
+	morkId WorkCityCol = getColumnId( morkDb, "WorkCity" );
+	morkId WorkStateCol = getColumnId( morkDb, "WorkState" );
+	morkId WorkZipCodeCol = getColumnId( morkDb, "WorkZipCode" );
+	morkId WorkCountryCol = getColumnId( morkDb, "WorkCountry" );
+	morkId JobTitleCol = getColumnId( morkDb, "JobTitle" );
+	//morkId DepartmentCol = getColumnId( morkDb, "Department" );
+	morkId CompanyCol = getColumnId( morkDb, "Company" );
+	morkId NotesCol = getColumnId( morkDb, "Notes" );
 #define	ESCBUFSIZE	1024
 	char	escBuf[ESCBUFSIZE];
-	char	*email;
-	char	*formattedName;
 	char	*firstName;
 	char	*lastName;
 	char	*value;
 	char	*value1, *value2, *value3, *value4, *value5;
 
-	// If there is only one entry then don't write anything
-	if( cells->cnt <= 1 )	return;
-
-	// What is the minimum content to generate a vCard?
-	// I have to do something because I am generating empty vCards!
-	email = valueForColumnId( EMAILcol, cells, morkDb );
-	formattedName = valueForColumnId( FNcol, cells, morkDb );
+	if( !isMorkCellsVcard( morkDb, cells ) )	return;
 	firstName = valueForColumnId( FirstNameCol, cells, morkDb );
 	lastName = valueForColumnId( LastNameCol, cells, morkDb );
-	if( !email && !formattedName && !firstName && !lastName )
-		return;
 
 	fprintf( ofp, "BEGIN:VCARD\n" );
 	fprintf( ofp, "VERSION:3.0\n" );
+	if( uid ) fprintf( ofp, "UID:%s\n", uid );
 	//N:Gump;Forrest
 	// name parts:
 	//	; Family, Given, Middle, Prefix, Suffix.
@@ -997,33 +950,33 @@ void writeMorkCellsAsVcard3_0( FILE *ofp, morkDb *morkDb, morkCells *cells ) {
 	//REV:20080424T195243Z
 	fprintf( ofp, "END:VCARD\n" );
 }
-void writeMorkCellsAsVcard2_1( FILE *ofp, morkDb *morkDb, morkCells *cells ) {
-	int LastNameCol = getColumnId( morkDb, "LastName" );
-	int FirstNameCol = getColumnId( morkDb, "FirstName" );
-	int FNcol = getColumnId( morkDb, "DisplayName" );
-	int EMAILcol = getColumnId( morkDb, "PrimaryEmail" );
-	//int EMAIL2col = getColumnId( morkDb, "SecondEmail" );
-	int WorkPhoneCol = getColumnId( morkDb, "WorkPhone" );
-	int FaxNumberCol = getColumnId( morkDb, "FaxNumber" );
-	int HomePhoneCol = getColumnId( morkDb, "HomePhone" );
-	int PagerNumberCol = getColumnId( morkDb, "PagerNumber" );
-	int CellularNumberCol = getColumnId( morkDb, "CellularNumber" );
-	int HomeAddressCol = getColumnId( morkDb, "HomeAddress" );
-	int HomeAddress2Col = getColumnId( morkDb, "HomeAddress2" );
-	int HomeCityCol = getColumnId( morkDb, "HomeCity" );
-	int HomeStateCol = getColumnId( morkDb, "HomeState" );
-	int HomeZipCodeCol = getColumnId( morkDb, "HomeZipCode" );
-	int HomeCountryCol = getColumnId( morkDb, "HomeCountry" );
-	int WorkAddressCol = getColumnId( morkDb, "WorkAddress" );
-	int WorkAddress2Col = getColumnId( morkDb, "WorkAddress2" );
-	int WorkCityCol = getColumnId( morkDb, "WorkCity" );
-	int WorkStateCol = getColumnId( morkDb, "WorkState" );
-	int WorkZipCodeCol = getColumnId( morkDb, "WorkZipCode" );
-	int WorkCountryCol = getColumnId( morkDb, "WorkCountry" );
-	int JobTitleCol = getColumnId( morkDb, "JobTitle" );
-	//int DepartmentCol = getColumnId( morkDb, "Department" );
-	int CompanyCol = getColumnId( morkDb, "Company" );
-	int NotesCol = getColumnId( morkDb, "Notes" );
+void writeMorkCellsAsVcard2_1( FILE *outfp, morkDb *morkDb, morkCells *cells ) {
+	morkId LastNameCol = getColumnId( morkDb, "LastName" );
+	morkId FirstNameCol = getColumnId( morkDb, "FirstName" );
+	morkId FNcol = getColumnId( morkDb, "DisplayName" );
+	morkId EMAILcol = getColumnId( morkDb, "PrimaryEmail" );
+	//morkId EMAIL2col = getColumnId( morkDb, "SecondEmail" );
+	morkId WorkPhoneCol = getColumnId( morkDb, "WorkPhone" );
+	morkId FaxNumberCol = getColumnId( morkDb, "FaxNumber" );
+	morkId HomePhoneCol = getColumnId( morkDb, "HomePhone" );
+	morkId PagerNumberCol = getColumnId( morkDb, "PagerNumber" );
+	morkId CellularNumberCol = getColumnId( morkDb, "CellularNumber" );
+	morkId HomeAddressCol = getColumnId( morkDb, "HomeAddress" );
+	morkId HomeAddress2Col = getColumnId( morkDb, "HomeAddress2" );
+	morkId HomeCityCol = getColumnId( morkDb, "HomeCity" );
+	morkId HomeStateCol = getColumnId( morkDb, "HomeState" );
+	morkId HomeZipCodeCol = getColumnId( morkDb, "HomeZipCode" );
+	morkId HomeCountryCol = getColumnId( morkDb, "HomeCountry" );
+	morkId WorkAddressCol = getColumnId( morkDb, "WorkAddress" );
+	morkId WorkAddress2Col = getColumnId( morkDb, "WorkAddress2" );
+	morkId WorkCityCol = getColumnId( morkDb, "WorkCity" );
+	morkId WorkStateCol = getColumnId( morkDb, "WorkState" );
+	morkId WorkZipCodeCol = getColumnId( morkDb, "WorkZipCode" );
+	morkId WorkCountryCol = getColumnId( morkDb, "WorkCountry" );
+	morkId JobTitleCol = getColumnId( morkDb, "JobTitle" );
+	//morkId DepartmentCol = getColumnId( morkDb, "Department" );
+	morkId CompanyCol = getColumnId( morkDb, "Company" );
+	morkId NotesCol = getColumnId( morkDb, "Notes" );
 #define	ESCBUFSIZE	1024
 	char	escBuf[ESCBUFSIZE];
 	char	*email;
@@ -1032,6 +985,9 @@ void writeMorkCellsAsVcard2_1( FILE *ofp, morkDb *morkDb, morkCells *cells ) {
 	char	*lastName;
 	char	*value;
 	char	*value1, *value2, *value3, *value4, *value5;
+	char	*card;
+	size_t	cardLen;
+	FILE	*ofp;
 
 	// If there is only one entry then don't write anything
 	if( cells->cnt <= 1 )	return;
@@ -1045,6 +1001,14 @@ void writeMorkCellsAsVcard2_1( FILE *ofp, morkDb *morkDb, morkCells *cells ) {
 	if( !email && !formattedName && !firstName && !lastName )
 		return;
 
+	// The card is put together in memory so the lines that are not
+	// ASCII can be given their charset and encoding on the way out
+	ofp = open_memstream( &card, &cardLen );
+	if( !ofp ) {
+		morkErr( "***** error: unable to allocate vCard buffer\n" );
+		return;
+	}
+
 	fprintf( ofp, "BEGIN:VCARD\n" );
 	fprintf( ofp, "VERSION:2.1\n" );
 	//N:Gump;Forrest
@@ -1082,7 +1046,7 @@ void writeMorkCellsAsVcard2_1( FILE *ofp, morkDb *morkDb, morkCells *cells ) {
 	value4 = valueForColumnId( WorkZipCodeCol, cells, morkDb );
 	value5 = valueForColumnId( WorkCountryCol, cells, morkDb );
 	if( value1 || value2 || value3 || value4 || value5 ) {
-		fprintf( ofp, "ADR:WORK:;" );
+		fprintf( ofp, "ADR;WORK:;" );
 		vCardLine( WorkAddress2Col, "%s" );
 		fprintf( ofp, ";" );
 		if( value1 ) fprintf( ofp, "%s", vCardEscapeString( escBuf,
@@ -1109,7 +1073,7 @@ void writeMorkCellsAsVcard2_1( FILE *ofp, morkDb *morkDb, morkCells *cells ) {
 	value4 = valueForColumnId( HomeZipCodeCol, cells, morkDb );
 	value5 = valueForColumnId( HomeCountryCol, cells, morkDb );
 	if( value1 || value2 || value3 || value4 || value5 ) {
-		fprintf( ofp, "ADR:HOME:;" );
+		fprintf( ofp, "ADR;HOME:;" );
 		vCardLine( HomeAddress2Col, "%s" );
 		fprintf( ofp, ";" );
 		if( value1 ) fprintf( ofp, "%s", vCardEscapeString( escBuf,
@@ -1134,13 +1098,16 @@ void writeMorkCellsAsVcard2_1( FILE *ofp, morkDb *morkDb, morkCells *cells ) {
 	vCardLine( NotesCol, "NOTE:%s\n" );
 	//REV:20080424T195243Z
 	fprintf( ofp, "END:VCARD\n" );
+	fclose( ofp );
+	vCardWrite2_1( outfp, card, cardLen );
+	free( card );
 }
 void dumpMorkCells( FILE *ofp, morkDb *morkDb, morkCells *cells ) {
 	int i;
 	fprintf( ofp, "               Mork cells with %d entries\n",
 		cells->cnt );
 	for( i = 0; i < cells->cnt; ++i ) {
-		dumpMorkCellEntry( ofp, morkDb, *(cells->entries[i]) );
+		dumpMorkCellEntry( ofp, morkDb, cells, i );
 	}
 }
 morkCells *makeMorkCells() {
@@ -1148,49 +1115,104 @@ morkCells *makeMorkCells() {
 	return mc;
 }
 void freeMorkCells( morkCells *cells ) {
-	if( cells->entries ) {
-		int i;
-		for( i = 0; i < cells->cnt; ++i ) {
-			freeMorkCellEntry( cells->entries[i] );
-			cells->entries[i] = NULL;
-		}
-		free( cells->entries );
-	}
+	free( cells->dense );
+	cells->dense = NULL;
+	free( cells->resolved );
+	cells->resolved = NULL;
+	free( cells->entries );
 	cells->entries = NULL;
-	cells->cnt = 0;
+	cells->cnt = cells->size = 0;
 }
-void storeInMorkCell( morkCells *cells, int key, int value ) {
-	int i, j;
-	morkLog( "     Setting cell with key %3d/%2X to %d/%X\n", key, key, value, value );
-	for( i = 0; i < cells->cnt; ++i ) {
-		if( key <= cells->entries[i]->key ) {
-			break;
+// Sorts the cells of a bulk loaded row by column, the last value given
+// for a column wins. Short rows are insertion sorted, longer ones
+// merge sorted, both keep the cells of a column in the order they came.
+void sortMorkBulkCells( morkCells *cells ) {
+	morkCellEntry	*e = cells->entries;
+	morkCellEntry	*tmp = (morkCellEntry *) 0;
+	int		cnt = cells->cnt;
+	int		i, j, n;
+
+	for( i = 1; i < cnt && e[i-1].key < e[i].key; ++i )
+		;
+	if( i >= cnt )	return;
+	if( cnt > MORKSORTCELLS )	tmp = malloc( cnt * sizeof(*tmp) );
+	if( !tmp ) {
+		for( ; i < cnt; ++i ) {
+			morkCellEntry x = e[i];
+			for( j = i; j > 0 && e[j-1].key > x.key; --j )
+				e[j] = e[j-1];
+			e[j] = x;
 		}
-	}
-	//morkLog( "   This will be at position %d of %d in the dictionary\n",
-	//	i, cells->cnt );
-	if( i >= cells->cnt || key != cells->entries[i]->key ) {
-		++cells->cnt;
-		cells->entries = realloc( cells->entries, cells->cnt * sizeof(*(cells->entries)) );
-		for( j = cells->cnt - 1; j > i; --j ) {
-			cells->entries[j] = cells->entries[j-1];
+	} else {
+		int width, lo;
+		for( width = 1; width < cnt; width *= 2 ) {
+			for( lo = 0; lo < cnt; lo += 2 * width ) {
+				int mid = lo + width < cnt ? lo + width : cnt;
+				int hi = lo + 2 * width < cnt ? lo + 2 * width : cnt;
+				int a = lo, b = mid, k = lo;
+				while( a < mid && b < hi )
+					tmp[k++] = e[b].key < e[a].key ? e[b++] : e[a++];
+				while( a < mid )	tmp[k++] = e[a++];
+				while( b < hi )		tmp[k++] = e[b++];
+			}
+			memcpy( e, tmp, cnt * sizeof(*e) );
 		}
-	} else if( cells->entries[i]->value != value ) {
-		morkLog( "     - Changing cell %3d/%2X from %d/%X to %d/%X\n",
-			key, key, cells->entries[i]->value,
-			cells->entries[i]->value, value, value );
+		free( tmp );
 	}
-	//morkLog( "   Putting the entry at %d with the size now %d\n",
-	//	i, cells->cnt );
-	cells->entries[i] = makeMorkCellEntry( key, value );
+	for( n = 1, i = 1; i < cnt; ++i ) {
+		if( e[n-1].key == e[i].key )	e[n-1] = e[i];
+		else				e[n++] = e[i];
+	}
+	cells->cnt = n;
+}
+// Give back the unused room at the end of a row that is complete
+void trimMorkCells( morkCells *cells ) {
+	if( !cells || cells->size <= cells->cnt )	return;
+	cells->size = cells->cnt;
+	cells->entries = realloc( cells->entries, cells->size * sizeof(*(cells->entries)) );
 }
+// Position of the key in a map's sorted keys or where it belongs.
+// Keys following on from the last one (the message keys of an .msf
+// file) are added at the end without a search. As the keys differ a
+// key's position is at most its distance from the first key and at
+// least the count less its distance from the last, so only a window
+// as wide as the map's gaps is searched. A map whose keys have no gaps
+// at all needs no search.
+static int findMorkKey( const morkId *keys, int cnt, morkId key ) {
+	morkId	first, last;
+	int	lo, hi;
+	if( !cnt || key > keys[cnt-1] )		return cnt;
+	if( key <= keys[0] )			return 0;
+	first = key - keys[0];
+	last = keys[cnt-1] - key;
+	lo = last < cnt - 1 ? cnt - 1 - (int) last : 0;
+	hi = first < cnt - 1 ? (int) first : cnt - 1;
+	while( lo < hi ) {
+		int mid = lo + (hi - lo) / 2;
+		if( keys[mid] < key )	lo = mid + 1;
+		else			hi = mid;
+	}
+	return lo;
+}
+// Opens a gap at i in a map's keys and entries. The arrays grow
+// geometrically so adding n rows costs O(n) and not O(n^2).
+#define	insertMorkMapEntry(map,i)	do { \
+	if( (map)->cnt >= (map)->size ) { \
+		(map)->size = (map)->size ? (map)->size * 2 : 4; \
+		(map)->keys = realloc( (map)->keys, (map)->size * sizeof(*((map)->keys)) ); \
+		(map)->entries = realloc( (map)->entries, (map)->size * sizeof(*((map)->entries)) ); \
+	} \
+	memmove( (map)->keys + (i) + 1, (map)->keys + (i), ((map)->cnt - (i)) * sizeof(*((map)->keys)) ); \
+	memmove( (map)->entries + (i) + 1, (map)->entries + (i), ((map)->cnt - (i)) * sizeof(*((map)->entries)) ); \
+	++(map)->cnt; \
+} while( 0 )
 // morkRowMap functions
 void dumpMorkRowMap( FILE *ofp, morkDb *mork, morkRowMap *morkRowMap ) {
 	int i;
 	fprintf( ofp, "               Mork row map with %d entries\n",
 		morkRowMap->cnt );
 	for( i = 0; i < morkRowMap->cnt; ++i ) {
-		fprintf( ofp, "               Row %3d:\n", morkRowMap->keys[i]);
+		fprintf( ofp, "               Row %3lld:\n", morkRowMap->keys[i]);
 		dumpMorkCells( ofp, mork, morkRowMap->entries[i] );
 		fflush( ofp );
 		writeMorkCellsAsVcard2_1( ofp, mork, morkRowMap->entries[i] );
@@ -1201,6 +1223,7 @@ void freeMorkRowMap( morkRowMap *morkRowMap ) {
 		int i;
 		for( i = 0; i < morkRowMap->cnt; ++i ) {
 			freeMorkCells( morkRowMap->entries[i] );
+			free( morkRowMap->entries[i] );
 			morkRowMap->entries[i] = NULL;
 		}
 		free( morkRowMap->entries );
@@ -1208,12 +1231,12 @@ void freeMorkRowMap( morkRowMap *morkRowMap ) {
 	}
 	morkRowMap->entries = NULL;
 	morkRowMap->keys = NULL;
-	morkRowMap->cnt = 0;
+	morkRowMap->cnt = morkRowMap->size = 0;
 }
 void dumpMorkRowMapVcards( FILE *ofp, morkDb *mork, morkRowMap *morkRowMap ) {
 	int i;
 	for( i = 0; i < morkRowMap->cnt; ++i ) {
-		writeMorkCellsAsVcard3_0( ofp, mork, morkRowMap->entries[i] );
+		writeMorkCellsAsVcard3_0( ofp, mork, morkRowMap->entries[i], NULL );
 	}
 }
 morkRowMap *makeMorkRowMap() {
@@ -1222,35 +1245,32 @@ morkRowMap *makeMorkRowMap() {
 }
 // Gets the Mork Cells Entry for the rowId from the morkRowMap
 // (will create an empty one if it does not exist).
-morkCells *getMorkCells( morkRowMap *morkRowMap, int rowId ) {
-	int	i, j;
-	for( i = 0; i < morkRowMap->cnt; ++i ) {
-		if( rowId <= morkRowMap->keys[i] ) {
-			break;
-		}
-	}
+morkCells *getMorkCells( morkRowMap *morkRowMap, morkId rowId ) {
+	int	i = findMorkKey( morkRowMap->keys, morkRowMap->cnt, rowId );
 	if( i >= morkRowMap->cnt || rowId != morkRowMap->keys[i] ) {
-		++morkRowMap->cnt;
-		morkRowMap->entries = realloc( morkRowMap->entries,
-			morkRowMap->cnt * sizeof(*(morkRowMap->entries)) );
-		morkRowMap->keys = realloc( morkRowMap->keys,
-			morkRowMap->cnt * sizeof(*(morkRowMap->keys)) );
-		for( j = morkRowMap->cnt - 1; j > i; --j ) {
-			morkRowMap->entries[j] = morkRowMap->entries[j-1];
-			morkRowMap->keys[j] = morkRowMap->keys[j-1];
-		}
+		insertMorkMapEntry( morkRowMap, i );
 		morkRowMap->entries[i] = makeMorkCells();
 		morkRowMap->keys[i] = rowId;
 	}
 	return morkRowMap->entries[i];
 }
+// The row's cells for a bulk load, a row that is not the last one
+// added is added again and the two are merged by finishMorkBulkLoad()
+morkCells *appendMorkCells( morkRowMap *morkRowMap, morkId rowId ) {
+	int	i = morkRowMap->cnt;
+	if( i && rowId == morkRowMap->keys[i-1] )	return morkRowMap->entries[i-1];
+	insertMorkMapEntry( morkRowMap, i );
+	morkRowMap->entries[i] = makeMorkCells();
+	morkRowMap->keys[i] = rowId;
+	return morkRowMap->entries[i];
+}
 // rowScopeMap functions
 void dumpRowScopeMap( FILE *ofp, morkDb *mork, rowScopeMap *rowScopeMap ) {
 	int i;
 	fprintf( ofp, "          Row scope map with %d entries\n",
 		rowScopeMap->cnt );
 	for( i = 0; i < rowScopeMap->cnt; ++i ) {
-		fprintf( ofp, "          Row scope %3d:\n",
+		fprintf( ofp, "          Row scope %3lld:\n",
 			rowScopeMap->keys[i] );
 		dumpMorkRowMap( ofp, mork, rowScopeMap->entries[i] );
 	}
@@ -1270,6 +1290,7 @@ void freeRowScopeMap( rowScopeMap *rowScopeMap ) {
 		int i;
 		for( i = 0; i < rowScopeMap->cnt; ++i ) {
 			freeMorkRowMap( rowScopeMap->entries[i] );
+			free( rowScopeMap->entries[i] );
 			rowScopeMap->entries[i] = NULL;
 		}
 		free( rowScopeMap->entries );
@@ -1277,27 +1298,14 @@ void freeRowScopeMap( rowScopeMap *rowScopeMap ) {
 	}
 	rowScopeMap->entries = NULL;
 	rowScopeMap->keys = NULL;
-	rowScopeMap->cnt = 0;
+	rowScopeMap->cnt = rowScopeMap->size = 0;
 }
 // Gets the Mork Row Map Entry for the rowScope from the rowScopeMap
 // (will create an empty one if it does not exist).
-morkRowMap *getMorkRowMap( rowScopeMap *rowScopeMap, int rowScope ) {
-	int	i, j;
-	for( i = 0; i < rowScopeMap->cnt; ++i ) {
-		if( rowScope <= rowScopeMap->keys[i] ) {
-			break;
-		}
-	}
+morkRowMap *getMorkRowMap( rowScopeMap *rowScopeMap, morkId rowScope ) {
+	int	i = findMorkKey( rowScopeMap->keys, rowScopeMap->cnt, rowScope );
 	if( i >= rowScopeMap->cnt || rowScope != rowScopeMap->keys[i] ) {
-		++rowScopeMap->cnt;
-		rowScopeMap->entries = realloc( rowScopeMap->entries,
-			rowScopeMap->cnt * sizeof(*(rowScopeMap->entries)) );
-		rowScopeMap->keys = realloc( rowScopeMap->keys,
-			rowScopeMap->cnt * sizeof(*(rowScopeMap->keys)) );
-		for( j = rowScopeMap->cnt - 1; j > i; --j ) {
-			rowScopeMap->entries[j] = rowScopeMap->entries[j-1];
-			rowScopeMap->keys[j] = rowScopeMap->keys[j-1];
-		}
+		insertMorkMapEntry( rowScopeMap, i );
 		rowScopeMap->entries[i] = makeMorkRowMap();
 		rowScopeMap->keys[i] = rowScope;
 	}
@@ -1309,7 +1317,7 @@ void dumpMorkTableMap( FILE *ofp, morkDb *mork, morkTableMap *morkTableMap ) {
 	fprintf( ofp, "     Mork table map with %d entries\n",
 		morkTableMap->cnt );
 	for( i = 0; i < morkTableMap->cnt; ++i ) {
-		fprintf( ofp, "     Table %3d:\n", morkTableMap->keys[i] );
+		fprintf( ofp, "     Table %3lld:\n", morkTableMap->keys[i] );
 		dumpRowScopeMap( ofp, mork, morkTableMap->entries[i] );
 	}
 }
@@ -1328,6 +1336,7 @@ void freeMorkTableMap( morkTableMap *morkTableMap ) {
 	if( morkTableMap && morkTableMap->entries ) {
 		for( i = 0; i < morkTableMap->cnt; ++i ) {
 			freeRowScopeMap( morkTableMap->entries[i] );
+			free( morkTableMap->entries[i] );
 			morkTableMap->entries[i] = NULL;
 		}
 		free( morkTableMap->entries );
@@ -1335,27 +1344,14 @@ void freeMorkTableMap( morkTableMap *morkTableMap ) {
 	}
 	morkTableMap->entries = NULL;
 	morkTableMap->keys = NULL;
-	morkTableMap->cnt = 0;
+	morkTableMap->cnt = morkTableMap->size = 0;
 }
 // Gets the Row Scope Map Entry for the tableID from the morkTableMap
 // (will create an empty one if it does not exist).
-rowScopeMap *getRowScopeMapEntry( morkDb *m, morkTableMap *morkTableMap, int tableId ) {
-	int	i, j;
-	for( i = 0; i < morkTableMap->cnt; ++i ) {
-		if( tableId <= morkTableMap->keys[i] ) {
-			break;
-		}
-	}
+rowScopeMap *getRowScopeMapEntry( morkDb *m, morkTableMap *morkTableMap, morkId tableId ) {
+	int	i = findMorkKey( morkTableMap->keys, morkTableMap->cnt, tableId );
 	if( i >= morkTableMap->cnt || tableId != morkTableMap->keys[i] ) {
-		++morkTableMap->cnt;
-		morkTableMap->entries = realloc( morkTableMap->entries,
-			morkTableMap->cnt * sizeof(*(morkTableMap->entries)) );
-		morkTableMap->keys = realloc( morkTableMap->keys,
-			morkTableMap->cnt * sizeof(*(morkTableMap->keys)) );
-		for( j = morkTableMap->cnt - 1; j > i; --j ) {
-			morkTableMap->entries[j] = morkTableMap->entries[j-1];
-			morkTableMap->keys[j] = morkTableMap->keys[j-1];
-		}
+		insertMorkMapEntry( morkTableMap, i );
 		morkTableMap->entries[i] = makeRowScopeMap();
 		morkTableMap->keys[i] = tableId;
 	}
@@ -1366,7 +1362,7 @@ void dumpTableScopeMap( FILE *ofp, morkDb *mork ) {
 	int i;
 	fprintf( ofp, "Table scope map with %d entries\n", mork->cnt );
 	for( i = 0; i < mork->cnt; ++i ) {
-		fprintf( ofp, "Table scope %3d:\n", mork->keys[i] );
+		fprintf( ofp, "Table scope %3lld:\n", mork->keys[i] );
 		dumpMorkTableMap( ofp, mork, mork->entries[i] );
 	}
 }
@@ -1376,35 +1372,289 @@ void dumpVcards( FILE *ofp, morkDb *mork ) {
 		dumpMorkTableMapVcards( ofp, mork, mork->entries[i] );
 	}
 }
+
+// Incremental vCard export
+//
+// The hash file has a line for each row that was written as a vCard
+// with the row's keys and a hash of its column names and values. The
+// rows are walked in key order and the hash file is written in that
+// same order so the old and new hashes are compared with a merge.
+#define	MorkHashFileHeader	"# mork vCard hashes 1"
+
+// A row's keys and content hash
+typedef struct {
+	morkId			tableScope;
+	morkId			tableId;
+	morkId			rowScope;
+	morkId			rowId;
+	unsigned long long	hash;
+} morkRowHash;
+
+static unsigned long long fnvMorkHash( unsigned long long h, const char *s ) {
+	while( *s ) {
+		h ^= (unsigned char) *s++;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+// Hash of the column names and values. Each cell is hashed on
+// its own and the hashes added so that the result does not depend
+// on the column ids or the order of the cells.
+unsigned long long hashMorkCells( morkDb *mork, morkCells *cells ) {
+	unsigned long long total = 0;
+	int i;
+	for( i = 0; i < cells->cnt; ++i ) {
+		unsigned long long h = 14695981039346656037ULL;
+		h = fnvMorkHash( h, getMorkCellColumn( mork, cells, i ) );
+		h ^= 0xff;
+		h *= 1099511628211ULL;
+		h = fnvMorkHash( h, getMorkCellValue( mork, cells, i ) );
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		total += h;
+	}
+	return total;
+}
+static int compareMorkRowHash( const morkRowHash *a, const morkRowHash *b ) {
+	if( a->tableScope != b->tableScope )
+		return a->tableScope < b->tableScope ? -1 : 1;
+	if( a->tableId != b->tableId )
+		return a->tableId < b->tableId ? -1 : 1;
+	if( a->rowScope != b->rowScope )
+		return a->rowScope < b->rowScope ? -1 : 1;
+	if( a->rowId != b->rowId )
+		return a->rowId < b->rowId ? -1 : 1;
+	return 0;
+}
+static bool readMorkRowHash( FILE *fp, morkRowHash *rh ) {
+	return fp && fscanf( fp, "%lld %lld %lld %lld %llx", &rh->tableScope,
+		&rh->tableId, &rh->rowScope, &rh->rowId, &rh->hash ) == 5;
+}
+static void formatMorkUid( char *buf, const morkRowHash *rh ) {
+	sprintf( buf, "mork:%lld:%lld:%lld:%lld", rh->tableScope, rh->tableId,
+		rh->rowScope, rh->rowId );
+}
+// Writes the vCards of the rows that are new or changed since the
+// hash file was written, writes the UIDs of the rows that are gone
+// to deletedfp (if not NULL) and updates the hash file. Every vCard
+// gets a UID made from its row's keys. Returns the number of vCards
+// written or -1 if the hash file could not be written.
+int dumpVcardsIncremental( FILE *ofp, FILE *deletedfp, morkDb *mork, const char *hashFileName ) {
+	char		uid[96];
+	char		*newFileName;
+	FILE		*oldfp, *newfp;
+	morkRowHash	old, cur;
+	bool		haveOld;
+	int		written = 0;
+	int		i, j, k, l;
+
+	newFileName = malloc( strlen( hashFileName ) + 5 );
+	sprintf( newFileName, "%s.new", hashFileName );
+	newfp = fopen( newFileName, "w" );
+	if( !newfp ) {
+		morkErr( "error: unable to write file \"%s\"\n", newFileName );
+		free( newFileName );
+		return -1;
+	}
+	fprintf( newfp, "%s\n", MorkHashFileHeader );
+
+	// A missing hash file just means everything is new
+	oldfp = fopen( hashFileName, "r" );
+	if( oldfp ) {
+		char header[64];
+		if( !fgets( header, sizeof(header), oldfp ) ||
+		    strncmp( header, MorkHashFileHeader, strlen( MorkHashFileHeader ) ) != 0 ) {
+			morkErr( "error: \"%s\" is not a mork hash file, "
+				 "writing all vCards\n", hashFileName );
+			fclose( oldfp );
+			oldfp = NULL;
+		}
+	}
+	haveOld = readMorkRowHash( oldfp, &old );
+
+	for( i = 0; i < mork->cnt; ++i ) {
+		morkTableMap *tableMap = mork->entries[i];
+		cur.tableScope = mork->keys[i];
+		for( j = 0; j < tableMap->cnt; ++j ) {
+			rowScopeMap *scopeMap = tableMap->entries[j];
+			cur.tableId = tableMap->keys[j];
+			for( k = 0; k < scopeMap->cnt; ++k ) {
+				morkRowMap *rowMap = scopeMap->entries[k];
+				cur.rowScope = scopeMap->keys[k];
+				for( l = 0; l < rowMap->cnt; ++l ) {
+					morkCells *cells = rowMap->entries[l];
+					bool changed = true;
+					cur.rowId = rowMap->keys[l];
+					if( !isMorkCellsVcard( mork, cells ) )
+						continue;
+					cur.hash = hashMorkCells( mork, cells );
+
+					// Anything before this row is gone
+					while( haveOld && compareMorkRowHash( &old, &cur ) < 0 ) {
+						formatMorkUid( uid, &old );
+						if( deletedfp ) fprintf( deletedfp, "%s\n", uid );
+						haveOld = readMorkRowHash( oldfp, &old );
+					}
+					if( haveOld && compareMorkRowHash( &old, &cur ) == 0 ) {
+						changed = old.hash != cur.hash;
+						haveOld = readMorkRowHash( oldfp, &old );
+					}
+					if( changed ) {
+						formatMorkUid( uid, &cur );
+						writeMorkCellsAsVcard3_0( ofp, mork, cells, uid );
+						++written;
+					}
+					fprintf( newfp, "%lld %lld %lld %lld %016llx\n",
+						cur.tableScope, cur.tableId,
+						cur.rowScope, cur.rowId, cur.hash );
+				}
+			}
+		}
+	}
+	while( haveOld ) {
+		formatMorkUid( uid, &old );
+		if( deletedfp ) fprintf( deletedfp, "%s\n", uid );
+		haveOld = readMorkRowHash( oldfp, &old );
+	}
+
+	if( oldfp )	fclose( oldfp );
+	if( fclose( newfp ) != 0 || rename( newFileName, hashFileName ) != 0 ) {
+		morkErr( "error: unable to replace file \"%s\"\n", hashFileName );
+		written = -1;
+	}
+	free( newFileName );
+	return written;
+}
 void initializeTableScopeMap( morkDb *mork ) {
-	mork->cnt = 0;
-	mork->keys = (int *) 0;
+	mork->cnt = mork->size = 0;
+	mork->keys = (morkId *) 0;
 	mork->nowParsing = NPValues;
-	mork->nextAddValueId = 0x7fffffff;
-	mork->defaultScope = 0x80;
+	mork->nextAddValueId = MORKLITERALIDBASE;
+	mork->defaultScope = MORKDEFAULTSCOPE;
+	mork->slots = (morkSlotMap *) 0;
+	mork->resolved = 0;
+	mork->bulk = 0;
 	mork->entries = (morkTableMap **) 0;
 	mork->columns = (morkDict *) calloc( 1, sizeof(*mork->columns) );
 	mork->values = (morkDict *) calloc( 1, sizeof(*mork->values) );
 }
 // Gets the Mork Table Map Entry for the tableScope from the morkDb
 // (will create an empty one if it does not exist).
-morkTableMap *getMorkTableMapEntry( morkDb *mork, int tableScope ) {
-	int	i, j;
-	for( i = 0; i < mork->cnt; ++i ) {
-		if( tableScope <= mork->keys[i] ) {
-			break;
-		}
-	}
+morkTableMap *getMorkTableMapEntry( morkDb *mork, morkId tableScope ) {
+	int	i = findMorkKey( mork->keys, mork->cnt, tableScope );
 	if( i >= mork->cnt || tableScope != mork->keys[i] ) {
-		++mork->cnt;
-		mork->entries = realloc( mork->entries, mork->cnt * sizeof(*(mork->entries)) );
-		mork->keys = realloc( mork->keys, mork->cnt * sizeof(*(mork->keys)) );
-		for( j = mork->cnt - 1; j > i; --j ) {
-			mork->entries[j] = mork->entries[j-1];
-			mork->keys[j] = mork->keys[j-1];
-		}
+		insertMorkMapEntry( mork, i );
 		mork->entries[i] = makeMorkTableMap();
 		mork->keys[i] = tableScope;
 	}
 	return mork->entries[i];
 }
+
+// Bulk loading
+//
+// A bulk load appends dictionary entries and rows as they come and
+// puts them in order once at the end. Most arrive in order already
+// and only the arrays that did not are sorted.
+
+// Key and position of a bulk loaded entry, sorting on both keeps the
+// entries given more than once in the order they came
+typedef struct {
+	morkId	key;
+	int	seq;
+} morkBulkKey;
+static int compareMorkBulkKeys( const void *a, const void *b ) {
+	const morkBulkKey *x = a, *y = b;
+	if( x->key != y->key )	return x->key < y->key ? -1 : 1;
+	return x->seq - y->seq;
+}
+// Sorts a dictionary, the last value given for a key wins. Returns the
+// number of entries given a new value.
+static int sortMorkBulkDict( morkDict *dict ) {
+	morkBulkKey	*order;
+	morkDictEntry	*entries;
+	int		i, n, changes = 0;
+
+	dict->unsorted = 0;
+	for( i = 1; i < dict->cnt; ++i )
+		if( dict->entries[i-1].key >= dict->entries[i].key )	break;
+	if( i >= dict->cnt )	return 0;
+	order = malloc( dict->cnt * sizeof(*order) );
+	entries = malloc( dict->size * sizeof(*entries) );
+	for( i = 0; i < dict->cnt; ++i ) {
+		order[i].key = dict->entries[i].key;
+		order[i].seq = i;
+	}
+	qsort( order, dict->cnt, sizeof(*order), compareMorkBulkKeys );
+	for( n = 0, i = 0; i < dict->cnt; ++i ) {
+		morkDictEntry *e = &dict->entries[order[i].seq];
+		if( n && entries[n-1].key == e->key ) {
+			entries[n-1] = *e;
+			changes++;
+		} else {
+			entries[n++] = *e;
+		}
+	}
+	free( order );
+	free( dict->entries );
+	dict->entries = entries;
+	dict->cnt = n;
+	return changes;
+}
+// Sorts a row map, a row given more than once gets the cells of each
+// time applied in the order they came
+static void sortMorkBulkRowMap( morkRowMap *map ) {
+	morkBulkKey	*order;
+	morkId		*keys;
+	morkCells	**entries;
+	int		i, j, n;
+
+	for( i = 1; i < map->cnt; ++i )
+		if( map->keys[i-1] >= map->keys[i] )	break;
+	if( i >= map->cnt )	return;
+	order = malloc( map->cnt * sizeof(*order) );
+	keys = malloc( map->size * sizeof(*keys) );
+	entries = malloc( map->size * sizeof(*entries) );
+	for( i = 0; i < map->cnt; ++i ) {
+		order[i].key = map->keys[i];
+		order[i].seq = i;
+	}
+	qsort( order, map->cnt, sizeof(*order), compareMorkBulkKeys );
+	for( n = 0, i = 0; i < map->cnt; ++i ) {
+		morkCells *cells = map->entries[order[i].seq];
+		if( n && keys[n-1] == order[i].key ) {
+			for( j = 0; j < cells->cnt; ++j ) {
+				storeInMorkCell( entries[n-1], cells->entries[j].key,
+					cells->entries[j].value );
+			}
+			trimMorkCells( entries[n-1] );
+			freeMorkCells( cells );
+			free( cells );
+		} else {
+			keys[n] = order[i].key;
+			entries[n++] = cells;
+		}
+	}
+	free( order );
+	free( map->keys );
+	free( map->entries );
+	map->keys = keys;
+	map->entries = entries;
+	map->cnt = n;
+}
+// Puts everything a bulk load added in order and ends the bulk load
+static void finishMorkBulkLoad( morkDb *mork ) {
+	int i, j, k;
+	mork->dictChanges += sortMorkBulkDict( mork->columns );
+	mork->dictChanges += sortMorkBulkDict( mork->values );
+	for( i = 0; i < mork->cnt; ++i ) {
+		morkTableMap *tableMap = mork->entries[i];
+		for( j = 0; j < tableMap->cnt; ++j ) {
+			rowScopeMap *scopeMap = tableMap->entries[j];
+			for( k = 0; k < scopeMap->cnt; ++k )
+				sortMorkBulkRowMap( scopeMap->entries[k] );
+		}
+	}
+	mork->activeCells = (morkCells *) 0;
+	mork->bulk = 0;
+}
@@ -2,6 +2,8 @@
  *    ParseMork.h - Parser for Thunderbird address books (abook.mab) files
  *
  *    Will load an abook.mab file and report any errors it encounters.
+ *    Mail folder summary (.msf) files are in the same format and load
+ *    the same way, with their millions of message rows.
  *
  *    If the 'morkLogfp' file pointer is set it will log what it is doing
  *    so when an error is encountered it can be sorted out.
@@ -9,11 +11,84 @@
  *    If the 'morkErrfp' file pointer is NULL no error information will
  *    be printed.
  *
+ *    Input that arrives in pieces can be parsed as it comes in with
+ *    morkParserCreate(), morkParserFeed() for each piece, and then
+ *    morkParserFinish() to get the Mork database.
+ *
+ *    Giving parseMorkFileWithOptions() (or morkParserSetOptions()) a
+ *    list of column names or ids keeps only those columns in the rows.
+ *    The cells of other columns are skipped by the lexer without their
+ *    values being decoded or stored. The dictionaries are kept whole.
+ *    A row filter in the options is asked about each row as it is
+ *    completed and the rows it turns down are freed right away, so a
+ *    selective load only holds the rows it keeps.
+ *
+ *    countMorkFile() runs a file through the lexer only and counts its
+ *    dictionary entries, tables, rows and cells without keeping any of
+ *    them. Setting presize in the options counts the file first and
+ *    then makes the dictionaries and row maps that size as the file is
+ *    parsed, instead of growing them as it goes.
+ *
+ *    openMorkLazyFile() only notes where each dictionary, table and top
+ *    level row of a file is and parses the dictionaries. The rows of a
+ *    table are parsed the first time loadMorkLazyTable() asks for it,
+ *    so a caller that wants one table of a large file (or only the
+ *    dictionaries) does not pay for parsing the rest.
+ *
+ *    A parse normally stops at the first thing it does not expect.
+ *    Setting recover in the options skips from there to the next line
+ *    starting a dictionary, table, row or group and goes on, noting the
+ *    bytes skipped in the Mork database. dumpMorkSkips() writes them
+ *    as JSON Lines.
+ *
  *    The Mork database can be written out using dumpTableScopeMap().
  *    Alternatively dumpMorkValues() or dumpMorkColumns() will write only
  *    the columns or values dictionaries.
  *
  *    The Mork database can be written as vCards using dumpVcards().
+ *    dumpVcardsIncremental() writes only the vCards that changed since
+ *    the last time, keeping row hashes in a file beside the vCards.
+ *
+ *    parseMorkFileWithVcards() writes the vCards on a thread of their
+ *    own as the rows are parsed, instead of after the whole file is in.
+ *
+ *    dumpJsonLines() writes every row as a line of JSON with the column
+ *    names and values.
+ *
+ *    buildMorkDenseRows() adds a slot per column layout to the rows so
+ *    valueForColumnId() is a bit test and an index instead of a search.
+ *
+ *    resolveMorkDb() looks up the column name and value text of every
+ *    cell once so that reading them later with getMorkCellColumn() and
+ *    getMorkCellValue() does not go back to the dictionaries.
+ *
+ *    transposeMorkDb() makes a columnar view of the rows, an array of
+ *    value ids for each column, that can be written as a binary
+ *    columnar file or as CSV.
+ *
+ *    A Mork database that will only be read from now on can be copied
+ *    into a compact read-only form with freezeMorkDb() and the original
+ *    freed. morkDbMemoryUsage() and morkFrozenDbMemoryUsage() report
+ *    how much memory each form uses, and morkDenseMemoryUsage() how
+ *    much of the first is the dense row layout.
+ *
+ *    diffMorkDb() lists the rows added, removed or modified from one
+ *    Mork database to another and dumpMorkDiff() writes that list.
+ *
+ *    mergeMorkFiles() loads several address books in parallel and
+ *    takes out the cards that are in more than one of them (the same
+ *    e-mail address and display name), dumpMorkMergeVcards() writes
+ *    what is left as vCards.
+ *
+ *    makeMorkBloomForDbs() makes a Bloom filter of the e-mail addresses
+ *    in address books that can be saved and asked whether an address
+ *    may be in them with checkMorkBloomEmail(), without the files.
+ *
+ *    serveMorkFiles() keeps address books loaded, follows the changes
+ *    made to them and answers look ups by e-mail or name and requests
+ *    for vCards over a Unix domain socket (see morkServe.c).
+ *
+ *    parseMork.hpp wraps all of this for C++.
  *
  *
  *    Example usage to load the address book and print it as vCards:
@@ -33,6 +108,10 @@
 #ifndef __ParseMork_h__
 #define __ParseMork_h__
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 // Set this to true to just ignore start and end group labels
 extern int morkDoNotParseGroups;
 
@@ -50,67 +129,409 @@ typedef enum {
 	NPRows,
 } nowParsingType;
 
-// Mork dictionary entry records (integer key, string value)
+// Object ids. Mork ids are hex numbers of any length and the message
+// keys of .msf mail summaries do not always fit in an int.
+typedef long long	morkId;
+
+// Size of the blocks read from input streams and files
+#define	MORKREADSIZE	65536
+// Scope of the tables (and their rows) that are not given one
+#define	MORKDEFAULTSCOPE	0x80
+
+// Values shorter than this are kept in their dictionary entry
+#define	MORKINLINEVALUE	16
+// Mork dictionary entry records (integer key, string value). Most
+// values are short and are kept in the entry itself, longer ones are
+// in the dictionary's string pool. morkDictEntryValue() gets either.
 typedef struct {
-	int	key;
-	char	*value;
+	morkId	key;
+	union {
+		char	text[MORKINLINEVALUE];	// A short value, NUL ended
+		struct {
+			char	*text;		// A long value, in the pool
+			char	pad[MORKINLINEVALUE - sizeof(char *) - 1];
+			char	isPooled;	// The last byte of a short value,
+		} pooled;			// which is always 0
+	} value;
 } morkDictEntry;
+#define	morkDictEntryValue(e)	\
+	((e)->value.pooled.isPooled ? (e)->value.pooled.text : (e)->value.text)
+// A block of a dictionary's string pool, the text follows it
+typedef struct morkPoolBlock {
+	struct morkPoolBlock	*next;
+	size_t			used;
+	size_t			size;	// Bytes of text the block holds
+} morkPoolBlock;
 // A Mork dictionary structure
 typedef struct {
 	int		cnt;
-	morkDictEntry	**entries;
+	int		size;		// Allocated length of entries
+	morkDictEntry	*entries;	// Sorted by key
+	morkPoolBlock	*pool;		// The values too long for their entries
+	int		unsorted;	// A bulk load added a key out of order
 } morkDict;
 
 // Mork cell entry records (integer tuples, key and value)
 typedef struct {
-	int	key;
-	int	value;
+	morkId	key;
+	morkId	value;
 } morkCellEntry;
+// A cell's column name and value text (see morkResolve.c)
+typedef struct {
+	const char	*column;
+	const char	*value;
+} morkResolvedCell;
 // A Mork cells structure
 typedef struct {
 	int		cnt;
-	morkCellEntry	**entries;
+	int		size;		// Allocated length of entries
+	morkCellEntry	*entries;
+	unsigned long long *dense;	// Dense layout block (see morkDense.c)
+	morkResolvedCell *resolved;	// Text of each entry, NULL if not resolved
 } morkCells;
 // A Mork row map structure (integer keys and cells values)
 typedef struct {
 	int		cnt;
-	int		*keys;
+	int		size;		// Allocated length of keys and entries
+	morkId		*keys;
 	morkCells	**entries;
 } morkRowMap;
 // A Mork scope map structure (integer keys and row map values)
 typedef struct {
 	int		cnt;
-	int		*keys;
+	int		size;
+	morkId		*keys;
 	morkRowMap	**entries;
 } rowScopeMap;
 // A Mork table map structure (integer keys and row scope map values)
 typedef struct {
 	int		cnt;
-	int		*keys;
+	int		size;
+	morkId		*keys;
 	rowScopeMap	**entries;
 } morkTableMap;
+// Rows counted for one row map by countMorkStream()
+typedef struct {
+	morkId		tableScope;
+	morkId		tableId;
+	morkId		rowScope;
+	long long	rows;
+} morkRowMapCount;
+// What countMorkStream() found in a Mork file
+typedef struct {
+	long long	bytes;
+	long long	columns;	// Column dictionary entries
+	long long	values;		// Value dictionary entries
+	long long	literals;	// Row cells with a literal value
+	long long	tables;
+	long long	rows;
+	long long	cells;		// Row cells
+	int		maxCells;	// Most cells in one row
+	long long	groups;
+	int		rowMapCnt;
+	int		rowMapSize;
+	morkRowMapCount	*rowMaps;
+} morkCounts;
+// Input skipped after an error by a parse that recovers from them
+typedef struct {
+	long long	start;		// Offset of the byte that was not expected
+	long long	end;		// Offset the parse picked up again at
+	const char	*error;		// Where it was: "format" (top level),
+					// "row" or "comment"
+	int		errorChar;	// The byte that was not expected
+	int		groupId;	// Group it was in, -1 if none
+} morkSkip;
+// Slot numbers of the columns for the dense row layout
+typedef struct {
+	morkId		firstColumn;	// Column id of slotOf[0]
+	int		columnRange;	// Length of slotOf
+	int		*slotOf;	// Slot of each column id, -1 if unused
+	int		slotCnt;
+	int		words;		// Bitmap words at the start of a row's block
+} morkSlotMap;
 // A Mork database structure.
 // Includes the column and value dictionaries.
 // Includes the table scope map (integer keys and table map values)
 // Includes internal status parameters for parsing
 typedef struct {
 	int		cnt;		// The number of keys & entries
-	int		*keys;		// Malloc'd array of integers
+	int		size;		// Allocated length of keys & entries
+	morkId		*keys;		// Malloc'd array of ids
 	morkTableMap	**entries;	// Malloc'd array of table map pointers
 	morkDict	*columns;	// Malloc'd column dictionary
 	morkDict	*values;	// Malloc'd value dictionary
 	nowParsingType	nowParsing;	// Parsing state
-	int		nextAddValueId;
-	int		defaultScope;
+	morkId		nextAddValueId;
+	morkId		defaultScope;	// Scope of rows and tables not given one
 	morkCells	*activeCells;
+	morkRowMap	*activeRowMap;	// Row map of the last row set, and
+	morkId		activeTableScope; // its keys, so the rows of a table
+	morkId		activeTableId;	// go straight to it
+	morkId		activeRowScope;
+	morkId		activeRowId;
+	morkSlotMap	*slots;		// Dense row layout, NULL if not built
+	int		resolved;	// Rows' cells may have been resolved
+	int		bulk;		// Appending, not sorted until the load ends
+	long long	dictChanges;	// Dictionary entries given a new value
+	const morkCounts *counts;	// Sizes for new row maps while loading,
+					// NULL to grow them
+	int		skipCnt;	// Input skipped after errors, in
+	int		skipSize;	// file order (morkParseOptions
+	morkSkip	*skips;		// recover)
 } morkDb;
 
+// A frozen dictionary entry (integer key, string pool offset)
+typedef struct {
+	morkId	key;
+	size_t	offset;
+} morkFrozenDictEntry;
+// A frozen map entry, the key and the index and count of its
+// entries in the next level's array. The index can pass an int in a
+// large file, the count is of one map and cannot.
+typedef struct {
+	morkId	key;
+	size_t	first;
+	int	cnt;
+} morkFrozenNode;
+// A frozen (read-only) Mork database. All of it is one block of
+// memory and the arrays refer to each other by index or offset.
+typedef struct {
+	size_t		size;		// Bytes in the whole block
+	int		tableScopeCnt;
+	morkFrozenNode	*tableScopes;	// Entries are in tables
+	size_t		tableCnt;
+	morkFrozenNode	*tables;	// Entries are in rowScopes
+	size_t		rowScopeCnt;
+	morkFrozenNode	*rowScopes;	// Entries are in rows
+	size_t		rowCnt;
+	morkFrozenNode	*rows;		// Entries are in cells
+	size_t		cellCnt;
+	morkCellEntry	*cells;
+	int		columnCnt;
+	morkFrozenDictEntry *columns;	// Sorted by key
+	int		valueCnt;
+	morkFrozenDictEntry *values;	// Sorted by key
+	size_t		stringsSize;
+	char		*strings;	// String pool
+} morkFrozenDb;
+
+// A column of a columnar view, the column's value id for every row
+// (0 where the row does not have it) and a bitmap of the rows that do
+typedef struct {
+	morkId		columnId;
+	morkId		*values;	// Indexed by row
+	unsigned char	*valid;		// Bit (i & 7) of byte (i >> 3) for row i
+	int		validCnt;	// Rows that have the column
+} morkColumn;
+// A columnar view of a Mork database. Rows are numbered in key order
+// and their keys are in the four row arrays.
+typedef struct {
+	int		rowCnt;
+	morkId		*tableScopes;
+	morkId		*tableIds;
+	morkId		*rowScopes;
+	morkId		*rowIds;
+	int		columnCnt;
+	morkColumn	*columns;	// Sorted by column id
+} morkColumnar;
+
+// Kinds of row changes found by diffMorkDb()
+typedef enum {
+	MDAdded,
+	MDRemoved,
+	MDModified,
+} morkDiffType;
+// A changed row, 'a' and 'b' are its cells in the first and second
+// databases (NULL when the row is not in that database)
+typedef struct {
+	morkDiffType	type;
+	morkId		tableScope;
+	morkId		tableId;
+	morkId		rowScope;
+	morkId		rowId;
+	morkCells	*a;
+	morkCells	*b;
+} morkDiffEntry;
+// The list of changed rows, in key order
+typedef struct {
+	int		cnt;
+	int		size;
+	morkDiffEntry	*entries;
+} morkDiff;
+
+// A card kept by a merge, the copies of it that were found, and the
+// database and row it is from
+typedef struct {
+	morkDb		*mork;
+	morkCells	*cells;
+	char		*key;		// Normalized e-mail and display name
+	unsigned long long hash;
+	int		copies;
+} morkMergeEntry;
+// The cards of several databases with the duplicates taken out, in
+// the order they were first found
+typedef struct {
+	int		cnt;
+	int		size;
+	morkMergeEntry	*entries;
+	int		rowCnt;		// Rows looked at
+	int		*table;		// Hash table of entry indexes, -1 if empty
+	int		tableSize;
+	morkDb		**dbs;		// Databases loaded by mergeMorkFiles()
+	int		dbCnt;
+} morkMerge;
+
+// A Bloom filter of e-mail addresses (see morkBloom.c)
+typedef struct {
+	unsigned long long bits;	// Length of the bitmap in bits, a power of two
+	int		hashes;		// Bits set for each address
+	int		cnt;		// Addresses added
+	unsigned char	*bitmap;
+} morkBloom;
+
+// Push parser state (opaque)
+typedef struct morkParser morkParser;
+// A file opened by openMorkLazyFile() (opaque)
+typedef struct morkLazyDb morkLazyDb;
+// A table of a file opened by openMorkLazyFile()
+typedef struct {
+	morkId		tableScope;
+	morkId		tableId;
+	long long	bytes;		// Bytes of the file with its rows
+	int		loaded;		// Its rows have been parsed
+} morkLazyTable;
+
+// Called as each row is completed with its keys and cells (which
+// the dictionaries so far can look up). Returns false to drop the row.
+typedef int (*morkRowFilter)( void *arg, morkDb *mork, morkId tableScope,
+		morkId tableId, morkId rowScope, morkId rowId, morkCells *cells );
+// Called as each row the row filter keeps is completed, or with NULL
+// cells when it drops one. A row given more than once is completed
+// each time. Until a bulk load ends the cells are only the ones given
+// that time and the caller merges them with the row's earlier cells.
+typedef void (*morkRowCallback)( void *arg, morkDb *mork, morkId tableScope,
+		morkId tableId, morkId rowScope, morkId rowId, morkCells *cells );
+// How far a parse has got, as told to the progress callback
+typedef struct {
+	long long	bytes;		// Bytes parsed so far
+	long long	total;		// Bytes in the stream, 0 if not known
+	long long	rows;		// Rows completed so far
+	long long	groups;		// Groups committed so far
+	int		done;		// All the input has been parsed
+} morkProgress;
+// Called every so many bytes or groups as the input is parsed.
+// Returns false to cancel the parse, which then frees what it has
+// parsed and comes back with NULL.
+typedef int (*morkProgressCallback)( void *arg, const morkProgress *progress );
+// Options for parseMorkFileWithOptions() and morkParserSetOptions().
+// Zeroed options parse everything.
+typedef struct {
+	const char	**columns;	// Names of the columns to keep in rows,
+	int		columnCnt;	// none to keep them all
+	const morkId	*columnIds;	// Ids of more columns to keep
+	int		columnIdCnt;
+	morkRowFilter	rowFilter;	// NULL to keep every row
+	void		*rowFilterArg;
+	morkRowCallback	rowComplete;	// NULL for no calls
+	void		*rowCompleteArg;
+	int		presize;	// Count the file first and make the
+					// arrays that size (seekable streams)
+	morkProgressCallback progress;	// NULL for no progress calls
+	void		*progressArg;
+	long long	progressBytes;	// Bytes between calls, 0 for 1 MB
+	int		progressGroups;	// Groups between calls, 0 for none
+	int		recover;	// After an error skip to the next line
+					// starting a top level construct and
+					// go on, noting it in the skips
+} morkParseOptions;
+
 morkDb *parseMorkFile( const char *filename );
 morkDb *parseMorkStream( FILE *ifp );
+morkDb *parseMorkFileWithOptions( const char *filename, const morkParseOptions *options );
+morkDb *parseMorkStreamWithOptions( FILE *ifp, const morkParseOptions *options );
+morkDb *parseMorkFileWithVcards( const char *filename, FILE *ofp, const morkParseOptions *options );
+morkDb *parseMorkStreamWithVcards( FILE *ifp, FILE *ofp, const morkParseOptions *options );
+morkParser *morkParserCreate( void );
+int morkParserSetOptions( morkParser *parser, const morkParseOptions *options );
+int morkParserFeed( morkParser *parser, const char *bytes, size_t len );
+morkDb *morkParserDb( morkParser *parser );
+morkDb *morkParserFinish( morkParser *parser );
+void morkParserFree( morkParser *parser );
 void freeMorkDb( morkDb *mork );
+morkLazyDb *openMorkLazyFile( const char *filename, const morkParseOptions *options );
+morkDb *getMorkLazyDb( morkLazyDb *lazy );
+const morkLazyTable *getMorkLazyTables( morkLazyDb *lazy, int *cnt );
+rowScopeMap *loadMorkLazyTable( morkLazyDb *lazy, morkId tableScope, morkId tableId );
+int loadMorkLazyTables( morkLazyDb *lazy );
+morkDb *finishMorkLazyFile( morkLazyDb *lazy );
+void freeMorkLazyDb( morkLazyDb *lazy );
+int countMorkFile( const char *filename, morkCounts *counts );
+int countMorkStream( FILE *ifp, morkCounts *counts );
+void dumpMorkCounts( FILE *ofp, morkCounts *counts );
+void freeMorkCounts( morkCounts *counts );
 void dumpTableScopeMap( FILE *ofp, morkDb *mork );
 void dumpMorkValues( FILE *ofp, morkDb *mork );
 void dumpMorkColumns( FILE *ofp, morkDb *mork );
 void dumpVcards( FILE *ofp, morkDb *mork );
+int dumpVcardsIncremental( FILE *ofp, FILE *deletedfp, morkDb *mork, const char *hashFileName );
+int dumpJsonLines( FILE *ofp, morkDb *mork );
+int dumpMorkSkips( FILE *ofp, morkDb *mork, const char *source );
+int serveMorkFiles( const char *socketPath, const char **files, int cnt );
+unsigned long long hashMorkCells( morkDb *mork, morkCells *cells );
+char *getValue( morkDb *mork, morkId objectId );
+char *getColumn( morkDb *morkDb, morkId objectId );
+morkId getColumnId( morkDb *morkDb, const char *value );
+char *valueForColumnId( morkId columnId, morkCells *cells, morkDb *morkDb );
+int isMorkCellsVcard( morkDb *morkDb, morkCells *cells );
+void writeMorkCellsAsVcard3_0( FILE *ofp, morkDb *morkDb, morkCells *cells, const char *uid );
+const char *getMorkCellColumn( morkDb *mork, morkCells *cells, int i );
+const char *getMorkCellValue( morkDb *mork, morkCells *cells, int i );
+
+morkFrozenDb *freezeMorkDb( morkDb *mork );
+void freeFrozenMorkDb( morkFrozenDb *frozen );
+size_t morkDbMemoryUsage( morkDb *mork );
+size_t morkDenseMemoryUsage( morkDb *mork );
+size_t morkFrozenDbMemoryUsage( morkFrozenDb *frozen );
+const char *getFrozenMorkValue( morkFrozenDb *frozen, morkId objectId );
+const char *getFrozenMorkColumn( morkFrozenDb *frozen, morkId objectId );
+morkId getFrozenMorkColumnId( morkFrozenDb *frozen, const char *value );
+const morkCellEntry *getFrozenMorkRow( morkFrozenDb *frozen, morkId tableScope,
+		morkId tableId, morkId rowScope, morkId rowId, int *cnt );
+
+int buildMorkDenseRows( morkDb *mork );
+void freeMorkDenseRows( morkDb *mork );
+int findMorkDenseCell( morkDb *mork, morkCells *cells, morkId columnId );
+int getMorkDenseValue( morkDb *mork, morkCells *cells, morkId columnId, morkId *valueId );
+size_t morkDenseRowSize( morkDb *mork, morkCells *cells );
+
+int resolveMorkDb( morkDb *mork );
+void freeMorkResolved( morkDb *mork );
+
+morkColumnar *transposeMorkDb( morkDb *mork );
+void freeMorkColumnar( morkColumnar *columnar );
+morkColumn *getMorkColumnarColumn( morkColumnar *columnar, morkId columnId );
+int writeMorkColumnarFile( FILE *ofp, morkDb *mork, morkColumnar *columnar );
+void dumpMorkColumnarCsv( FILE *ofp, morkDb *mork, morkColumnar *columnar );
+
+morkMerge *mergeMorkDbs( morkDb **dbs, int cnt );
+morkMerge *mergeMorkFiles( const char **filenames, int cnt );
+void dumpMorkMergeVcards( FILE *ofp, morkMerge *merge );
+void freeMorkMerge( morkMerge *merge );
+
+morkBloom *makeMorkBloom( int expected, double falseRate );
+morkBloom *makeMorkBloomForDbs( morkDb **dbs, int cnt, double falseRate );
+void freeMorkBloom( morkBloom *bloom );
+void addMorkBloomEmail( morkBloom *bloom, const char *email );
+int checkMorkBloomEmail( morkBloom *bloom, const char *email );
+int writeMorkBloomFile( FILE *ofp, morkBloom *bloom );
+morkBloom *readMorkBloomFile( FILE *ifp );
+
+morkDiff *diffMorkDb( morkDb *a, morkDb *b );
+void dumpMorkDiff( FILE *ofp, morkDb *a, morkDb *b, morkDiff *diff );
+void freeMorkDiff( morkDiff *diff );
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif // __ParseMork_h__
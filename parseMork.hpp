@@ -0,0 +1,255 @@
+/*-----------------------------------------------------------------------------
+ *    ParseMork.hpp - C++17 interface to the Mork parser
+ *
+ *    A header only wrapper around parseMork.h. mork::Db owns a morkDb
+ *    (it is moved, never copied) and frees it when it goes away. The
+ *    tables, rows and cells can be walked with range for loops and
+ *    the column names and values come back as std::string_view
+ *    pointing into the database, so reading does not allocate or copy.
+ *    The views are good until the database is changed or freed.
+ *
+ *    Example usage to print the e-mail address of every card:
+ *       mork::Db db = mork::Db::parseFile( "abook.mab" );
+ *       if( !db ) return;
+ *       for( mork::Table table : db.tables() )
+ *           for( mork::Row row : table.rows() )
+ *               std::cout << row["PrimaryEmail"] << "\n";
+ *
+ *    Tables are listed in table scope then table id order and the rows
+ *    of a table in row scope then row id order, as dumpTableScopeMap()
+ *    writes them.
+ *
+ ----------------------------------------------------------------------------*/
+#ifndef __ParseMork_hpp__
+#define __ParseMork_hpp__
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstddef>
+#include <iterator>
+#include <string_view>
+#include <utility>
+#include "parseMork.h"
+
+namespace mork {
+
+// A view of a C string, empty for NULL
+inline std::string_view view( const char *s ) {
+	return s ? std::string_view( s ) : std::string_view();
+}
+
+// A cell of a row, its column and value
+class Cell {
+public:
+	Cell( morkDb *db, morkCells *cells, int i ) : db_( db ), cells_( cells ), i_( i ) {}
+	morkId columnId() const { return cells_->entries[i_].key; }
+	morkId valueId() const { return cells_->entries[i_].value; }
+	std::string_view column() const { return view( getMorkCellColumn( db_, cells_, i_ ) ); }
+	std::string_view value() const { return view( getMorkCellValue( db_, cells_, i_ ) ); }
+private:
+	morkDb		*db_;
+	morkCells	*cells_;
+	int		i_;
+};
+
+// Iterator over the cells of a row
+class CellIterator {
+public:
+	using iterator_category = std::forward_iterator_tag;
+	using value_type = Cell;
+	using difference_type = std::ptrdiff_t;
+	using pointer = void;
+	using reference = Cell;
+
+	CellIterator( morkDb *db, morkCells *cells, int i ) : db_( db ), cells_( cells ), i_( i ) {}
+	Cell operator*() const { return Cell( db_, cells_, i_ ); }
+	CellIterator &operator++() { ++i_; return *this; }
+	CellIterator operator++( int ) { CellIterator t = *this; ++i_; return t; }
+	bool operator==( const CellIterator &o ) const { return cells_ == o.cells_ && i_ == o.i_; }
+	bool operator!=( const CellIterator &o ) const { return !(*this == o); }
+private:
+	morkDb		*db_;
+	morkCells	*cells_;
+	int		i_;
+};
+
+// A row of a table, its keys and cells
+class Row {
+public:
+	Row( morkDb *db, morkId tableScope, morkId tableId, morkId rowScope, morkId rowId, morkCells *cells )
+		: db_( db ), tableScope_( tableScope ), tableId_( tableId ),
+		  rowScope_( rowScope ), rowId_( rowId ), cells_( cells ) {}
+	morkId tableScope() const { return tableScope_; }
+	morkId tableId() const { return tableId_; }
+	morkId scope() const { return rowScope_; }
+	morkId id() const { return rowId_; }
+	morkCells *get() const { return cells_; }
+	int size() const { return cells_->cnt; }
+	bool empty() const { return !cells_->cnt; }
+	CellIterator begin() const { return CellIterator( db_, cells_, 0 ); }
+	CellIterator end() const { return CellIterator( db_, cells_, cells_->cnt ); }
+	Cell operator[]( int i ) const { return Cell( db_, cells_, i ); }
+	// The value of a column, empty if the row does not have it
+	std::string_view value( morkId columnId ) const {
+		return view( valueForColumnId( columnId, cells_, db_ ) );
+	}
+	std::string_view operator[]( std::string_view column ) const {
+		for( int i = 0; i < cells_->cnt; ++i ) {
+			if( view( getMorkCellColumn( db_, cells_, i ) ) == column )
+				return view( getMorkCellValue( db_, cells_, i ) );
+		}
+		return std::string_view();
+	}
+private:
+	morkDb		*db_;
+	morkId		tableScope_;
+	morkId		tableId_;
+	morkId		rowScope_;
+	morkId		rowId_;
+	morkCells	*cells_;
+};
+
+// Iterator over the rows of a table, through each of its row scopes
+class RowIterator {
+public:
+	using iterator_category = std::forward_iterator_tag;
+	using value_type = Row;
+	using difference_type = std::ptrdiff_t;
+	using pointer = void;
+	using reference = Row;
+
+	RowIterator( morkDb *db, morkId tableScope, morkId tableId, rowScopeMap *map, int scope )
+		: db_( db ), tableScope_( tableScope ), tableId_( tableId ),
+		  map_( map ), scope_( scope ), row_( 0 ) { skipEmpty(); }
+	Row operator*() const {
+		morkRowMap *rows = map_->entries[scope_];
+		return Row( db_, tableScope_, tableId_, map_->keys[scope_],
+			rows->keys[row_], rows->entries[row_] );
+	}
+	RowIterator &operator++() { ++row_; skipEmpty(); return *this; }
+	RowIterator operator++( int ) { RowIterator t = *this; ++*this; return t; }
+	bool operator==( const RowIterator &o ) const {
+		return map_ == o.map_ && scope_ == o.scope_ && row_ == o.row_;
+	}
+	bool operator!=( const RowIterator &o ) const { return !(*this == o); }
+private:
+	// Moves on to the next row scope when this one is done
+	void skipEmpty() {
+		while( scope_ < map_->cnt && row_ >= map_->entries[scope_]->cnt ) {
+			++scope_;
+			row_ = 0;
+		}
+	}
+	morkDb		*db_;
+	morkId		tableScope_;
+	morkId		tableId_;
+	rowScopeMap	*map_;
+	int		scope_;
+	int		row_;
+};
+
+// A table, its keys and rows
+class Table {
+public:
+	Table( morkDb *db, morkId scope, morkId id, rowScopeMap *map )
+		: db_( db ), scope_( scope ), id_( id ), map_( map ) {}
+	morkId scope() const { return scope_; }
+	morkId id() const { return id_; }
+	rowScopeMap *get() const { return map_; }
+	RowIterator begin() const { return RowIterator( db_, scope_, id_, map_, 0 ); }
+	RowIterator end() const { return RowIterator( db_, scope_, id_, map_, map_->cnt ); }
+	Table rows() const { return *this; }
+private:
+	morkDb		*db_;
+	morkId		scope_;
+	morkId		id_;
+	rowScopeMap	*map_;
+};
+
+// Iterator over the tables of a database, through each table scope
+class TableIterator {
+public:
+	using iterator_category = std::forward_iterator_tag;
+	using value_type = Table;
+	using difference_type = std::ptrdiff_t;
+	using pointer = void;
+	using reference = Table;
+
+	TableIterator( morkDb *db, int scope ) : db_( db ), scope_( scope ), table_( 0 ) { skipEmpty(); }
+	Table operator*() const {
+		morkTableMap *tables = db_->entries[scope_];
+		return Table( db_, db_->keys[scope_], tables->keys[table_], tables->entries[table_] );
+	}
+	TableIterator &operator++() { ++table_; skipEmpty(); return *this; }
+	TableIterator operator++( int ) { TableIterator t = *this; ++*this; return t; }
+	bool operator==( const TableIterator &o ) const {
+		return db_ == o.db_ && scope_ == o.scope_ && table_ == o.table_;
+	}
+	bool operator!=( const TableIterator &o ) const { return !(*this == o); }
+private:
+	// Moves on to the next table scope when this one is done
+	void skipEmpty() {
+		while( db_ && scope_ < db_->cnt && table_ >= db_->entries[scope_]->cnt ) {
+			++scope_;
+			table_ = 0;
+		}
+	}
+	morkDb		*db_;
+	int		scope_;
+	int		table_;
+};
+
+// The tables of a database, for range for
+class Tables {
+public:
+	explicit Tables( morkDb *db ) : db_( db ) {}
+	TableIterator begin() const { return TableIterator( db_, 0 ); }
+	TableIterator end() const { return TableIterator( db_, db_ ? db_->cnt : 0 ); }
+private:
+	morkDb		*db_;
+};
+
+// Owns a Mork database
+class Db {
+public:
+	Db() noexcept : db_( nullptr ) {}
+	// Takes ownership of a database from parseMorkFile() and friends
+	explicit Db( morkDb *db ) noexcept : db_( db ) {}
+	Db( const Db & ) = delete;
+	Db &operator=( const Db & ) = delete;
+	Db( Db &&o ) noexcept : db_( o.release() ) {}
+	Db &operator=( Db &&o ) noexcept {
+		if( this != &o )	reset( o.release() );
+		return *this;
+	}
+	~Db() { reset(); }
+
+	// An empty Db if the file could not be parsed
+	static Db parseFile( const char *filename, const morkParseOptions *options = nullptr ) {
+		return Db( parseMorkFileWithOptions( filename, options ) );
+	}
+	static Db parseStream( FILE *ifp, const morkParseOptions *options = nullptr ) {
+		return Db( parseMorkStreamWithOptions( ifp, options ) );
+	}
+
+	explicit operator bool() const noexcept { return db_ != nullptr; }
+	morkDb *get() const noexcept { return db_; }
+	morkDb *release() noexcept { morkDb *db = db_; db_ = nullptr; return db; }
+	void reset( morkDb *db = nullptr ) noexcept {
+		if( db_ ) {
+			freeMorkDb( db_ );
+			std::free( db_ );
+		}
+		db_ = db;
+	}
+
+	Tables tables() const { return Tables( db_ ); }
+	std::string_view column( morkId columnId ) const { return view( getColumn( db_, columnId ) ); }
+	std::string_view value( morkId valueId ) const { return view( getValue( db_, valueId ) ); }
+private:
+	morkDb		*db_;
+};
+
+} // namespace mork
+
+#endif // __ParseMork_hpp__
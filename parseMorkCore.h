@@ -0,0 +1,421 @@
+/*-----------------------------------------------------------------------------
+ *    ParseMorkCore.h - The token handling of the Mork parser
+ *
+ *    Not a header to include anywhere else. parseMork.c includes it
+ *    twice, once with MORKCORELOG set to 0 and once with it set to 1,
+ *    to build each function here with and without logging. The names
+ *    get "Quiet" or "Logged" put on the end. In the Quiet functions
+ *    morkCoreLog() is nothing at all, so the loops that handle every
+ *    token and cell do no test of morkLogfp and have no fprintf()
+ *    calls in them. Groups are handled by parseMorkToken() and ignored
+ *    by parseMorkTokenNoGroups(), so morkDoNotParseGroups is not tested
+ *    for each token either. morkParserCreate() picks the handler for
+ *    the logging and group handling wanted.
+ *
+ ----------------------------------------------------------------------------*/
+#if MORKCORELOG
+#define	MORKCORE(name)		name##Logged
+#define	morkCoreLog(...)	morkLog( __VA_ARGS__ )
+#else
+#define	MORKCORE(name)		name##Quiet
+#define	morkCoreLog(...)	((void) 0)
+#endif
+
+static int MORKCORE(parseMorkTokenNoGroups)( void *arg, const morkToken *token );
+static int MORKCORE(parseMorkToken)( void *arg, const morkToken *token );
+static int MORKCORE(replayMorkTokens)( morkParser *p );
+static int MORKCORE(applyMorkToken)( morkParser *p, const morkToken *token );
+static void MORKCORE(storeMorkCellToken)( morkDb *m, const morkToken *token );
+static void MORKCORE(setCurrentRow)( morkDb *m, morkId TableScope, morkId TableId, morkId RowScope, morkId RowId );
+static void MORKCORE(parseScopeId)( const char *textId, morkId *id, morkId *scope );
+static void MORKCORE(storeInMorkDict)( morkDb *m, morkDict *dict, morkId key, const char *value );
+static void MORKCORE(storeInMorkCell)( morkCells *cells, morkId key, morkId value );
+static void MORKCORE(storeRowCell)( morkDb *m, morkId key, morkId value );
+
+// Token handler for morkDoNotParseGroups, the group markers are
+// ignored and everything in a group is applied as it comes
+static int MORKCORE(parseMorkTokenNoGroups)( void *arg, const morkToken *token ) {
+	morkParser *p = (morkParser *) arg;
+
+	if( p->wantNames )	noteMorkWantedColumn( p, token );
+
+	switch( token->type ) {
+	case MTGroupStart:
+	case MTGroupCommit:
+	case MTGroupAbort:
+		morkCoreLog( "    - Ignoring group marker \"%s\"\n", token->text );
+		return true;
+	case MTSkipped:
+		noteMorkSkip( p, token );
+		return true;
+	default:
+		return MORKCORE(applyMorkToken)( p, token );
+	}
+}
+// Token handler that holds back the tokens of each group
+static int MORKCORE(parseMorkToken)( void *arg, const morkToken *token ) {
+	morkParser *p = (morkParser *) arg;
+
+	if( p->wantNames )	noteMorkWantedColumn( p, token );
+
+	switch( token->type ) {
+	case MTGroupStart:
+		if( p->inGroup ) {
+			morkErr( "Something's corrupt because group %d started "
+				 "inside of group %d\n", token->id, p->groupId );
+			morkCoreLog( "  . Group %d never ended... trashing contents\n",
+				 p->groupId );
+			p->group.cnt = 0;
+			p->group.textLen = 0;
+		}
+		morkCoreLog( "    + Got the group header with group id of %d\n",
+			token->id );
+		p->inGroup = true;
+		p->groupId = token->id;
+		return true;
+	case MTGroupCommit:
+		if( !p->inGroup ) {
+			morkCoreLog( "    - Group %d end without a start\n", token->id );
+			return true;
+		}
+		p->inGroup = false;
+		if( token->id != p->groupId ) {
+			morkErr( "Something's corrupt because the start group ID "
+				 "is %d and the end group ID is %d\n",
+				 p->groupId, token->id );
+			morkCoreLog( "  . Start  and end Id's don't match... "
+				 "trashing the contents\n" );
+			p->group.cnt = 0;
+			p->group.textLen = 0;
+			return true;
+		}
+		morkCoreLog( "  . Found a good unaborted group %d... "
+			 "loading contents\n", token->id );
+		if( !MORKCORE(replayMorkTokens)( p ) )	return false;
+		p->done.groups++;
+		if( p->progressGroups && p->done.groups % p->progressGroups == 0 )
+			return reportMorkProgress( p );
+		return true;
+	case MTGroupAbort:
+		if( !p->inGroup ) {
+			morkCoreLog( "    - Group %d abort without a start\n", token->id );
+			return true;
+		}
+		p->inGroup = false;
+		if( token->id < 0 ) {
+			morkErr( "Something was corrupt in the group footer?\n" );
+			morkCoreLog( "  . Something was wrong... trashing contents\n" );
+		} else {
+			morkCoreLog( "  . Found a good group but it was aborted... "
+				 "trashing contents\n" );
+		}
+		p->group.cnt = 0;
+		p->group.textLen = 0;
+		return true;
+	case MTSkipped:
+		noteMorkSkip( p, token );
+		return true;
+	default:
+		if( p->inGroup ) {
+			queueMorkToken( &p->group, token );
+			return true;
+		}
+		return MORKCORE(applyMorkToken)( p, token );
+	}
+}
+// Apply all the held back tokens of a committed group
+static int MORKCORE(replayMorkTokens)( morkParser *p ) {
+	morkTokenQueue *q = &p->group;
+	morkToken token;
+	bool result = true;
+	int i;
+	for( i = 0; result && i < q->cnt; ++i ) {
+		token.type = q->entries[i].type;
+		token.flags = q->entries[i].flags;
+		token.id = q->entries[i].id;
+		token.text = q->text + q->entries[i].textOff;
+		token.textLen = q->entries[i].textLen;
+		token.value = q->text + q->entries[i].valueOff;
+		token.valueLen = q->entries[i].valueLen;
+		result = MORKCORE(applyMorkToken)( p, &token );
+	}
+	q->cnt = 0;
+	q->textLen = 0;
+	return result;
+}
+static int MORKCORE(applyMorkToken)( morkParser *p, const morkToken *token ) {
+	morkDb *m = p->mork;
+	morkId id = 0, scope = 0;
+
+	switch( token->type ) {
+	case MTDictOpen:
+		morkCoreLog( "Dictionary start\n" );
+		m->nowParsing = NPValues;
+		break;
+	case MTDictMeta:
+		// Only the column dictionary meta means anything to us
+		if( token->textLen == strlen( MorkDictColumnMeta ) - 2 &&
+		    strncmp( token->text, MorkDictColumnMeta + 1, token->textLen ) == 0 ) {
+			m->nowParsing = NPColumns;
+		} else {
+			morkErr( "error: thought we were getting a dictionary but found \"<%s>\" instead of \"%s\"\n", token->text, MorkDictColumnMeta );
+		}
+		break;
+	case MTDictClose:
+		morkCoreLog( "-- Dictionary end\n" );
+		break;
+	case MTCell:
+		MORKCORE(storeMorkCellToken)( m, token );
+		break;
+	case MTTableOpen:
+		morkCoreLog( "Table start\n" );
+		p->tableId = 0;
+		p->tableScope = 0;
+		MORKCORE(parseScopeId)( token->text, &p->tableId, &p->tableScope );
+		break;
+	case MTTableClose:
+		morkCoreLog( "-- Table end\n" );
+		p->tableId = 0;
+		p->tableScope = 0;
+		break;
+	case MTOid:
+		MORKCORE(parseScopeId)( token->text, &id, &scope );
+		MORKCORE(setCurrentRow)( m, p->tableScope, p->tableId, scope, id );
+		// A row given by id is complete as it is
+		if( p->rowFilter )	filterMorkRow( p, m->nextAddValueId );
+		if( p->rowComplete )	completeMorkRow( p );
+		p->done.rows++;
+		break;
+	case MTRowOpen:
+		morkCoreLog( "  Row start\n" );
+		m->nowParsing = NPRows;
+		// Figure out the row scope and row ID and set it
+		MORKCORE(parseScopeId)( token->text, &id, &scope );
+		MORKCORE(setCurrentRow)( m, p->tableScope, p->tableId, scope, id );
+		p->rowFirstValueId = m->nextAddValueId;
+		p->rowOpen = true;
+		break;
+	case MTRowClose:
+		morkCoreLog( "  -- Row end\n" );
+		if( m->bulk )	sortMorkBulkCells( m->activeCells );
+		trimMorkCells( m->activeCells );
+		p->rowOpen = false;
+		if( p->rowFilter )	filterMorkRow( p, p->rowFirstValueId );
+		if( p->rowComplete )	completeMorkRow( p );
+		p->done.rows++;
+		break;
+	case MTTableMeta:
+	case MTRowMeta:
+	case MTMeta:
+		morkCoreLog( "    - Ignoring meta \"%s\"\n", token->text );
+		break;
+	case MTComment:
+		morkCoreLog( "  Comment => \"%s\"\n", token->text );
+		break;
+	default:
+		break;
+	}
+	return true;
+}
+// Apply a cell to the dictionary or row being parsed
+static void MORKCORE(storeMorkCellToken)( morkDb *m, const morkToken *token ) {
+#if MORKCORELOG
+	bool columnIsObjectId = token->flags & MTFColumnOid;
+#endif
+	bool valueIsObjectId = token->flags & MTFValueOid;
+
+	morkCoreLog( "  .  Cell => %s%s%s%s\n", columnIsObjectId ? "^" : "",
+		token->text, valueIsObjectId ? "^" : "=", token->value );
+
+	// Apply column and text
+	morkId columnId = strtoll( token->text, (char **) NULL, 16 );
+
+	// If the text field is not empty
+	if( '\0' != token->value[0] ) {
+		if( NPRows == m->nowParsing ) {
+			// Rows
+			if( valueIsObjectId  ) {
+				morkId valueId = strtoll( token->value, (char **) NULL, 16 );
+				MORKCORE(storeRowCell)( m, columnId, valueId );
+			} else {
+				MORKCORE(storeInMorkDict)( m, m->values,
+					m->nextAddValueId, token->value );
+				MORKCORE(storeRowCell)( m, columnId, m->nextAddValueId++ );
+			}
+		} else {
+			// Dicts
+			if( NPColumns == m->nowParsing ) {
+				MORKCORE(storeInMorkDict)( m, m->columns, columnId, token->value );
+			} else {
+				MORKCORE(storeInMorkDict)( m, m->values, columnId, token->value );
+			}
+		}
+	//} else {
+	//	// If the text is empty I should probably be removing
+	//	// any previously set cell for the column...
+	//	// If nothing previously set, then just doing nothing
+	//	// is fine.
+	}
+}
+static void MORKCORE(setCurrentRow)( morkDb *m, morkId TableScope, morkId TableId, morkId RowScope, morkId RowId ) {
+	if( !TableScope ) TableScope = m->defaultScope;
+	// A row without a scope of its own is in its table's scope
+	if( !RowScope )	  RowScope = TableScope;
+
+	morkCoreLog( "  Setting active cells to Table ID %lld in TableScope "
+		 "%lld and Row ID %lld in Row Scope %lld\n",
+		 TableId, TableScope, RowId, RowScope );
+	// Rows mostly come one after another in the same table and scope,
+	// so the row map used last time is kept instead of looking it up
+	if( !m->activeRowMap || TableScope != m->activeTableScope ||
+	    TableId != m->activeTableId || RowScope != m->activeRowScope ) {
+		morkTableMap *tableMap = getMorkTableMapEntry( m, TableScope );
+		rowScopeMap *rowScopeMap = getRowScopeMapEntry( m, tableMap, TableId );
+		m->activeRowMap = getMorkRowMap( rowScopeMap, RowScope );
+		if( m->counts && !m->activeRowMap->size ) {
+			presizeMorkRowMap( m->activeRowMap, m->counts,
+				TableScope, TableId, RowScope );
+		}
+		m->activeTableScope = TableScope;
+		m->activeTableId = TableId;
+		m->activeRowScope = RowScope;
+	}
+	m->activeRowId = RowId;
+	if( m->bulk ) {
+		m->activeCells = appendMorkCells( m->activeRowMap, RowId );
+	} else {
+		m->activeCells = getMorkCells( m->activeRowMap, RowId );
+	}
+}
+// Ids are "id" or "id:scope" where the scope may be given as "^scope"
+static void MORKCORE(parseScopeId)( const char *textId, morkId *id, morkId *scope ) {
+	morkCoreLog( "  Entering parseScopeId( \"%s\" ) => ", textId );
+
+	const char *colonPos = strchr( textId, ':' );
+	if( colonPos ) {
+		// Move past the colon
+		++colonPos;
+
+		if( *colonPos && '^' == *colonPos ) {
+			// Skip '^'
+			// --- but what does the '^' mean?
+			++colonPos;
+		}
+		*scope = strtoll( colonPos, (char **) NULL, 16 );
+		morkCoreLog( "scope %lld for ", *scope );
+	}
+	*id = strtoll( textId, (char **) NULL, 16 );
+	morkCoreLog( "id %lld\n", *id );
+}
+static void MORKCORE(storeInMorkDict)( morkDb *m, morkDict *dict, morkId key, const char *value ) {
+	int i, lo, hi;
+#if MORKCORELOG
+	char *dictName = "unknown";
+	if( dict == m->columns ) {
+		dictName = "columns";
+	} else if( dict == m->values ) {
+		dictName = "values";
+	}
+#endif
+	morkCoreLog( "     Setting %s dictionary key %3lld/%2llX to \"%s\"\n", dictName, key, key, value );
+	// Resolved cells may point at the entry being replaced
+	if( m->resolved )	freeMorkResolved( m );
+	// A bulk load sorts the dictionary at the end
+	if( m->bulk ) {
+		if( dict->cnt >= dict->size ) {
+			dict->size = dict->size ? dict->size * 2 : 16;
+			dict->entries = realloc( dict->entries, dict->size * sizeof(*(dict->entries)) );
+		}
+		if( dict->cnt && key <= dict->entries[dict->cnt-1].key )	dict->unsorted = 1;
+		setMorkDictEntry( dict, &dict->entries[dict->cnt++], key, value );
+		return;
+	}
+	// Keys mostly arrive in order so check the end before searching
+	if( !dict->cnt || key > dict->entries[dict->cnt-1].key ) {
+		i = dict->cnt;
+	} else {
+		lo = 0;
+		hi = dict->cnt;
+		while( lo < hi ) {
+			int mid = lo + (hi - lo) / 2;
+			if( dict->entries[mid].key < key )	lo = mid + 1;
+			else					hi = mid;
+		}
+		i = lo;
+	}
+	//morkCoreLog( "   This will be at position %d of %d in the dictionary\n", i, dict->cnt );
+	if( i >= dict->cnt || key != dict->entries[i].key ) {
+		if( dict->cnt >= dict->size ) {
+			dict->size = dict->size ? dict->size * 2 : 16;
+			dict->entries = realloc( dict->entries, dict->size * sizeof(*(dict->entries)) );
+		}
+		memmove( dict->entries + i + 1, dict->entries + i,
+			(dict->cnt - i) * sizeof(*(dict->entries)) );
+		++dict->cnt;
+	} else {
+		morkCoreLog( "     - Changing %3lld/%2llX from \"%s\" to \"%s\"\n", key, key, morkDictEntryValue( &dict->entries[i] ), value );
+		m->dictChanges++;
+	}
+	//morkCoreLog( "   Putting the entry at %d with the size now %d\n", i, dict->cnt );
+	setMorkDictEntry( dict, &dict->entries[i], key, value );
+}
+static void MORKCORE(storeInMorkCell)( morkCells *cells, morkId key, morkId value ) {
+	int i;
+	morkCoreLog( "     Setting cell with key %3lld/%2llX to %lld/%llX\n", key, key, value, value );
+	// A changed row goes back to being searched
+	free( cells->dense );
+	cells->dense = NULL;
+	free( cells->resolved );
+	cells->resolved = NULL;
+	for( i = 0; i < cells->cnt; ++i ) {
+		if( key <= cells->entries[i].key ) {
+			break;
+		}
+	}
+	//morkCoreLog( "   This will be at position %d of %d in the dictionary\n",
+	//	i, cells->cnt );
+	if( i >= cells->cnt || key != cells->entries[i].key ) {
+		if( cells->cnt >= cells->size ) {
+			cells->size = cells->size ? cells->size * 2 : 8;
+			cells->entries = realloc( cells->entries, cells->size * sizeof(*(cells->entries)) );
+		}
+		memmove( cells->entries + i + 1, cells->entries + i,
+			(cells->cnt - i) * sizeof(*(cells->entries)) );
+		++cells->cnt;
+	} else if( cells->entries[i].value != value ) {
+		morkCoreLog( "     - Changing cell %3lld/%2llX from %lld/%llX to %lld/%llX\n",
+			key, key, cells->entries[i].value,
+			cells->entries[i].value, value, value );
+	}
+	//morkCoreLog( "   Putting the entry at %d with the size now %d\n",
+	//	i, cells->cnt );
+	cells->entries[i].key = key;
+	cells->entries[i].value = value;
+}
+// A cell of the row being parsed. A bulk load appends the cells and
+// sorts them when the row ends, instead of searching and moving the
+// row's cells for each one. Logging still searches, so the log shows
+// the cells a row changes.
+static void MORKCORE(storeRowCell)( morkDb *m, morkId key, morkId value ) {
+	morkCells *cells = m->activeCells;
+	if( !m->bulk || MORKCORELOG ) {
+		MORKCORE(storeInMorkCell)( cells, key, value );
+		return;
+	}
+	if( cells->dense || cells->resolved ) {
+		free( cells->dense );
+		cells->dense = NULL;
+		free( cells->resolved );
+		cells->resolved = NULL;
+	}
+	if( cells->cnt >= cells->size ) {
+		cells->size = cells->size ? cells->size * 2 : 8;
+		cells->entries = realloc( cells->entries, cells->size * sizeof(*(cells->entries)) );
+	}
+	cells->entries[cells->cnt].key = key;
+	cells->entries[cells->cnt].value = value;
+	++cells->cnt;
+}
+
+#undef	MORKCORE
+#undef	morkCoreLog
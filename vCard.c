@@ -1,5 +1,8 @@
 #include <string.h>
 #include <stdio.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 char *vCardEscapeString( char *dst, const char *src, size_t n ) {
 	if( !dst ) return dst;
 	if( !src ) {
@@ -41,3 +44,150 @@ char *vCardEscapeString( char *dst, const char *src, size_t n ) {
 	while( i++ < n )	*dp++ = '\0';
 	return dst;
 }
+
+// vCard 2.1 text that is not plain ASCII has to be sent with its
+// charset and quoted-printable encoded. The checks and the encoder
+// look at 16 bytes at a time with SSE2 where it is available.
+
+// Whether the text is all 7 bit ASCII
+int vCardIsAscii( const char *str, size_t n ) {
+	const unsigned char *s = (const unsigned char *) str;
+	size_t i = 0;
+#ifdef __SSE2__
+	for( ; i + 16 <= n; i += 16 ) {
+		if( _mm_movemask_epi8( _mm_loadu_si128( (const __m128i *) (s + i) ) ) )
+			return 0;
+	}
+#endif
+	for( ; i < n; ++i ) {
+		if( s[i] & 0x80 )	return 0;
+	}
+	return 1;
+}
+// Whether the text is valid UTF-8 (no overlong forms or surrogates).
+// Runs of ASCII are skipped a block at a time.
+int vCardIsUtf8( const char *str, size_t n ) {
+	const unsigned char *s = (const unsigned char *) str;
+	const unsigned char *end = s + n;
+	while( s < end ) {
+		unsigned int c, min;
+		int len, i;
+#ifdef __SSE2__
+		while( end - s >= 16 &&
+		       !_mm_movemask_epi8( _mm_loadu_si128( (const __m128i *) s ) ) )
+			s += 16;
+		if( s >= end )	break;
+#endif
+		if( *s < 0x80 ) {
+			++s;
+			continue;
+		}
+		if( (*s & 0xe0) == 0xc0 ) {
+			len = 2; c = *s & 0x1f; min = 0x80;
+		} else if( (*s & 0xf0) == 0xe0 ) {
+			len = 3; c = *s & 0x0f; min = 0x800;
+		} else if( (*s & 0xf8) == 0xf0 ) {
+			len = 4; c = *s & 0x07; min = 0x10000;
+		} else {
+			return 0;
+		}
+		if( end - s < len )	return 0;
+		for( i = 1; i < len; ++i ) {
+			if( (s[i] & 0xc0) != 0x80 )	return 0;
+			c = (c << 6) | (s[i] & 0x3f);
+		}
+		if( c < min || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff) )
+			return 0;
+		s += len;
+	}
+	return 1;
+}
+// Length of the run of bytes at the start of the text that
+// quoted-printable leaves as they are (printable ASCII but '=')
+static size_t vCardQpSafeRun( const unsigned char *s, size_t n ) {
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i space = _mm_set1_epi8( 0x1f );
+	const __m128i del = _mm_set1_epi8( 0x7f );
+	const __m128i eq = _mm_set1_epi8( '=' );
+	for( ; i + 16 <= n; i += 16 ) {
+		__m128i x = _mm_loadu_si128( (const __m128i *) (s + i) );
+		// Bytes above 0x7f are negative so fail the signed compare
+		__m128i bad = _mm_or_si128( _mm_cmpeq_epi8( x, del ), _mm_cmpeq_epi8( x, eq ) );
+		int safe = _mm_movemask_epi8( _mm_andnot_si128( bad, _mm_cmpgt_epi8( x, space ) ) );
+		if( safe != 0xffff )
+			return i + __builtin_ctz( ~safe );
+	}
+#endif
+	for( ; i < n; ++i ) {
+		if( s[i] < 0x20 || s[i] > 0x7e || s[i] == '=' )	break;
+	}
+	return i;
+}
+// Writes the text quoted-printable encoded. The line starts at column
+// col and soft line breaks keep the lines to 76 characters.
+void vCardWriteQuotedPrintable( FILE *ofp, const char *str, size_t n, int col ) {
+	static const char hex[] = "0123456789ABCDEF";
+	const unsigned char *s = (const unsigned char *) str;
+	size_t i = 0;
+	while( i < n ) {
+		size_t run = vCardQpSafeRun( s + i, n - i );
+		// A space at the end of a line has to be encoded
+		if( run && i + run == n && s[n-1] == ' ' )	--run;
+		while( run ) {
+			size_t room = 75 - col;
+			if( !room ) {
+				fputs( "=\n", ofp );
+				col = 0;
+				continue;
+			}
+			if( room > run )	room = run;
+			fwrite( s + i, 1, room, ofp );
+			col += room;
+			i += room;
+			run -= room;
+		}
+		if( i >= n )	break;
+		if( col + 3 > 75 ) {
+			fputs( "=\n", ofp );
+			col = 0;
+		}
+		putc( '=', ofp );
+		putc( hex[s[i] >> 4], ofp );
+		putc( hex[s[i] & 0xf], ofp );
+		col += 3;
+		++i;
+	}
+}
+// Writes a vCard 2.1 card made up of "NAME:text" lines. Lines with
+// text that is not ASCII get CHARSET and ENCODING parameters, UTF-8
+// when the text is valid UTF-8 and ISO-8859-1 (what older address
+// books hold) when it is not. A card that is all ASCII is written as
+// it is.
+void vCardWrite2_1( FILE *ofp, const char *card, size_t n ) {
+	if( vCardIsAscii( card, n ) ) {
+		fwrite( card, 1, n, ofp );
+		return;
+	}
+	while( n ) {
+		const char *eol = memchr( card, '\n', n );
+		size_t len = eol ? (size_t) (eol - card) + 1 : n;
+		size_t textLen = eol ? len - 1 : len;
+		const char *colon = memchr( card, ':', textLen );
+		if( !colon || vCardIsAscii( card, textLen ) ) {
+			fwrite( card, 1, len, ofp );
+		} else {
+			const char *text = colon + 1;
+			size_t nameLen = colon - card;
+			size_t valueLen = textLen - nameLen - 1;
+			int col;
+			fwrite( card, 1, nameLen, ofp );
+			col = nameLen + fprintf( ofp, ";CHARSET=%s;ENCODING=QUOTED-PRINTABLE:",
+				vCardIsUtf8( text, valueLen ) ? "UTF-8" : "ISO-8859-1" );
+			vCardWriteQuotedPrintable( ofp, text, valueLen, col );
+			if( eol )	putc( '\n', ofp );
+		}
+		card += len;
+		n -= len;
+	}
+}
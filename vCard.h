@@ -1,2 +1,6 @@
 
 char *vCardEscapeString( char *dst, const char *src, size_t n );
+int vCardIsAscii( const char *str, size_t n );
+int vCardIsUtf8( const char *str, size_t n );
+void vCardWriteQuotedPrintable( FILE *ofp, const char *str, size_t n, int col );
+void vCardWrite2_1( FILE *ofp, const char *card, size_t n );